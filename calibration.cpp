@@ -0,0 +1,344 @@
+/**
+ * Master calibration frames of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "calibration.h"
+#include "frame_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fitsio.h>
+
+/* File layout: this header, then width * height native floats. The header is
+ * 64 bytes so the samples stay aligned in the mapping. */
+struct MasterFileHeader
+{
+    char magic[8];
+    MasterKey key;
+    uint8_t reserved[64 - 8 - sizeof(MasterKey)];
+};
+
+static const char MASTER_MAGIC[8] = { 'P', 'G', 'M', 'A', 'S', 'T', 'R', '1' };
+
+static const char *typeName(uint32_t type)
+{
+    switch (type)
+    {
+        case MASTER_BIAS:
+            return "bias";
+        case MASTER_DARK:
+            return "dark";
+        default:
+            return "flat";
+    }
+}
+
+static const char *imageType(uint32_t type)
+{
+    switch (type)
+    {
+        case MASTER_BIAS:
+            return "Bias Frame";
+        case MASTER_DARK:
+            return "Dark Frame";
+        default:
+            return "Flat Field";
+    }
+}
+
+/* The FITS copy holds what other software expects: ADU for biases and darks,
+ * the normalised flat rather than its reciprocal for flats. */
+static bool writeFITS(const std::string &path, const MasterKey &key, const float *data, const char *combine)
+{
+    fitsfile *fptr = NULL;
+    long naxes[2] = { (long)key.width, (long)key.height };
+    size_t n = (size_t)key.width * key.height;
+    std::vector<float> flat;
+    double exposure = key.exposure, gain = key.gain, temperature = key.temperature;
+    long frames = key.frames, bin = key.bin, x = key.x, y = key.y;
+    int status = 0;
+
+    if (key.type == MASTER_FLAT)
+    {
+        flat.resize(n);
+        for (size_t i = 0; i < n; i++)
+            flat[i] = 1.0f / data[i];
+        data = &flat[0];
+    }
+
+    // A leading ! makes cfitsio replace an existing file
+    fits_create_file(&fptr, ("!" + path).c_str(), &status);
+    fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+    fits_update_key(fptr, TSTRING, "IMAGETYP", (void *)imageType(key.type), "Master calibration frame", &status);
+    fits_update_key(fptr, TDOUBLE, "EXPTIME", &exposure, "Total Exposure Time (s)", &status);
+    fits_update_key(fptr, TDOUBLE, "GAIN", &gain, "Gain", &status);
+    if (!isnan(key.temperature))
+        fits_update_key(fptr, TDOUBLE, "CCD-TEMP", &temperature, "CCD Temperature (Celsius)", &status);
+    fits_update_key(fptr, TLONG, "XBINNING", &bin, "Binning factor in width", &status);
+    fits_update_key(fptr, TLONG, "YBINNING", &bin, "Binning factor in height", &status);
+    fits_update_key(fptr, TLONG, "XORGSUBF", &x, "Subframe X position in binned pixels", &status);
+    fits_update_key(fptr, TLONG, "YORGSUBF", &y, "Subframe Y position in binned pixels", &status);
+    fits_update_key(fptr, TLONG, "NCOMBINE", &frames, "Frames combined", &status);
+    fits_update_key(fptr, TSTRING, "COMBINE", (void *)combine, "Combine method", &status);
+    fits_write_img(fptr, TFLOAT, 1, n, (void *)data, &status);
+    fits_close_file(fptr, &status);
+
+    return status == 0;
+}
+
+MasterFrame::~MasterFrame()
+{
+    if (mapping)
+        munmap(mapping, mappedBytes);
+}
+
+std::unique_ptr<MasterFrame> MasterFrame::map(const std::string &path)
+{
+    std::unique_ptr<MasterFrame> master;
+    const MasterFileHeader *header;
+    struct stat st;
+    void *mapping;
+    int fd;
+
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return master;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MasterFileHeader))
+    {
+        ::close(fd);
+        return master;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+        return master;
+
+    header = (const MasterFileHeader *)mapping;
+    if (memcmp(header->magic, MASTER_MAGIC, sizeof(MASTER_MAGIC)) ||
+            (size_t)st.st_size != sizeof(MasterFileHeader) + (size_t)header->key.width * header->key.height * sizeof(float))
+    {
+        munmap(mapping, st.st_size);
+        return master;
+    }
+
+    master.reset(new MasterFrame());
+    master->key = header->key;
+    master->path = path;
+    master->data = (const float *)(header + 1);
+    master->mapping = mapping;
+    master->mappedBytes = st.st_size;
+    return master;
+}
+
+std::string MasterFrame::describe() const
+{
+    char text[128];
+
+    if (key.type == MASTER_FLAT)
+        snprintf(text, sizeof(text), "flat %ux%u bin %u, %u frames", key.width, key.height, key.bin, key.frames);
+    else if (isnan(key.temperature))
+        snprintf(text, sizeof(text), "%s %.3f s gain %.2f, %u frames", typeName(key.type), key.exposure, key.gain, key.frames);
+    else
+        snprintf(text, sizeof(text), "%s %.3f s gain %.2f at %.1f C, %u frames", typeName(key.type), key.exposure, key.gain,
+                 key.temperature, key.frames);
+    return text;
+}
+
+void CalibrationLibrary::open(uint64_t guid)
+{
+    char name[64];
+    const char *home = getenv("HOME");
+    DIR *d;
+    struct dirent *entry;
+
+    close();
+
+    snprintf(name, sizeof(name), "/dc1394_pgrey_%016llx_masters", (unsigned long long)guid);
+    dir = std::string(home ? home : "/tmp") + "/.indi" + name;
+
+    d = opendir(dir.c_str());
+    if (!d)
+        return;
+    while ((entry = readdir(d)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (len < 7 || strcmp(entry->d_name + len - 7, ".master"))
+            continue;
+        std::unique_ptr<MasterFrame> master = MasterFrame::map(dir + "/" + entry->d_name);
+        if (master)
+            masters.push_back(std::move(master));
+    }
+    closedir(d);
+}
+
+void CalibrationLibrary::close()
+{
+    masters.clear();
+}
+
+const MasterFrame *CalibrationLibrary::store(const MasterKey &key, const float *data, const char *combine, std::string &warning)
+{
+    MasterFileHeader header;
+    char name[160];
+    char temp[16];
+    std::string path, tmp;
+    size_t bytes = (size_t)key.width * key.height * sizeof(float);
+    FILE *fp;
+    bool ok;
+
+    warning.clear();
+    if (dir.empty())
+        return NULL;
+
+    if (isnan(key.temperature))
+        strcpy(temp, "na");
+    else
+        snprintf(temp, sizeof(temp), "%.0f", key.temperature);
+    // Same settings give the same name, so a new master replaces the old one
+    snprintf(name, sizeof(name), "/%s_b%u_%ux%u+%u+%u_%ubit_g%.2f_e%.3f_t%s.master", typeName(key.type), key.bin, key.width,
+             key.height, key.x, key.y, key.bpp, key.gain, key.type == MASTER_DARK ? key.exposure : 0.0f, temp);
+    path = dir + name;
+    tmp = path + ".tmp";
+
+    mkdir((dir.substr(0, dir.rfind('/'))).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MASTER_MAGIC, sizeof(MASTER_MAGIC));
+    header.key = key;
+
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+        return NULL;
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(data, 1, bytes, fp) == bytes;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+        return NULL;
+    }
+
+    for (size_t i = 0; i < masters.size(); i++)
+    {
+        if (masters[i]->path == path)
+        {
+            masters.erase(masters.begin() + i);
+            break;
+        }
+    }
+
+    // The mapped file is what the driver uses, a failed copy only gets a warning
+    if (!writeFITS(path.substr(0, path.size() - 7) + ".fits", key, data, combine))
+        warning = "Could not write FITS copy of " + path;
+
+    std::unique_ptr<MasterFrame> master = MasterFrame::map(path);
+    if (!master)
+        return NULL;
+    masters.push_back(std::move(master));
+    return masters.back().get();
+}
+
+const MasterFrame *CalibrationLibrary::findDark(uint32_t bpp, uint32_t bin, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+        float gain, float exposure, float temperature) const
+{
+    const MasterFrame *dark = NULL, *bias = NULL;
+    float darkScore = 0, biasScore = 0;
+
+    for (size_t i = 0; i < masters.size(); i++)
+    {
+        const MasterFrame *m = masters[i].get();
+        float score;
+
+        if (m->key.type == MASTER_FLAT || m->key.bpp != bpp || m->key.bin != bin || !m->covers(x, y, w, h) ||
+                fabsf(m->key.gain - gain) > 0.05f)
+            continue;
+
+        // Closer in temperature is better; unknown temperatures count as a 5 C miss
+        score = (isnan(m->key.temperature) || isnan(temperature)) ? 5.0f : fabsf(m->key.temperature - temperature);
+
+        if (m->key.type == MASTER_BIAS)
+        {
+            if (!bias || score < biasScore)
+            {
+                bias = m;
+                biasScore = score;
+            }
+        }
+        else if (fabsf(m->key.exposure - exposure) <= 0.02f * exposure + 1e-4f)
+        {
+            if (!dark || score < darkScore)
+            {
+                dark = m;
+                darkScore = score;
+            }
+        }
+    }
+
+    return dark ? dark : bias;
+}
+
+const MasterFrame *CalibrationLibrary::findFlat(uint32_t bin, uint32_t x, uint32_t y, uint32_t w, uint32_t h) const
+{
+    const MasterFrame *flat = NULL;
+
+    // Flats are normalised, any bit depth or gain will do; the most frames wins
+    for (size_t i = 0; i < masters.size(); i++)
+    {
+        const MasterFrame *m = masters[i].get();
+        if (m->key.type == MASTER_FLAT && m->key.bin == bin && m->covers(x, y, w, h) && (!flat || m->key.frames > flat->key.frames))
+            flat = m;
+    }
+    return flat;
+}
+
+void combineFrames(const std::vector<const uint16_t *> &frames, size_t n, float kappa, float *out)
+{
+    // Small enough tiles for the cores to finish together, large enough that handing them out costs nothing
+    const size_t TILE = 16384;
+    size_t tiles = (n + TILE - 1) / TILE;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next(0);
+
+    auto work = [&]()
+    {
+        size_t tile;
+        while ((tile = next++) < tiles)
+        {
+            size_t offset = tile * TILE;
+            combine16(&frames[0], frames.size(), offset, std::min(TILE, n - offset), kappa, out + offset);
+        }
+    };
+
+    workers = std::min(workers, tiles);
+    for (size_t i = 1; i < workers; i++)
+        threads.push_back(std::thread(work));
+    work();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
@@ -0,0 +1,121 @@
+/**
+ * Master calibration frames of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum MasterType
+{
+    MASTER_BIAS,
+    MASTER_DARK,
+    MASTER_FLAT
+};
+
+/* What a master was taken with. The region is in binned pixels of the full
+ * sensor; a master covering a larger region serves any subframe inside it.
+ * Temperature is NaN when the camera has no sensor. */
+struct MasterKey
+{
+    uint32_t type;
+    uint32_t bpp;
+    uint32_t bin;
+    uint32_t x, y, width, height;
+    float gain;
+    float exposure;
+    float temperature;
+    uint32_t frames;            // how many raw frames went into it
+};
+
+/* One master, memory-mapped from its file. Biases and darks hold the ADU to
+ * subtract. Flats hold the reciprocal of the normalised flat, so applying
+ * one is a multiply. */
+class MasterFrame
+{
+public:
+    ~MasterFrame();
+
+    static std::unique_ptr<MasterFrame> map(const std::string &path);
+
+    // First sample of the row of this master that lines up with row y, column x of the frame
+    const float *at(uint32_t x, uint32_t y) const
+    {
+        return data + (size_t)(y - key.y) * key.width + (x - key.x);
+    }
+
+    // Does this master cover the w x h region at x, y?
+    bool covers(uint32_t x, uint32_t y, uint32_t w, uint32_t h) const
+    {
+        return x >= key.x && y >= key.y && x + w <= key.x + key.width && y + h <= key.y + key.height;
+    }
+
+    std::string describe() const;
+
+    MasterKey key;
+    std::string path;
+    const float *data;
+
+private:
+    MasterFrame() : data(NULL), mapping(NULL), mappedBytes(0) {}
+
+    void *mapping;
+    size_t mappedBytes;
+};
+
+/* All masters of one camera, kept under ~/.indi per GUID. Files are mapped
+ * rather than read, so a library of masters costs address space, and the
+ * page cache only holds the ones actually in use. */
+class CalibrationLibrary
+{
+public:
+    void open(uint64_t guid);
+    void close();
+
+    /* Write a master to disk, replacing any with the same key, and map it.
+     * A FITS copy for other software is written next to it; combine names
+     * the method used for it. If only that copy fails, the master is still
+     * stored and warning says what went wrong. */
+    const MasterFrame *store(const MasterKey &key, const float *data, const char *combine, std::string &warning);
+
+    /* Best dark for the frame, or else the best bias. Gain has to match,
+     * exposure to within a couple of percent, temperature is the tie breaker. */
+    const MasterFrame *findDark(uint32_t bpp, uint32_t bin, uint32_t x, uint32_t y, uint32_t w, uint32_t h, float gain,
+                                float exposure, float temperature) const;
+    const MasterFrame *findFlat(uint32_t bin, uint32_t x, uint32_t y, uint32_t w, uint32_t h) const;
+
+    size_t size() const
+    {
+        return masters.size();
+    }
+
+private:
+    std::string dir;
+    std::vector<std::unique_ptr<MasterFrame> > masters;
+};
+
+/* Combine count frames of n pixels each into out. Tiles are spread over all
+ * cores. kappa <= 0 takes the median, otherwise a kappa sigma clipped mean. */
+void combineFrames(const std::vector<const uint16_t *> &frames, size_t n, float kappa, float *out);
+
+#endif // CALIBRATION_H
@@ -0,0 +1,175 @@
+/**
+ * Per-camera capability cache of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "capability_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Plain "key values..." lines, bumped whenever a key changes meaning:
+ *
+ *   version 1
+ *   vendor <text>
+ *   model <text>
+ *   modes <mode> ...
+ *   codings <coding> ...
+ *   geometry <bin> <mode> <maxW> <maxH> <unitPosX> <unitPosY> <unitSizeX> <unitSizeY>
+ *   shutter <min> <max>
+ *   gain <min> <max>
+ */
+static const int CACHE_VERSION = 1;
+
+static std::string cacheDir()
+{
+    const char *home = getenv("HOME");
+    return std::string(home ? home : "/tmp") + "/.indi";
+}
+
+static std::string cachePath(uint64_t guid)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/dc1394_pgrey_%016llx.caps", (unsigned long long)guid);
+    return cacheDir() + name;
+}
+
+// Text after "key " up to the end of the line
+static std::string restOfLine(const char *line, size_t keyLen)
+{
+    std::string s(line + keyLen);
+    while (!s.empty() && (s[0] == ' ' || s[0] == '\t'))
+        s.erase(0, 1);
+    while (!s.empty() && (s[s.size() - 1] == '\n' || s[s.size() - 1] == '\r'))
+        s.erase(s.size() - 1);
+    return s;
+}
+
+bool loadCapabilities(uint64_t guid, CameraCapabilities &caps)
+{
+    FILE *fp = fopen(cachePath(guid).c_str(), "r");
+    char line[1024];
+    int version = 0;
+    bool haveShutter = false, haveGain = false;
+
+    if (!fp)
+        return false;
+
+    caps = CameraCapabilities();
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (!strncmp(line, "version ", 8))
+        {
+            version = atoi(line + 8);
+        }
+        else if (!strncmp(line, "vendor ", 7))
+        {
+            caps.vendor = restOfLine(line, 7);
+        }
+        else if (!strncmp(line, "model ", 6))
+        {
+            caps.model = restOfLine(line, 6);
+        }
+        else if (!strncmp(line, "modes ", 6) || !strncmp(line, "codings ", 8))
+        {
+            bool isModes = line[0] == 'm';
+            char *p = line + (isModes ? 6 : 8), *end;
+            for (;;)
+            {
+                unsigned long v = strtoul(p, &end, 10);
+                if (end == p)
+                    break;
+                if (isModes)
+                    caps.modes.push_back((dc1394video_mode_t)v);
+                else
+                    caps.codings.push_back((dc1394color_coding_t)v);
+                p = end;
+            }
+        }
+        else if (!strncmp(line, "geometry ", 9))
+        {
+            Format7Geometry g;
+            unsigned int bin, mode;
+            if (sscanf(line + 9, "%u %u %u %u %u %u %u %u", &bin, &mode, &g.maxWidth, &g.maxHeight,
+                       &g.unitPosX, &g.unitPosY, &g.unitSizeX, &g.unitSizeY) != 8)
+                break;
+            g.mode = (dc1394video_mode_t)mode;
+            caps.geometry.push_back(std::make_pair((uint32_t)bin, g));
+        }
+        else if (!strncmp(line, "shutter ", 8))
+        {
+            haveShutter = sscanf(line + 8, "%f %f", &caps.shutterMin, &caps.shutterMax) == 2;
+        }
+        else if (!strncmp(line, "gain ", 5))
+        {
+            haveGain = sscanf(line + 5, "%f %f", &caps.gainMin, &caps.gainMax) == 2;
+        }
+    }
+    fclose(fp);
+
+    return version == CACHE_VERSION && !caps.model.empty() && !caps.modes.empty() && !caps.codings.empty() &&
+           !caps.geometry.empty() && caps.geometry[0].first == 1 && haveShutter && haveGain;
+}
+
+bool saveCapabilities(uint64_t guid, const CameraCapabilities &caps)
+{
+    std::string path = cachePath(guid);
+    std::string tmp = path + ".tmp";
+    FILE *fp;
+    size_t i;
+
+    mkdir(cacheDir().c_str(), 0755);
+
+    // Written aside and renamed into place so a crash never leaves half a file behind
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "version %d\n", CACHE_VERSION);
+    fprintf(fp, "vendor %s\n", caps.vendor.c_str());
+    fprintf(fp, "model %s\n", caps.model.c_str());
+    fprintf(fp, "modes");
+    for (i = 0; i < caps.modes.size(); i++)
+        fprintf(fp, " %u", (unsigned int)caps.modes[i]);
+    fprintf(fp, "\ncodings");
+    for (i = 0; i < caps.codings.size(); i++)
+        fprintf(fp, " %u", (unsigned int)caps.codings[i]);
+    fprintf(fp, "\n");
+    for (i = 0; i < caps.geometry.size(); i++)
+    {
+        const Format7Geometry &g = caps.geometry[i].second;
+        fprintf(fp, "geometry %u %u %u %u %u %u %u %u\n", caps.geometry[i].first, (unsigned int)g.mode,
+                g.maxWidth, g.maxHeight, g.unitPosX, g.unitPosY, g.unitSizeX, g.unitSizeY);
+    }
+    fprintf(fp, "shutter %.9g %.9g\n", caps.shutterMin, caps.shutterMax);
+    fprintf(fp, "gain %.9g %.9g\n", caps.gainMin, caps.gainMax);
+
+    if (fclose(fp) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
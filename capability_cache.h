@@ -0,0 +1,57 @@
+/**
+ * Per-camera capability cache of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef CAPABILITY_CACHE_H
+#define CAPABILITY_CACHE_H
+
+#include <dc1394/dc1394.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Size and position/size granularity of one Format7 mode
+struct Format7Geometry
+{
+    dc1394video_mode_t mode;
+    uint32_t maxWidth, maxHeight;
+    uint32_t unitPosX, unitPosY;
+    uint32_t unitSizeX, unitSizeY;
+};
+
+/* What Connect() learns by probing a camera. None of it changes unless the
+ * camera does, so it is kept on disk per GUID and reused on reconnect. */
+struct CameraCapabilities
+{
+    std::string vendor;
+    std::string model;
+    std::vector<dc1394video_mode_t> modes;
+    std::vector<dc1394color_coding_t> codings;     // of the working Format7 mode
+    // Working mode first, then one entry per hardware binning factor
+    std::vector<std::pair<uint32_t, Format7Geometry> > geometry;
+    float shutterMin, shutterMax;
+    float gainMin, gainMax;
+};
+
+/* The cache lives in ~/.indi next to the driver configuration, one file per
+ * GUID. Loading fails on a missing, unreadable or older-format file, in which
+ * case the camera is simply probed again. */
+bool loadCapabilities(uint64_t guid, CameraCapabilities &caps);
+bool saveCapabilities(uint64_t guid, const CameraCapabilities &caps);
+
+#endif // CAPABILITY_CACHE_H
@@ -0,0 +1,311 @@
+/**
+ * Pre-trigger event capture of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "event_capture.h"
+#include "frame_kernels.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fitsio.h>
+
+// Rows per band of the change detector
+static const uint32_t BAND_ROWS = 32;
+// Frames the per band change is averaged over, and learnt from before anything is judged
+static const uint32_t LEARN_FRAMES = 32;
+// Smallest change spread, in ADU per pixel, so a perfectly still band does not trigger on a single count
+static const double MIN_SPREAD = 0.05;
+
+// UTC as ISO 8601 with milliseconds, the way FITS wants it
+static std::string isoTime(double t, const char *format)
+{
+    char text[64], ms[8];
+    time_t seconds = (time_t)floor(t);
+    struct tm tm;
+
+    gmtime_r(&seconds, &tm);
+    strftime(text, sizeof(text), format, &tm);
+    snprintf(ms, sizeof(ms), ".%03d", std::min(999, (int)((t - seconds) * 1000)));
+    return std::string(text) + ms;
+}
+
+EventRecorder::EventRecorder()
+    : dropped(0), width(0), height(0), bpp(8), frameBytes(0), slots(0), head(0), filled(0), eventOpen(false), triggerTime(0),
+      postEnd(0), learnt(0), quit(false)
+{
+}
+
+EventRecorder::~EventRecorder()
+{
+    stop();
+}
+
+bool EventRecorder::start(uint32_t w, uint32_t h, uint32_t bits, size_t budget, const std::string &directory)
+{
+    stop();
+
+    width = w;
+    height = h;
+    bpp = bits;
+    frameBytes = (size_t)w * h * (bits / 8);
+    dir = directory;
+    if (!frameBytes || budget / frameBytes < 2)
+        return false;
+
+    // Filling it in now commits the memory, rather than at the first frames of the stream
+    slots = budget / frameBytes;
+    buffer.assign((size_t)slots * frameBytes, 0);
+    times.assign(slots, 0);
+    held.assign(slots, 0);
+    head = filled = 0;
+    eventOpen = false;
+    dropped = 0;
+
+    bandMean.assign((h + BAND_ROWS - 1) / BAND_ROWS, 0);
+    bandVariance.assign(bandMean.size(), 0);
+    learnt = 0;
+
+    quit = false;
+    writer = std::thread(&EventRecorder::writerLoop, this);
+    return true;
+}
+
+void EventRecorder::stop()
+{
+    if (!writer.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (eventOpen)
+        {
+            Job job = { -1, triggerTime };
+            queue.push_back(job);
+            eventOpen = false;
+        }
+        quit = true;
+    }
+    wake.notify_one();
+    writer.join();
+
+    std::vector<uint8_t>().swap(buffer);
+    slots = 0;
+}
+
+double EventRecorder::push(const uint8_t *image, double time)
+{
+    const size_t rowBytes = (size_t)width * (bpp / 8);
+    double score = 0;
+    bool store;
+
+    // Compare with the frame before, band by band, so a meteor crossing a corner still stands out
+    if (filled)
+    {
+        const uint8_t *previous = &buffer[(size_t)((head + slots - 1) % slots) * frameBytes];
+        double alpha = 1.0 / std::min(learnt + 1, LEARN_FRAMES);
+
+        for (size_t band = 0; band < bandMean.size(); band++)
+        {
+            uint32_t rows = std::min(BAND_ROWS, height - (uint32_t)band * BAND_ROWS);
+            size_t offset = band * BAND_ROWS * rowBytes, n = (size_t)rows * width;
+            double change, deviation;
+
+            if (bpp == 8)
+                change = frameDifference8(image + offset, previous + offset, n) / (double)n;
+            else
+                change = frameDifference16((const uint16_t *)(image + offset), (const uint16_t *)(previous + offset), n) / (double)n;
+
+            deviation = change - bandMean[band];
+            if (learnt >= LEARN_FRAMES)
+                score = std::max(score, deviation / std::max(sqrt(bandVariance[band]), MIN_SPREAD));
+            bandMean[band] += alpha * deviation;
+            bandVariance[band] += alpha * ((1 - alpha) * deviation * deviation - bandVariance[band]);
+        }
+        learnt++;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        store = !held[head];
+    }
+    if (!store)
+    {
+        dropped++;
+        return score;
+    }
+
+    memcpy(&buffer[(size_t)head * frameBytes], image, frameBytes);
+    times[head] = time;
+
+    if (eventOpen)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (time <= postEnd)
+        {
+            Job job = { (int32_t)head, triggerTime };
+            held[head] = 1;
+            queue.push_back(job);
+        }
+        else
+        {
+            Job job = { -1, triggerTime };
+            queue.push_back(job);
+            eventOpen = false;
+        }
+    }
+    wake.notify_one();
+
+    head = (head + 1) % slots;
+    filled = std::min(filled + 1, slots);
+    return score;
+}
+
+void EventRecorder::trigger(double time, double pre, double post)
+{
+    if (!running())
+        return;
+
+    if (eventOpen)
+    {
+        postEnd = std::max(postEnd, time + post);
+        return;
+    }
+
+    eventOpen = true;
+    triggerTime = time;
+    postEnd = time + post;
+
+    // Oldest first; frames still held for the event before belong to its file
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        uint32_t oldest = (head + slots - filled) % slots;
+        for (uint32_t i = 0; i < filled; i++)
+        {
+            uint32_t slot = (oldest + i) % slots;
+            if (held[slot] || times[slot] < time - pre)
+                continue;
+            Job job = { (int32_t)slot, triggerTime };
+            held[slot] = 1;
+            queue.push_back(job);
+        }
+    }
+    wake.notify_one();
+}
+
+bool EventRecorder::finished(std::string &path, uint32_t &frames)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (done.empty())
+        return false;
+    path = done.front().path;
+    frames = done.front().frames;
+    done.pop_front();
+    return true;
+}
+
+double EventRecorder::buffered() const
+{
+    if (filled < 2)
+        return 0;
+    return times[(head + slots - 1) % slots] - times[(head + slots - filled) % slots];
+}
+
+void EventRecorder::writerLoop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    const long npix = (long)width * height;
+    fitsfile *fptr = NULL;
+    std::string path;
+    std::vector<double> frameTimes;
+    int status = 0;
+
+    for (;;)
+    {
+        while (queue.empty() && !quit)
+            wake.wait(guard);
+        if (queue.empty())
+            break;
+
+        Job job = queue.front();
+        queue.pop_front();
+
+        if (job.slot < 0)
+        {
+            Done result = { path, (uint32_t)frameTimes.size() };
+
+            guard.unlock();
+            if (!fptr)
+            {
+                result.frames = 0;
+            }
+            else
+            {
+                char *ttype[] = { (char *)"TIME" }, *tform[] = { (char *)"1D" }, *tunit[] = { (char *)"s" };
+                std::string start = isoTime(frameTimes[0], "%Y-%m-%dT%H:%M:%S"), triggered = isoTime(job.trigger, "%Y-%m-%dT%H:%M:%S");
+
+                fits_update_key(fptr, TSTRING, "DATE-OBS", (void *)start.c_str(), "UTC mid-exposure of the first frame", &status);
+                fits_update_key(fptr, TSTRING, "TRIGTIME", (void *)triggered.c_str(), "UTC of the trigger", &status);
+                fits_create_tbl(fptr, BINARY_TBL, frameTimes.size(), 1, ttype, tform, tunit, "TIMES", &status);
+                fits_write_comment(fptr, "TIME is the mid-exposure UTC in seconds since 1970", &status);
+                fits_write_col(fptr, TDOUBLE, 1, 1, 1, frameTimes.size(), &frameTimes[0], &status);
+                fits_close_file(fptr, &status);
+                if (status)
+                {
+                    remove(path.c_str());
+                    result.frames = 0;
+                }
+            }
+            guard.lock();
+            if (!path.empty())
+                done.push_back(result);
+            fptr = NULL;
+            path.clear();
+            frameTimes.clear();
+            status = 0;
+            continue;
+        }
+
+        double time = times[job.slot];
+        const uint8_t *frame = &buffer[(size_t)job.slot * frameBytes];
+        guard.unlock();
+
+        // The cube grows by a frame at a time, NAXIS3 is only right once the event is over
+        long naxes[3] = { (long)width, (long)height, (long)frameTimes.size() + 1 };
+        if (path.empty())
+        {
+            path = dir + "/event_" + isoTime(time, "%Y%m%dT%H%M%S") + ".fits";
+            fits_create_file(&fptr, ("!" + path).c_str(), &status);
+            fits_create_img(fptr, bpp == 8 ? BYTE_IMG : USHORT_IMG, 3, naxes, &status);
+        }
+        else if (fptr)
+        {
+            fits_resize_img(fptr, bpp == 8 ? BYTE_IMG : USHORT_IMG, 3, naxes, &status);
+        }
+        // After a failure the rest of the event is only released, the file is dropped when it closes
+        if (fptr)
+            fits_write_img(fptr, bpp == 8 ? TBYTE : TUSHORT, (LONGLONG)frameTimes.size() * npix + 1, npix, (void *)frame, &status);
+        frameTimes.push_back(time);
+
+        guard.lock();
+        held[job.slot] = 0;
+    }
+}
@@ -0,0 +1,128 @@
+/**
+ * Pre-trigger event capture of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef EVENT_CAPTURE_H
+#define EVENT_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Keeps the last frames of a stream in a ring allocated once, sized by a
+ * memory budget. When an event is triggered, the frames of the seconds
+ * before it and those that follow are written out as a FITS cube by a
+ * writer thread. Frames waiting to be written are held in the ring, so the
+ * stream only ever pays for a copy; should the writer fall so far behind
+ * that the ring is all held frames, new frames are dropped and counted.
+ *
+ * Everything but the writer runs on the event loop. */
+class EventRecorder
+{
+public:
+    EventRecorder();
+    ~EventRecorder();
+
+    /* Allocate the ring for w x h frames of bpp (8 or 16) bits, as many as
+     * fit in budget bytes, and start the writer. Events are saved in dir. */
+    bool start(uint32_t w, uint32_t h, uint32_t bpp, size_t budget, const std::string &dir);
+    // Write out the event in progress, if any, and free the ring
+    void stop();
+
+    /* Copy a frame taken at time (UTC seconds) into the ring. Returns how
+     * far the change from the previous frame stands out in the band of rows
+     * where it is largest, in sigma of that band's usual change; 0 while
+     * that is still being learnt. */
+    double push(const uint8_t *image, double time);
+
+    /* Save the frames from pre seconds before time until post seconds after
+     * it. A trigger while an event is being recorded extends it. */
+    void trigger(double time, double pre, double post);
+
+    /* Events written since the last call, one per call. frames is 0 when
+     * writing the file failed. */
+    bool finished(std::string &path, uint32_t &frames);
+
+    bool running() const
+    {
+        return writer.joinable();
+    }
+    bool recording() const
+    {
+        return eventOpen;
+    }
+    uint32_t capacity() const
+    {
+        return slots;
+    }
+    // Time spanned by the frames in the ring
+    double buffered() const;
+
+    uint32_t dropped;
+
+private:
+    struct Job
+    {
+        int32_t slot;           // frame to write, -1 to close the file
+        double trigger;
+    };
+
+    struct Done
+    {
+        std::string path;
+        uint32_t frames;
+    };
+
+    void writerLoop();
+
+    uint32_t width, height, bpp;
+    size_t frameBytes;
+    std::string dir;
+
+    // The ring: frame slot i is at buffer[i * frameBytes]
+    std::vector<uint8_t> buffer;
+    std::vector<double> times;
+    std::vector<uint8_t> held;  // waiting for the writer, under lock
+    uint32_t slots;
+    uint32_t head;              // next slot to fill
+    uint32_t filled;
+
+    // Event in progress, event loop only
+    bool eventOpen;
+    double triggerTime;
+    double postEnd;
+
+    // Change detection: usual per band change and its variance
+    std::vector<double> bandMean;
+    std::vector<double> bandVariance;
+    uint32_t learnt;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Job> queue;
+    std::deque<Done> done;
+    bool quit;
+    std::thread writer;
+};
+
+#endif // EVENT_CAPTURE_H
@@ -0,0 +1,312 @@
+/**
+ * Parallel FITS tile compression of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "fits_compress.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Rows a worker takes at a time, enough to keep the lock out of the way
+static const uint32_t CHUNK_ROWS = 16;
+// Frames held before submit turns more away
+static const unsigned MAX_PENDING = 3;
+// Pixels per Rice block, as cfitsio writes by default
+static const int RICE_BLOCK = 32;
+
+static double elapsed(const struct timespec &start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+FitsCompressor::FitsCompressor() : pending(0), quit(false)
+{
+    notifyPipe[0] = notifyPipe[1] = -1;
+}
+
+FitsCompressor::~FitsCompressor()
+{
+    stop();
+}
+
+bool FitsCompressor::start(unsigned threads)
+{
+    unsigned i;
+
+    stop();
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    if (pipe2(notifyPipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        return false;
+
+    quit = false;
+    for (i = 0; i < threads; i++)
+        workers.push_back(std::thread(&FitsCompressor::workerLoop, this));
+    return true;
+}
+
+void FitsCompressor::stop()
+{
+    FitsCompressed result;
+    size_t i;
+
+    if (workers.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+
+    queue.clear();
+    while (finished(result))
+        free(result.data);
+    pending = 0;
+
+    close(notifyPipe[0]);
+    close(notifyPipe[1]);
+    notifyPipe[0] = notifyPipe[1] = -1;
+}
+
+bool FitsCompressor::submit(const uint8_t *image, uint32_t w, uint32_t h, uint32_t bpp, int method,
+                            const std::function<void(fitsfile *, int *)> &header)
+{
+    std::shared_ptr<Job> job;
+
+    if (workers.empty() || w == 0 || h == 0 || (bpp != 8 && bpp != 16 && bpp != 32))
+        return false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (pending >= MAX_PENDING)
+            return false;
+        pending++;
+    }
+
+    // Copied so the frame buffer is free for the next exposure straight away
+    job = std::make_shared<Job>();
+    job->image.assign(image, image + (size_t)w * h * (bpp / 8));
+    job->width = w;
+    job->height = h;
+    job->bpp = bpp;
+    job->method = method;
+    job->header = header;
+    job->tiles.resize(h);
+    job->claimed = 0;
+    job->remaining = h;
+    job->failed = false;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(job);
+    }
+    wake.notify_all();
+    return true;
+}
+
+bool FitsCompressor::finished(FitsCompressed &result)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (done.empty())
+        return false;
+    result = done.front();
+    done.pop_front();
+    return true;
+}
+
+void FitsCompressor::workerLoop()
+{
+    std::vector<uint8_t> scratch;
+    std::shared_ptr<Job> job;
+    uint32_t first, last, row;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this] { return quit || !queue.empty(); });
+            if (quit)
+                return;
+            job = queue.front();
+            first = job->claimed;
+            last = std::min(first + CHUNK_ROWS, job->height);
+            job->claimed = last;
+            // Fully handed out, the next worker starts on the next frame
+            if (last == job->height)
+                queue.pop_front();
+        }
+
+        for (row = first; row < last; row++)
+            if (!compressRow(*job, row, scratch))
+                job->failed = true;
+
+        if (job->remaining.fetch_sub(last - first) == last - first)
+            writeFile(*job);
+        job.reset();
+    }
+}
+
+/* Pixels are converted the way cfitsio does before compressing: unsigned
+ * 16 and 32 bit values become signed with BZERO taking up the offset. */
+bool FitsCompressor::compressRow(Job &job, uint32_t row, std::vector<uint8_t> &scratch)
+{
+    uint32_t n = job.width, bytepix = job.bpp / 8, i, b;
+    const uint8_t *src = &job.image[(size_t)row * n * bytepix];
+    std::vector<uint8_t> &tile = job.tiles[row];
+    z_stream z;
+    int len;
+
+    if (job.method == FITS_RICE)
+    {
+        // Worst case is every pixel at full width plus a code per block
+        tile.resize((size_t)n * bytepix + n / RICE_BLOCK + 16);
+        if (bytepix == 1)
+        {
+            len = fits_rcomp_byte((signed char *)src, n, &tile[0], tile.size(), RICE_BLOCK);
+        }
+        else if (bytepix == 2)
+        {
+            scratch.resize((size_t)n * 2);
+            short *v = (short *)&scratch[0];
+            for (i = 0; i < n; i++)
+                v[i] = (short)(((const uint16_t *)src)[i] ^ 0x8000);
+            len = fits_rcomp_short(v, n, &tile[0], tile.size(), RICE_BLOCK);
+        }
+        else
+        {
+            scratch.resize((size_t)n * 4);
+            int *v = (int *)&scratch[0];
+            for (i = 0; i < n; i++)
+                v[i] = (int)(((const uint32_t *)src)[i] ^ 0x80000000u);
+            len = fits_rcomp(v, n, &tile[0], tile.size(), RICE_BLOCK);
+        }
+        if (len < 0)
+            return false;
+        tile.resize(len);
+        return true;
+    }
+
+    // Byte planes of the big-endian values, most significant first
+    scratch.resize((size_t)n * bytepix);
+    for (i = 0; i < n; i++)
+    {
+        uint32_t v = bytepix == 1 ? src[i] : bytepix == 2 ? ((const uint16_t *)src)[i] ^ 0x8000 : ((const uint32_t *)src)[i] ^ 0x80000000u;
+        for (b = 0; b < bytepix; b++)
+            scratch[(size_t)b * n + i] = v >> (8 * (bytepix - 1 - b));
+    }
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    tile.resize(deflateBound(&z, scratch.size()));
+    z.next_in = &scratch[0];
+    z.avail_in = scratch.size();
+    z.next_out = &tile[0];
+    z.avail_out = tile.size();
+    len = deflate(&z, Z_FINISH) == Z_STREAM_END ? (int)z.total_out : -1;
+    deflateEnd(&z);
+    if (len < 0)
+        return false;
+    tile.resize(len);
+    return true;
+}
+
+void FitsCompressor::writeFile(Job &job)
+{
+    FitsCompressed result;
+    fitsfile *fptr = NULL;
+    void *memptr = NULL;
+    size_t memsize = 0;
+    int status = 0, yes = 1, bitpix = job.bpp, naxis = 2, blocksize = RICE_BLOCK, bytepix = job.bpp / 8;
+    int width = job.width, height = job.height, one = 1;
+    double zero = job.bpp == 16 ? 32768.0 : 2147483648.0, scale = 1;
+    char ttype[] = "COMPRESSED_DATA", tform[] = "1PB";
+    char *ttypes[] = { ttype }, *tforms[] = { tform };
+    char c = 0;
+    uint32_t row;
+
+    if (!job.failed)
+    {
+        fits_create_memfile(&fptr, &memptr, &memsize, 2880, realloc, &status);
+        fits_create_img(fptr, BYTE_IMG, 0, NULL, &status);
+        fits_create_tbl(fptr, BINARY_TBL, job.height, 1, ttypes, tforms, NULL, "COMPRESSED_IMAGE", &status);
+        for (row = 0; row < job.height && status == 0; row++)
+            fits_write_col(fptr, TBYTE, 1, row + 1, 1, job.tiles[row].size(), &job.tiles[row][0], &status);
+
+        // Written after the rows, so cfitsio still treats the HDU as a plain table
+        fits_update_key(fptr, TLOGICAL, "ZIMAGE", &yes, "extension contains compressed image", &status);
+        fits_update_key(fptr, TINT, "ZBITPIX", &bitpix, "data type of original image", &status);
+        fits_update_key(fptr, TINT, "ZNAXIS", &naxis, "dimension of original image", &status);
+        fits_update_key(fptr, TINT, "ZNAXIS1", &width, "length of original image axis", &status);
+        fits_update_key(fptr, TINT, "ZNAXIS2", &height, "length of original image axis", &status);
+        fits_update_key(fptr, TINT, "ZTILE1", &width, "size of tiles to be compressed", &status);
+        fits_update_key(fptr, TINT, "ZTILE2", &one, "size of tiles to be compressed", &status);
+        if (job.method == FITS_RICE)
+        {
+            fits_update_key(fptr, TSTRING, "ZCMPTYPE", (void *)"RICE_1", "compression algorithm", &status);
+            fits_update_key(fptr, TSTRING, "ZNAME1", (void *)"BLOCKSIZE", "compression block size", &status);
+            fits_update_key(fptr, TINT, "ZVAL1", &blocksize, "pixels per block", &status);
+            fits_update_key(fptr, TSTRING, "ZNAME2", (void *)"BYTEPIX", "bytes per pixel (1, 2, 4, or 8)", &status);
+            fits_update_key(fptr, TINT, "ZVAL2", &bytepix, "bytes per pixel (1, 2, 4, or 8)", &status);
+        }
+        else
+        {
+            fits_update_key(fptr, TSTRING, "ZCMPTYPE", (void *)"GZIP_2", "compression algorithm", &status);
+        }
+        if (job.bpp > 8)
+        {
+            fits_update_key(fptr, TDOUBLE, "BZERO", &zero, "offset data range to that of unsigned", &status);
+            fits_update_key(fptr, TDOUBLE, "BSCALE", &scale, "default scaling factor", &status);
+        }
+        job.header(fptr, &status);
+        fits_close_file(fptr, &status);
+        if (status != 0)
+        {
+            free(memptr);
+            memptr = NULL;
+        }
+    }
+
+    result.data = memptr;
+    result.size = memptr ? memsize : 0;
+    result.rawBytes = job.image.size();
+    result.seconds = elapsed(job.start);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done.push_back(result);
+        pending--;
+    }
+    if (write(notifyPipe[1], &c, 1) < 0)
+    {
+        // Pipe full means a wakeup is already pending
+    }
+}
@@ -0,0 +1,119 @@
+/**
+ * Parallel FITS tile compression of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FITS_COMPRESS_H
+#define FITS_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fitsio.h>
+
+enum
+{
+    FITS_RICE,                  // RICE_1, the usual choice for integer frames
+    FITS_GZIP                   // GZIP_2, deflate on bytes shuffled by significance
+};
+
+// A finished file, data is malloc'ed and the caller frees it. NULL if compressing failed.
+struct FitsCompressed
+{
+    void *data;
+    size_t size;
+    size_t rawBytes;            // what the frame takes uncompressed
+    double seconds;             // from submit until the file was complete
+};
+
+/* Turns frames into tile compressed FITS files in memory, one tile per row,
+ * in the layout cfitsio reads back as an ordinary image. The rows of a frame
+ * are shared out between the worker threads in chunks; whichever worker
+ * finishes the last chunk writes the file, while the others carry on with
+ * the next frame. A byte is written to notifyFd() for every finished file.
+ *
+ * submit and finished are for the event loop. */
+class FitsCompressor
+{
+public:
+    FitsCompressor();
+    ~FitsCompressor();
+
+    // 0 threads for one per core
+    bool start(unsigned threads);
+    // Waits for the chunks being compressed, drops everything not finished
+    void stop();
+
+    /* Copy a w x h frame of bpp (8, 16 or 32) unsigned bits and queue it.
+     * header writes the keywords into the image HDU. Returns false if the
+     * workers are already that far behind, the caller sends the frame as is. */
+    bool submit(const uint8_t *image, uint32_t w, uint32_t h, uint32_t bpp, int method,
+                const std::function<void(fitsfile *, int *)> &header);
+
+    bool finished(FitsCompressed &result);
+
+    bool running() const
+    {
+        return !workers.empty();
+    }
+    unsigned threadCount() const
+    {
+        return workers.size();
+    }
+    int notifyFd() const
+    {
+        return notifyPipe[0];
+    }
+
+private:
+    struct Job
+    {
+        std::vector<uint8_t> image;
+        uint32_t width, height, bpp;
+        int method;
+        std::function<void(fitsfile *, int *)> header;
+        std::vector<std::vector<uint8_t>> tiles;
+        uint32_t claimed;       // rows handed out, under lock
+        std::atomic<uint32_t> remaining;
+        std::atomic<bool> failed;
+        struct timespec start;
+    };
+
+    void workerLoop();
+    bool compressRow(Job &job, uint32_t row, std::vector<uint8_t> &scratch);
+    void writeFile(Job &job);
+
+    std::vector<std::thread> workers;
+    int notifyPipe[2];
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::deque<FitsCompressed> done;
+    unsigned pending;           // submitted and not yet finished
+    bool quit;
+};
+
+#endif // FITS_COMPRESS_H
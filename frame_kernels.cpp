@@ -0,0 +1,1612 @@
+/**
+ * Pixel kernels used on the frame path of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "frame_kernels.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef KERNELS_X86
+static bool cpuHasAVX2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif
+
+/////////////////////////////////////////////////////////
+/// Big-endian 16-bit unpack
+/////////////////////////////////////////////////////////
+
+void unpackBigEndian16Scalar(uint16_t *dst, const uint8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = (uint16_t)((src[2 * i] << 8) | src[2 * i + 1]);
+}
+
+#ifdef KERNELS_X86
+TARGET_AVX2 static size_t unpackBigEndian16AVX2(uint16_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    return i;
+}
+
+static size_t unpackBigEndian16SSE2(uint16_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    return i;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static size_t unpackBigEndian16NEON(uint16_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        uint8x16_t v = vrev16q_u8(vld1q_u8(src + 2 * i));
+        vst1q_u16(dst + i, vreinterpretq_u16_u8(v));
+    }
+    return i;
+}
+#endif
+
+void unpackBigEndian16(uint16_t *dst, const uint8_t *src, size_t n)
+{
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = unpackBigEndian16AVX2(dst, src, n);
+    done += unpackBigEndian16SSE2(dst + done, src + 2 * done, n - done);
+#elif defined(KERNELS_NEON)
+    done = unpackBigEndian16NEON(dst, src, n);
+#endif
+
+    unpackBigEndian16Scalar(dst + done, src + 2 * done, n - done);
+}
+
+/////////////////////////////////////////////////////////
+/// Software binning
+/////////////////////////////////////////////////////////
+
+/* Both binning kernels first sum `bin` source rows into a wide row accumulator,
+ * which is where almost all the memory traffic is and what the SIMD loops
+ * cover, then fold each run of `bin` accumulator columns into one output pixel. */
+
+static void accumulateRow8Scalar(uint16_t *acc, const uint8_t *src, size_t n, size_t start)
+{
+    for (size_t i = start; i < n; i++)
+        acc[i] += src[i];
+}
+
+static void accumulateRow16Scalar(uint32_t *acc, const uint8_t *src, size_t n, size_t start, bool bigEndian)
+{
+    const uint16_t *s16 = (const uint16_t *)src;
+
+    for (size_t i = start; i < n; i++)
+    {
+        uint16_t v = bigEndian ? (uint16_t)((src[2 * i] << 8) | src[2 * i + 1]) : s16[i];
+        acc[i] += v;
+    }
+}
+
+#ifdef KERNELS_X86
+TARGET_AVX2 static size_t accumulateRow8AVX2(uint16_t *acc, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi16(a, v));
+    }
+    return i;
+}
+
+static size_t accumulateRow8SSE2(uint16_t *acc, const uint8_t *src, size_t n, size_t start)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = start;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(acc + i + 8));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128((__m128i *)(acc + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero)));
+    }
+    return i;
+}
+
+TARGET_AVX2 static size_t accumulateRow16AVX2(uint32_t *acc, const uint8_t *src, size_t n, bool bigEndian)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        if (bigEndian)
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi32(a, _mm256_cvtepu16_epi32(v)));
+    }
+    return i;
+}
+
+static size_t accumulateRow16SSE2(uint32_t *acc, const uint8_t *src, size_t n, size_t start, bool bigEndian)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = start;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        if (bigEndian)
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        __m128i lo = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(acc + i + 4));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi32(lo, _mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_si128((__m128i *)(acc + i + 4), _mm_add_epi32(hi, _mm_unpackhi_epi16(v, zero)));
+    }
+    return i;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static size_t accumulateRow8NEON(uint16_t *acc, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(src + i);
+        vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(v)));
+        vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(v)));
+    }
+    return i;
+}
+
+static size_t accumulateRow16NEON(uint32_t *acc, const uint8_t *src, size_t n, bool bigEndian)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        uint8x16_t b = vld1q_u8(src + 2 * i);
+        if (bigEndian)
+            b = vrev16q_u8(b);
+        uint16x8_t v = vreinterpretq_u16_u8(b);
+        vst1q_u32(acc + i, vaddw_u16(vld1q_u32(acc + i), vget_low_u16(v)));
+        vst1q_u32(acc + i + 4, vaddw_u16(vld1q_u32(acc + i + 4), vget_high_u16(v)));
+    }
+    return i;
+}
+#endif
+
+static void accumulateRow8(uint16_t *acc, const uint8_t *src, size_t n)
+{
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = accumulateRow8AVX2(acc, src, n);
+    done = accumulateRow8SSE2(acc, src, n, done);
+#elif defined(KERNELS_NEON)
+    done = accumulateRow8NEON(acc, src, n);
+#endif
+
+    accumulateRow8Scalar(acc, src, n, done);
+}
+
+static void accumulateRow16(uint32_t *acc, const uint8_t *src, size_t n, bool bigEndian)
+{
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = accumulateRow16AVX2(acc, src, n, bigEndian);
+    done = accumulateRow16SSE2(acc, src, n, done, bigEndian);
+#elif defined(KERNELS_NEON)
+    done = accumulateRow16NEON(acc, src, n, bigEndian);
+#endif
+
+    accumulateRow16Scalar(acc, src, n, done, bigEndian);
+}
+
+/////////////////////////////////////////////////////////
+/// Sub-exposure stacking
+/////////////////////////////////////////////////////////
+
+void stackAdd8Scalar(uint32_t *acc, const uint8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        acc[i] += src[i];
+}
+
+#ifdef KERNELS_X86
+TARGET_AVX2 static size_t stackAdd8AVX2(uint32_t *acc, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m256i lo = _mm256_cvtepu8_epi32(v);
+        __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8));
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(acc + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(acc + i + 8));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi32(a0, lo));
+        _mm256_storeu_si256((__m256i *)(acc + i + 8), _mm256_add_epi32(a1, hi));
+    }
+    return i;
+}
+
+static size_t stackAdd8SSE2(uint32_t *acc, const uint8_t *src, size_t n, size_t start)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = start;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i w0 = _mm_unpacklo_epi8(v, zero);
+        __m128i w1 = _mm_unpackhi_epi8(v, zero);
+        __m128i *a = (__m128i *)(acc + i);
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(w0, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(w0, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(w1, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(w1, zero)));
+    }
+    return i;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static size_t stackAdd8NEON(uint32_t *acc, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(src + i);
+        uint16x8_t w0 = vmovl_u8(vget_low_u8(v));
+        uint16x8_t w1 = vmovl_u8(vget_high_u8(v));
+        vst1q_u32(acc + i, vaddw_u16(vld1q_u32(acc + i), vget_low_u16(w0)));
+        vst1q_u32(acc + i + 4, vaddw_u16(vld1q_u32(acc + i + 4), vget_high_u16(w0)));
+        vst1q_u32(acc + i + 8, vaddw_u16(vld1q_u32(acc + i + 8), vget_low_u16(w1)));
+        vst1q_u32(acc + i + 12, vaddw_u16(vld1q_u32(acc + i + 12), vget_high_u16(w1)));
+    }
+    return i;
+}
+#endif
+
+void stackAdd8(uint32_t *acc, const uint8_t *src, size_t n)
+{
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = stackAdd8AVX2(acc, src, n);
+    done = stackAdd8SSE2(acc, src, n, done);
+#elif defined(KERNELS_NEON)
+    done = stackAdd8NEON(acc, src, n);
+#endif
+
+    stackAdd8Scalar(acc + done, src + done, n - done);
+}
+
+void stackAdd16(uint32_t *acc, const uint8_t *src, size_t n, bool bigEndian)
+{
+    // Same widening add the 16-bit binning uses for its row sums
+    accumulateRow16(acc, src, n, bigEndian);
+}
+
+/////////////////////////////////////////////////////////
+/// Calibration
+/////////////////////////////////////////////////////////
+
+/* All versions work in single precision and round to nearest even after
+ * clamping, so SIMD and scalar results agree bit for bit. The SIMD loops
+ * convert 8 (SSE2, NEON) or 16 (AVX2) pixels to float, apply both masters
+ * and narrow back with saturation. */
+
+template <typename T>
+static inline T calibratePixel(T px, const float *dark, const float *invFlat, size_t i, float maxValue)
+{
+    float v = px;
+    if (dark)
+        v -= dark[i];
+    if (invFlat)
+        v *= invFlat[i];
+    v = std::min(std::max(v, 0.0f), maxValue);
+    return (T)lrintf(v);
+}
+
+void calibrate8Scalar(uint8_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        px[i] = calibratePixel(px[i], dark, invFlat, i, 255.0f);
+}
+
+void calibrate16Scalar(uint16_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        px[i] = calibratePixel(px[i], dark, invFlat, i, 65535.0f);
+}
+
+void calibrate32(uint32_t *px, const float *dark, float darkScale, const float *invFlat, size_t n)
+{
+    // Stacks are rare and long, a scalar loop in double keeps all 32 bits
+    for (size_t i = 0; i < n; i++)
+    {
+        double v = px[i];
+        if (dark)
+            v -= dark[i] * (double)darkScale;
+        if (invFlat)
+            v *= invFlat[i];
+        px[i] = (uint32_t)llrint(std::min(std::max(v, 0.0), 4294967295.0));
+    }
+}
+
+#ifdef KERNELS_X86
+// 8 pixels, widened to 32 bits in lo/hi, calibrated and packed back to unsigned 16 bits
+static inline __m128i calibrate8PxSSE2(__m128i lo, __m128i hi, const float *dark, const float *invFlat, __m128 maxValue)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i bias = _mm_set1_epi32(32768);
+    __m128 flo = _mm_cvtepi32_ps(lo);
+    __m128 fhi = _mm_cvtepi32_ps(hi);
+
+    if (dark)
+    {
+        flo = _mm_sub_ps(flo, _mm_loadu_ps(dark));
+        fhi = _mm_sub_ps(fhi, _mm_loadu_ps(dark + 4));
+    }
+    if (invFlat)
+    {
+        flo = _mm_mul_ps(flo, _mm_loadu_ps(invFlat));
+        fhi = _mm_mul_ps(fhi, _mm_loadu_ps(invFlat + 4));
+    }
+    flo = _mm_min_ps(_mm_max_ps(flo, zero), maxValue);
+    fhi = _mm_min_ps(_mm_max_ps(fhi, zero), maxValue);
+
+    // No unsigned 32 -> 16 pack before SSE4.1: shift into signed range, pack, shift back
+    lo = _mm_sub_epi32(_mm_cvtps_epi32(flo), bias);
+    hi = _mm_sub_epi32(_mm_cvtps_epi32(fhi), bias);
+    return _mm_xor_si128(_mm_packs_epi32(lo, hi), _mm_set1_epi16((short)0x8000));
+}
+
+static size_t calibrate16SSE2(uint16_t *px, const float *dark, const float *invFlat, size_t n, size_t start)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 maxValue = _mm_set1_ps(65535.0f);
+    size_t i = start;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(px + i));
+        v = calibrate8PxSSE2(_mm_unpacklo_epi16(v, zero), _mm_unpackhi_epi16(v, zero), dark ? dark + i : NULL,
+                             invFlat ? invFlat + i : NULL, maxValue);
+        _mm_storeu_si128((__m128i *)(px + i), v);
+    }
+    return i;
+}
+
+static size_t calibrate8SSE2(uint8_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 maxValue = _mm_set1_ps(255.0f);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(px + i));
+        __m128i w0 = _mm_unpacklo_epi8(v, zero);
+        __m128i w1 = _mm_unpackhi_epi8(v, zero);
+        w0 = calibrate8PxSSE2(_mm_unpacklo_epi16(w0, zero), _mm_unpackhi_epi16(w0, zero), dark ? dark + i : NULL,
+                              invFlat ? invFlat + i : NULL, maxValue);
+        w1 = calibrate8PxSSE2(_mm_unpacklo_epi16(w1, zero), _mm_unpackhi_epi16(w1, zero), dark ? dark + i + 8 : NULL,
+                              invFlat ? invFlat + i + 8 : NULL, maxValue);
+        _mm_storeu_si128((__m128i *)(px + i), _mm_packus_epi16(w0, w1));
+    }
+    return i;
+}
+
+TARGET_AVX2 static inline __m256i calibrate8PxAVX2(__m256i v, const float *dark, const float *invFlat, __m256 maxValue)
+{
+    __m256 f = _mm256_cvtepi32_ps(v);
+
+    if (dark)
+        f = _mm256_sub_ps(f, _mm256_loadu_ps(dark));
+    if (invFlat)
+        f = _mm256_mul_ps(f, _mm256_loadu_ps(invFlat));
+    f = _mm256_min_ps(_mm256_max_ps(f, _mm256_setzero_ps()), maxValue);
+    return _mm256_cvtps_epi32(f);
+}
+
+TARGET_AVX2 static size_t calibrate16AVX2(uint16_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    const __m256 maxValue = _mm256_set1_ps(65535.0f);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(px + i)));
+        __m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(px + i + 8)));
+        lo = calibrate8PxAVX2(lo, dark ? dark + i : NULL, invFlat ? invFlat + i : NULL, maxValue);
+        hi = calibrate8PxAVX2(hi, dark ? dark + i + 8 : NULL, invFlat ? invFlat + i + 8 : NULL, maxValue);
+        // packus works per 128-bit lane, put the quadwords back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i *)(px + i), packed);
+    }
+    return i;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static inline uint32x4_t calibrate4PxNEON(uint32x4_t v, const float *dark, const float *invFlat, float32x4_t maxValue)
+{
+    float32x4_t f = vcvtq_f32_u32(v);
+
+    if (dark)
+        f = vsubq_f32(f, vld1q_f32(dark));
+    if (invFlat)
+        f = vmulq_f32(f, vld1q_f32(invFlat));
+    f = vminq_f32(vmaxq_f32(f, vdupq_n_f32(0.0f)), maxValue);
+#if defined(__aarch64__)
+    return vcvtnq_u32_f32(f);
+#else
+    /* ARMv7 only converts by truncating. NEON arithmetic always rounds to
+     * nearest even, so adding 2^23 rounds the clamped value to an integer
+     * the same way lrintf does; taking 2^23 off again is exact. */
+    const float32x4_t magic = vdupq_n_f32(8388608.0f);
+    return vcvtq_u32_f32(vsubq_f32(vaddq_f32(f, magic), magic));
+#endif
+}
+
+static size_t calibrate16NEON(uint16_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    const float32x4_t maxValue = vdupq_n_f32(65535.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(px + i);
+        uint32x4_t lo = calibrate4PxNEON(vmovl_u16(vget_low_u16(v)), dark ? dark + i : NULL, invFlat ? invFlat + i : NULL, maxValue);
+        uint32x4_t hi = calibrate4PxNEON(vmovl_u16(vget_high_u16(v)), dark ? dark + i + 4 : NULL, invFlat ? invFlat + i + 4 : NULL,
+                                         maxValue);
+        vst1q_u16(px + i, vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi)));
+    }
+    return i;
+}
+
+static size_t calibrate8NEON(uint8_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    const float32x4_t maxValue = vdupq_n_f32(255.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vmovl_u8(vld1_u8(px + i));
+        uint32x4_t lo = calibrate4PxNEON(vmovl_u16(vget_low_u16(v)), dark ? dark + i : NULL, invFlat ? invFlat + i : NULL, maxValue);
+        uint32x4_t hi = calibrate4PxNEON(vmovl_u16(vget_high_u16(v)), dark ? dark + i + 4 : NULL, invFlat ? invFlat + i + 4 : NULL,
+                                         maxValue);
+        vst1_u8(px + i, vqmovn_u16(vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi))));
+    }
+    return i;
+}
+#endif
+
+void calibrate8(uint8_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    done = calibrate8SSE2(px, dark, invFlat, n);
+#elif defined(KERNELS_NEON)
+    done = calibrate8NEON(px, dark, invFlat, n);
+#endif
+
+    calibrate8Scalar(px + done, dark ? dark + done : NULL, invFlat ? invFlat + done : NULL, n - done);
+}
+
+void calibrate16(uint16_t *px, const float *dark, const float *invFlat, size_t n)
+{
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = calibrate16AVX2(px, dark, invFlat, n);
+    done = calibrate16SSE2(px, dark, invFlat, n, done);
+#elif defined(KERNELS_NEON)
+    done = calibrate16NEON(px, dark, invFlat, n);
+#endif
+
+    calibrate16Scalar(px + done, dark ? dark + done : NULL, invFlat ? invFlat + done : NULL, n - done);
+}
+
+/////////////////////////////////////////////////////////
+/// Master frame combine
+/////////////////////////////////////////////////////////
+
+/* Each pixel's values across the frames are sorted with a fixed network of
+ * compare-exchanges, which maps onto SIMD min/max with one pixel per lane.
+ * The sorted values are then reduced in single precision in the same order
+ * by every version, so SIMD and scalar results agree bit for bit. */
+
+static const uint32_t CLIP_ROUNDS = 3;
+
+typedef std::vector<std::pair<uint16_t, uint16_t> > SortingNetwork;
+
+/* Batcher's odd-even merge sort for count inputs. It is the network for the
+ * next power of two with the comparators past count dropped, which still
+ * sorts since the missing inputs would all have ended up at the top. */
+static void buildSortingNetwork(uint32_t count, SortingNetwork &net)
+{
+    net.clear();
+    for (uint32_t p = 1; p < count; p <<= 1)
+        for (uint32_t k = p; k >= 1; k >>= 1)
+            for (uint32_t j = k % p; j + k < count; j += 2 * k)
+                for (uint32_t i = 0; i < k && i + j + k < count; i++)
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p))
+                        net.push_back(std::make_pair((uint16_t)(i + j), (uint16_t)(i + j + k)));
+}
+
+// One pixel's sorted values, stride apart
+static inline float combineSorted(const float *s, size_t stride, uint32_t count, float kappa)
+{
+    float median = (count & 1) ? s[(count / 2) * stride] : (s[(count / 2 - 1) * stride] + s[(count / 2) * stride]) * 0.5f;
+    float limit = INFINITY, sum, cnt, mean, dev;
+
+    if (kappa <= 0)
+        return median;
+
+    for (uint32_t round = 0;; round++)
+    {
+        sum = 0;
+        cnt = 0;
+        for (uint32_t k = 0; k < count; k++)
+        {
+            float v = s[k * stride];
+            if (fabsf(v - median) <= limit)
+            {
+                sum += v;
+                cnt += 1;
+            }
+        }
+        mean = sum / cnt;
+        if (round == CLIP_ROUNDS)
+            break;
+
+        dev = 0;
+        for (uint32_t k = 0; k < count; k++)
+        {
+            float v = s[k * stride];
+            if (fabsf(v - median) <= limit)
+            {
+                float d = v - mean;
+                dev += d * d;
+            }
+        }
+        limit = kappa * sqrtf(dev / cnt);
+    }
+
+    // Everything clipped away, only possible with no spread at all
+    return cnt > 0 ? mean : median;
+}
+
+void combine16Scalar(const uint16_t *const *frames, uint32_t count, size_t offset, size_t n, float kappa, float *out)
+{
+    std::vector<float> column(count);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        for (uint32_t k = 0; k < count; k++)
+            column[k] = frames[k][offset + i];
+        std::sort(column.begin(), column.end());
+        out[i] = combineSorted(&column[0], 1, count, kappa);
+    }
+}
+
+#ifdef KERNELS_X86
+static inline void combineSorted4SSE2(const float *s, size_t stride, uint32_t count, float kappa, float *out)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 median = (count & 1) ? _mm_loadu_ps(s + (count / 2) * stride) :
+                    _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(s + (count / 2 - 1) * stride), _mm_loadu_ps(s + (count / 2) * stride)),
+                               _mm_set1_ps(0.5f));
+    __m128 limit = _mm_set1_ps(INFINITY), sum, cnt, mean, dev, empty;
+
+    if (kappa <= 0)
+    {
+        _mm_storeu_ps(out, median);
+        return;
+    }
+
+    for (uint32_t round = 0;; round++)
+    {
+        sum = zero;
+        cnt = zero;
+        for (uint32_t k = 0; k < count; k++)
+        {
+            __m128 v = _mm_loadu_ps(s + k * stride);
+            __m128 keep = _mm_cmple_ps(_mm_and_ps(_mm_sub_ps(v, median), absMask), limit);
+            sum = _mm_add_ps(sum, _mm_and_ps(keep, v));
+            cnt = _mm_add_ps(cnt, _mm_and_ps(keep, one));
+        }
+        mean = _mm_div_ps(sum, cnt);
+        if (round == CLIP_ROUNDS)
+            break;
+
+        dev = zero;
+        for (uint32_t k = 0; k < count; k++)
+        {
+            __m128 v = _mm_loadu_ps(s + k * stride);
+            __m128 keep = _mm_cmple_ps(_mm_and_ps(_mm_sub_ps(v, median), absMask), limit);
+            __m128 d = _mm_sub_ps(v, mean);
+            dev = _mm_add_ps(dev, _mm_and_ps(keep, _mm_mul_ps(d, d)));
+        }
+        limit = _mm_mul_ps(_mm_set1_ps(kappa), _mm_sqrt_ps(_mm_div_ps(dev, cnt)));
+    }
+
+    empty = _mm_cmpeq_ps(cnt, zero);
+    _mm_storeu_ps(out, _mm_or_ps(_mm_and_ps(empty, median), _mm_andnot_ps(empty, mean)));
+}
+
+TARGET_AVX2 static size_t combine16AVX2(const uint16_t *const *frames, uint32_t count, const SortingNetwork &net, size_t offset,
+                                        size_t n, float kappa, float *out)
+{
+    std::vector<uint16_t> work((size_t)count * 16);
+    std::vector<float> sorted((size_t)count * 16);
+    __m256i *w = (__m256i *)&work[0];
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        for (uint32_t k = 0; k < count; k++)
+            _mm256_storeu_si256(w + k, _mm256_loadu_si256((const __m256i *)(frames[k] + offset + i)));
+
+        for (size_t c = 0; c < net.size(); c++)
+        {
+            __m256i a = _mm256_loadu_si256(w + net[c].first);
+            __m256i b = _mm256_loadu_si256(w + net[c].second);
+            _mm256_storeu_si256(w + net[c].first, _mm256_min_epu16(a, b));
+            _mm256_storeu_si256(w + net[c].second, _mm256_max_epu16(a, b));
+        }
+
+        for (uint32_t k = 0; k < count; k++)
+        {
+            __m256i v = _mm256_loadu_si256(w + k);
+            _mm256_storeu_ps(&sorted[k * 16], _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v))));
+            _mm256_storeu_ps(&sorted[k * 16 + 8], _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1))));
+        }
+
+        for (uint32_t l = 0; l < 16; l += 4)
+            combineSorted4SSE2(&sorted[l], 16, count, kappa, out + i + l);
+    }
+    return i;
+}
+
+static size_t combine16SSE2(const uint16_t *const *frames, uint32_t count, const SortingNetwork &net, size_t offset, size_t n,
+                            float kappa, float *out, size_t start)
+{
+    // No unsigned 16-bit min/max before SSE4.1: flip the sign bit and compare signed
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    std::vector<uint16_t> work((size_t)count * 8);
+    std::vector<float> sorted((size_t)count * 8);
+    __m128i *w = (__m128i *)&work[0];
+    size_t i = start;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        for (uint32_t k = 0; k < count; k++)
+            _mm_storeu_si128(w + k, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(frames[k] + offset + i)), sign));
+
+        for (size_t c = 0; c < net.size(); c++)
+        {
+            __m128i a = _mm_loadu_si128(w + net[c].first);
+            __m128i b = _mm_loadu_si128(w + net[c].second);
+            _mm_storeu_si128(w + net[c].first, _mm_min_epi16(a, b));
+            _mm_storeu_si128(w + net[c].second, _mm_max_epi16(a, b));
+        }
+
+        for (uint32_t k = 0; k < count; k++)
+        {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128(w + k), sign);
+            _mm_storeu_ps(&sorted[k * 8], _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+            _mm_storeu_ps(&sorted[k * 8 + 4], _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+        }
+
+        combineSorted4SSE2(&sorted[0], 8, count, kappa, out + i);
+        combineSorted4SSE2(&sorted[4], 8, count, kappa, out + i + 4);
+    }
+    return i;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static size_t combine16NEON(const uint16_t *const *frames, uint32_t count, const SortingNetwork &net, size_t offset, size_t n,
+                            float kappa, float *out)
+{
+    std::vector<uint16_t> work((size_t)count * 8);
+    std::vector<float> sorted((size_t)count * 8);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        for (uint32_t k = 0; k < count; k++)
+            vst1q_u16(&work[k * 8], vld1q_u16(frames[k] + offset + i));
+
+        for (size_t c = 0; c < net.size(); c++)
+        {
+            uint16_t *pa = &work[net[c].first * 8];
+            uint16_t *pb = &work[net[c].second * 8];
+            uint16x8_t a = vld1q_u16(pa);
+            uint16x8_t b = vld1q_u16(pb);
+            vst1q_u16(pa, vminq_u16(a, b));
+            vst1q_u16(pb, vmaxq_u16(a, b));
+        }
+
+        for (uint32_t k = 0; k < count; k++)
+        {
+            uint16x8_t v = vld1q_u16(&work[k * 8]);
+            vst1q_f32(&sorted[k * 8], vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))));
+            vst1q_f32(&sorted[k * 8 + 4], vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))));
+        }
+
+        // The reduction is cheap next to the sort, it stays scalar here
+        for (uint32_t l = 0; l < 8; l++)
+            out[i + l] = combineSorted(&sorted[l], 8, count, kappa);
+    }
+    return i;
+}
+#endif
+
+void combine16(const uint16_t *const *frames, uint32_t count, size_t offset, size_t n, float kappa, float *out)
+{
+    SortingNetwork net;
+    size_t done = 0;
+
+    if (count == 0)
+        return;
+    buildSortingNetwork(count, net);
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = combine16AVX2(frames, count, net, offset, n, kappa, out);
+    done = combine16SSE2(frames, count, net, offset, n, kappa, out, done);
+#elif defined(KERNELS_NEON)
+    done = combine16NEON(frames, count, net, offset, n, kappa, out);
+#endif
+
+    combine16Scalar(frames, count, offset + done, n - done, kappa, out + done);
+}
+
+/////////////////////////////////////////////////////////
+/// Frame statistics
+/////////////////////////////////////////////////////////
+
+/* Min, max, sum and sum of squares are done in SIMD registers. The
+ * histogram has no SIMD form, it is filled from the same cache lines in
+ * the same loop, spread over several tables so that runs of equal pixels
+ * do not wait on each other's increments. */
+
+static const unsigned HIST8_TABLES = 4;
+static const unsigned HIST16_TABLES = 2;
+
+// Narrow accumulators are emptied into 64-bit totals this often (in loop iterations)
+static const size_t FLUSH_EVERY = 8192;
+
+// n is a multiple of TABLES, pixel i goes to table i % TABLES
+template <unsigned TABLES, typename T>
+static inline void histogramRun(const T *px, size_t n, uint32_t shift, uint32_t *tables, size_t bins)
+{
+    for (size_t i = 0; i < n; i += TABLES)
+        for (unsigned t = 0; t < TABLES; t++)
+            tables[t * bins + (px[i + t] >> shift)]++;
+}
+
+static void mergeTables(const uint32_t *tables, size_t bins, unsigned count, uint32_t *hist)
+{
+    for (size_t b = 0; b < bins; b++)
+    {
+        uint32_t sum = 0;
+        for (unsigned t = 0; t < count; t++)
+            sum += tables[t * bins + b];
+        hist[b] = sum;
+    }
+}
+
+template <typename T>
+static void frameStatsScalar(const T *px, size_t n, uint32_t shift, uint32_t *tables, size_t bins, unsigned count, FrameStats &stats)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t v = px[i];
+        tables[(i % count) * bins + (v >> shift)]++;
+        stats.min = std::min(stats.min, v);
+        stats.max = std::max(stats.max, v);
+        stats.sum += v;
+        stats.sumSquares += (uint64_t)v * v;
+    }
+}
+
+#ifdef KERNELS_X86
+static inline uint64_t sum64SSE2(__m128i v)
+{
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return lanes[0] + lanes[1];
+}
+
+static inline uint64_t sum32SSE2(__m128i v)
+{
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static size_t frameStats8SSE2(const uint8_t *px, size_t n, uint32_t *tables, FrameStats &stats)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_set1_epi8((char)0xFF), hi = zero, sum = zero, squares = zero;
+    uint8_t lanes[16];
+    size_t i = 0, iter = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(px + i));
+        __m128i w0 = _mm_unpacklo_epi8(v, zero);
+        __m128i w1 = _mm_unpackhi_epi8(v, zero);
+
+        lo = _mm_min_epu8(lo, v);
+        hi = _mm_max_epu8(hi, v);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+        squares = _mm_add_epi32(squares, _mm_add_epi32(_mm_madd_epi16(w0, w0), _mm_madd_epi16(w1, w1)));
+        if (++iter == FLUSH_EVERY)
+        {
+            stats.sumSquares += sum32SSE2(squares);
+            squares = zero;
+            iter = 0;
+        }
+        histogramRun<HIST8_TABLES>(px + i, 16, 0, tables, 256);
+    }
+    stats.sumSquares += sum32SSE2(squares);
+    stats.sum += sum64SSE2(sum);
+
+    if (i)
+    {
+        _mm_storeu_si128((__m128i *)lanes, lo);
+        stats.min = std::min<uint32_t>(stats.min, *std::min_element(lanes, lanes + 16));
+        _mm_storeu_si128((__m128i *)lanes, hi);
+        stats.max = std::max<uint32_t>(stats.max, *std::max_element(lanes, lanes + 16));
+    }
+    return i;
+}
+
+static size_t frameStats16SSE2(const uint16_t *px, size_t n, uint32_t shift, uint32_t *tables, FrameStats &stats)
+{
+    // Unsigned 16-bit min/max through the signed ones, with the sign bit flipped
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_set1_epi16(0x7FFF), hi = _mm_set1_epi16((short)0x8000), sum = zero, sum64 = zero, squares = zero;
+    uint16_t lanes[8];
+    size_t i = 0, iter = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(px + i));
+        __m128i s = _mm_xor_si128(v, sign);
+        // 32-bit squares from the low and high halves of the 16 x 16 products
+        __m128i pl = _mm_mullo_epi16(v, v);
+        __m128i ph = _mm_mulhi_epu16(v, v);
+        __m128i q0 = _mm_unpacklo_epi16(pl, ph);
+        __m128i q1 = _mm_unpackhi_epi16(pl, ph);
+
+        lo = _mm_min_epi16(lo, s);
+        hi = _mm_max_epi16(hi, s);
+        sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_unpacklo_epi16(v, zero), _mm_unpackhi_epi16(v, zero)));
+        squares = _mm_add_epi64(squares, _mm_add_epi64(_mm_unpacklo_epi32(q0, zero), _mm_unpackhi_epi32(q0, zero)));
+        squares = _mm_add_epi64(squares, _mm_add_epi64(_mm_unpacklo_epi32(q1, zero), _mm_unpackhi_epi32(q1, zero)));
+        if (++iter == FLUSH_EVERY)
+        {
+            sum64 = _mm_add_epi64(sum64, _mm_add_epi64(_mm_unpacklo_epi32(sum, zero), _mm_unpackhi_epi32(sum, zero)));
+            sum = zero;
+            iter = 0;
+        }
+        histogramRun<HIST16_TABLES>(px + i, 8, shift, tables, 65536 >> shift);
+    }
+    sum64 = _mm_add_epi64(sum64, _mm_add_epi64(_mm_unpacklo_epi32(sum, zero), _mm_unpackhi_epi32(sum, zero)));
+    stats.sum += sum64SSE2(sum64);
+    stats.sumSquares += sum64SSE2(squares);
+
+    if (i)
+    {
+        _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(lo, sign));
+        stats.min = std::min<uint32_t>(stats.min, *std::min_element(lanes, lanes + 8));
+        _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(hi, sign));
+        stats.max = std::max<uint32_t>(stats.max, *std::max_element(lanes, lanes + 8));
+    }
+    return i;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static size_t frameStats8NEON(const uint8_t *px, size_t n, uint32_t *tables, FrameStats &stats)
+{
+    uint8x16_t lo = vdupq_n_u8(0xFF), hi = vdupq_n_u8(0);
+    uint32x4_t sum = vdupq_n_u32(0), squares = vdupq_n_u32(0);
+    uint64x2_t sum64 = vdupq_n_u64(0), squares64 = vdupq_n_u64(0);
+    uint8_t lanes[16];
+    size_t i = 0, iter = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(px + i);
+
+        lo = vminq_u8(lo, v);
+        hi = vmaxq_u8(hi, v);
+        sum = vpadalq_u16(sum, vpaddlq_u8(v));
+        squares = vpadalq_u16(squares, vmull_u8(vget_low_u8(v), vget_low_u8(v)));
+        squares = vpadalq_u16(squares, vmull_u8(vget_high_u8(v), vget_high_u8(v)));
+        if (++iter == FLUSH_EVERY)
+        {
+            sum64 = vpadalq_u32(sum64, sum);
+            squares64 = vpadalq_u32(squares64, squares);
+            sum = vdupq_n_u32(0);
+            squares = vdupq_n_u32(0);
+            iter = 0;
+        }
+        histogramRun<HIST8_TABLES>(px + i, 16, 0, tables, 256);
+    }
+    sum64 = vpadalq_u32(sum64, sum);
+    squares64 = vpadalq_u32(squares64, squares);
+    stats.sum += vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1);
+    stats.sumSquares += vgetq_lane_u64(squares64, 0) + vgetq_lane_u64(squares64, 1);
+
+    if (i)
+    {
+        vst1q_u8(lanes, lo);
+        stats.min = std::min<uint32_t>(stats.min, *std::min_element(lanes, lanes + 16));
+        vst1q_u8(lanes, hi);
+        stats.max = std::max<uint32_t>(stats.max, *std::max_element(lanes, lanes + 16));
+    }
+    return i;
+}
+
+static size_t frameStats16NEON(const uint16_t *px, size_t n, uint32_t shift, uint32_t *tables, FrameStats &stats)
+{
+    uint16x8_t lo = vdupq_n_u16(0xFFFF), hi = vdupq_n_u16(0);
+    uint32x4_t sum = vdupq_n_u32(0);
+    uint64x2_t sum64 = vdupq_n_u64(0), squares = vdupq_n_u64(0);
+    uint16_t lanes[8];
+    size_t i = 0, iter = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(px + i);
+
+        lo = vminq_u16(lo, v);
+        hi = vmaxq_u16(hi, v);
+        sum = vpadalq_u16(sum, v);
+        squares = vpadalq_u32(squares, vmull_u16(vget_low_u16(v), vget_low_u16(v)));
+        squares = vpadalq_u32(squares, vmull_u16(vget_high_u16(v), vget_high_u16(v)));
+        if (++iter == FLUSH_EVERY)
+        {
+            sum64 = vpadalq_u32(sum64, sum);
+            sum = vdupq_n_u32(0);
+            iter = 0;
+        }
+        histogramRun<HIST16_TABLES>(px + i, 8, shift, tables, 65536 >> shift);
+    }
+    sum64 = vpadalq_u32(sum64, sum);
+    stats.sum += vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1);
+    stats.sumSquares += vgetq_lane_u64(squares, 0) + vgetq_lane_u64(squares, 1);
+
+    if (i)
+    {
+        vst1q_u16(lanes, lo);
+        stats.min = std::min<uint32_t>(stats.min, *std::min_element(lanes, lanes + 8));
+        vst1q_u16(lanes, hi);
+        stats.max = std::max<uint32_t>(stats.max, *std::max_element(lanes, lanes + 8));
+    }
+    return i;
+}
+#endif
+
+static void resetStats(FrameStats &stats)
+{
+    stats.min = UINT32_MAX;
+    stats.max = 0;
+    stats.sum = 0;
+    stats.sumSquares = 0;
+}
+
+static void finishStats(FrameStats &stats, size_t n)
+{
+    if (n == 0)
+        stats.min = 0;
+}
+
+void frameStats8Scalar(const uint8_t *px, size_t n, uint32_t *hist, FrameStats &stats)
+{
+    resetStats(stats);
+    memset(hist, 0, 256 * sizeof(uint32_t));
+    frameStatsScalar(px, n, 0, hist, 256, 1, stats);
+    finishStats(stats, n);
+}
+
+void frameStats16Scalar(const uint16_t *px, size_t n, uint32_t shift, uint32_t *hist, FrameStats &stats)
+{
+    resetStats(stats);
+    memset(hist, 0, (65536 >> shift) * sizeof(uint32_t));
+    frameStatsScalar(px, n, shift, hist, 65536 >> shift, 1, stats);
+    finishStats(stats, n);
+}
+
+void frameStats8(const uint8_t *px, size_t n, uint32_t *hist, FrameStats &stats)
+{
+    std::vector<uint32_t> tables(HIST8_TABLES * 256);
+    size_t done = 0;
+
+    resetStats(stats);
+#if defined(KERNELS_X86)
+    done = frameStats8SSE2(px, n, &tables[0], stats);
+#elif defined(KERNELS_NEON)
+    done = frameStats8NEON(px, n, &tables[0], stats);
+#endif
+    frameStatsScalar(px + done, n - done, 0, &tables[0], 256, 1, stats);
+    mergeTables(&tables[0], 256, HIST8_TABLES, hist);
+    finishStats(stats, n);
+}
+
+void frameStats16(const uint16_t *px, size_t n, uint32_t shift, uint32_t *hist, FrameStats &stats)
+{
+    size_t bins = 65536 >> shift;
+    std::vector<uint32_t> tables(HIST16_TABLES * bins);
+    size_t done = 0;
+
+    resetStats(stats);
+#if defined(KERNELS_X86)
+    done = frameStats16SSE2(px, n, shift, &tables[0], stats);
+#elif defined(KERNELS_NEON)
+    done = frameStats16NEON(px, n, shift, &tables[0], stats);
+#endif
+    frameStatsScalar(px + done, n - done, shift, &tables[0], bins, 1, stats);
+    mergeTables(&tables[0], bins, HIST16_TABLES, hist);
+    finishStats(stats, n);
+}
+
+/////////////////////////////////////////////////////////
+/// Laplacian variance
+/////////////////////////////////////////////////////////
+
+/* L = 4c - up - down - left - right over the interior pixels, in 16-bit
+ * lanes: 12-bit input keeps L within +-16380. Sums of L go through 32-bit
+ * lanes, which hold a whole row; squares are moved into 64-bit lanes as
+ * they come. */
+
+struct LaplacianSums
+{
+    int64_t sum;
+    uint64_t squares;
+};
+
+template <typename T>
+static inline void laplacianRowScalar(const T *row, uint32_t w, uint32_t shift, uint32_t x, LaplacianSums &sums)
+{
+    const T *up = row - w, *down = row + w;
+
+    for (; x + 1 < w; x++)
+    {
+        int32_t l = 4 * (row[x] >> shift) - (up[x] >> shift) - (down[x] >> shift) - (row[x - 1] >> shift) - (row[x + 1] >> shift);
+        sums.sum += l;
+        sums.squares += (int64_t)l * l;
+    }
+}
+
+static double laplacianResult(const LaplacianSums &sums, uint32_t w, uint32_t h)
+{
+    double n = (double)(w - 2) * (h - 2), mean;
+
+    if (w < 3 || h < 3)
+        return 0;
+    mean = sums.sum / n;
+    return sums.squares / n - mean * mean;
+}
+
+#ifdef KERNELS_X86
+static inline void laplacianAccumulateSSE2(__m128i l, __m128i &sum, __m128i &squares)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sq = _mm_madd_epi16(l, l);
+
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(l, _mm_set1_epi16(1)));
+    squares = _mm_add_epi64(squares, _mm_add_epi64(_mm_unpacklo_epi32(sq, zero), _mm_unpackhi_epi32(sq, zero)));
+}
+
+static inline void laplacianFinishRowSSE2(__m128i sum, __m128i squares, LaplacianSums &sums)
+{
+    int32_t s[4];
+    uint64_t q[2];
+
+    _mm_storeu_si128((__m128i *)s, sum);
+    _mm_storeu_si128((__m128i *)q, squares);
+    sums.sum += (int64_t)s[0] + s[1] + s[2] + s[3];
+    sums.squares += q[0] + q[1];
+}
+
+static uint32_t laplacianRow8SSE2(const uint8_t *row, uint32_t w, LaplacianSums &sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero, squares = zero;
+    uint32_t x = 1;
+
+    for (; x + 9 <= w; x += 8)
+    {
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x)), zero);
+        __m128i l = _mm_slli_epi16(c, 2);
+        l = _mm_sub_epi16(l, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x - 1)), zero));
+        l = _mm_sub_epi16(l, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x + 1)), zero));
+        l = _mm_sub_epi16(l, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x - w)), zero));
+        l = _mm_sub_epi16(l, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x + w)), zero));
+        laplacianAccumulateSSE2(l, sum, squares);
+    }
+    laplacianFinishRowSSE2(sum, squares, sums);
+    return x;
+}
+
+static uint32_t laplacianRow16SSE2(const uint16_t *row, uint32_t w, uint32_t shift, LaplacianSums &sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    __m128i sum = zero, squares = zero;
+    uint32_t x = 1;
+
+    for (; x + 9 <= w; x += 8)
+    {
+        __m128i l = _mm_slli_epi16(_mm_srl_epi16(_mm_loadu_si128((const __m128i *)(row + x)), count), 2);
+        l = _mm_sub_epi16(l, _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(row + x - 1)), count));
+        l = _mm_sub_epi16(l, _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(row + x + 1)), count));
+        l = _mm_sub_epi16(l, _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(row + x - w)), count));
+        l = _mm_sub_epi16(l, _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(row + x + w)), count));
+        laplacianAccumulateSSE2(l, sum, squares);
+    }
+    laplacianFinishRowSSE2(sum, squares, sums);
+    return x;
+}
+
+TARGET_AVX2 static inline void laplacianAccumulateAVX2(__m256i l, __m256i &sum, __m256i &squares)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sq = _mm256_madd_epi16(l, l);
+
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(l, _mm256_set1_epi16(1)));
+    squares = _mm256_add_epi64(squares, _mm256_add_epi64(_mm256_unpacklo_epi32(sq, zero), _mm256_unpackhi_epi32(sq, zero)));
+}
+
+TARGET_AVX2 static inline void laplacianFinishRowAVX2(__m256i sum, __m256i squares, LaplacianSums &sums)
+{
+    int32_t s[8];
+    uint64_t q[4];
+
+    _mm256_storeu_si256((__m256i *)s, sum);
+    _mm256_storeu_si256((__m256i *)q, squares);
+    for (int i = 0; i < 8; i++)
+        sums.sum += s[i];
+    sums.squares += q[0] + q[1] + q[2] + q[3];
+}
+
+TARGET_AVX2 static uint32_t laplacianRow8AVX2(const uint8_t *row, uint32_t w, LaplacianSums &sums)
+{
+    __m256i sum = _mm256_setzero_si256(), squares = _mm256_setzero_si256();
+    uint32_t x = 1;
+
+    for (; x + 17 <= w; x += 16)
+    {
+        __m256i l = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + x))), 2);
+        l = _mm256_sub_epi16(l, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + x - 1))));
+        l = _mm256_sub_epi16(l, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + x + 1))));
+        l = _mm256_sub_epi16(l, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + x - w))));
+        l = _mm256_sub_epi16(l, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + x + w))));
+        laplacianAccumulateAVX2(l, sum, squares);
+    }
+    laplacianFinishRowAVX2(sum, squares, sums);
+    return x;
+}
+
+TARGET_AVX2 static uint32_t laplacianRow16AVX2(const uint16_t *row, uint32_t w, uint32_t shift, LaplacianSums &sums)
+{
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    __m256i sum = _mm256_setzero_si256(), squares = _mm256_setzero_si256();
+    uint32_t x = 1;
+
+    for (; x + 17 <= w; x += 16)
+    {
+        __m256i l = _mm256_slli_epi16(_mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(row + x)), count), 2);
+        l = _mm256_sub_epi16(l, _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(row + x - 1)), count));
+        l = _mm256_sub_epi16(l, _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(row + x + 1)), count));
+        l = _mm256_sub_epi16(l, _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(row + x - w)), count));
+        l = _mm256_sub_epi16(l, _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(row + x + w)), count));
+        laplacianAccumulateAVX2(l, sum, squares);
+    }
+    laplacianFinishRowAVX2(sum, squares, sums);
+    return x;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static inline void laplacianAccumulateNEON(int16x8_t l, int32x4_t &sum, uint64x2_t &squares)
+{
+    int32x4_t sq = vmull_s16(vget_low_s16(l), vget_low_s16(l));
+    sq = vmlal_s16(sq, vget_high_s16(l), vget_high_s16(l));
+    sum = vpadalq_s16(sum, l);
+    squares = vpadalq_u32(squares, vreinterpretq_u32_s32(sq));
+}
+
+static inline void laplacianFinishRowNEON(int32x4_t sum, uint64x2_t squares, LaplacianSums &sums)
+{
+    sums.sum += (int64_t)vgetq_lane_s32(sum, 0) + vgetq_lane_s32(sum, 1) + vgetq_lane_s32(sum, 2) + vgetq_lane_s32(sum, 3);
+    sums.squares += vgetq_lane_u64(squares, 0) + vgetq_lane_u64(squares, 1);
+}
+
+static uint32_t laplacianRow8NEON(const uint8_t *row, uint32_t w, LaplacianSums &sums)
+{
+    int32x4_t sum = vdupq_n_s32(0);
+    uint64x2_t squares = vdupq_n_u64(0);
+    uint32_t x = 1;
+
+    for (; x + 9 <= w; x += 8)
+    {
+        int16x8_t l = vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(row + x), 2));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vmovl_u8(vld1_u8(row + x - 1))));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vmovl_u8(vld1_u8(row + x + 1))));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vmovl_u8(vld1_u8(row + x - w))));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vmovl_u8(vld1_u8(row + x + w))));
+        laplacianAccumulateNEON(l, sum, squares);
+    }
+    laplacianFinishRowNEON(sum, squares, sums);
+    return x;
+}
+
+static uint32_t laplacianRow16NEON(const uint16_t *row, uint32_t w, uint32_t shift, LaplacianSums &sums)
+{
+    const int16x8_t count = vdupq_n_s16(-(int16_t)shift);
+    int32x4_t sum = vdupq_n_s32(0);
+    uint64x2_t squares = vdupq_n_u64(0);
+    uint32_t x = 1;
+
+    for (; x + 9 <= w; x += 8)
+    {
+        int16x8_t l = vreinterpretq_s16_u16(vshlq_n_u16(vshlq_u16(vld1q_u16(row + x), count), 2));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vshlq_u16(vld1q_u16(row + x - 1), count)));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vshlq_u16(vld1q_u16(row + x + 1), count)));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vshlq_u16(vld1q_u16(row + x - w), count)));
+        l = vsubq_s16(l, vreinterpretq_s16_u16(vshlq_u16(vld1q_u16(row + x + w), count)));
+        laplacianAccumulateNEON(l, sum, squares);
+    }
+    laplacianFinishRowNEON(sum, squares, sums);
+    return x;
+}
+#endif
+
+double laplacianVariance8Scalar(const uint8_t *px, uint32_t w, uint32_t h)
+{
+    LaplacianSums sums = { 0, 0 };
+
+    for (uint32_t y = 1; y + 1 < h; y++)
+        laplacianRowScalar(px + (size_t)y * w, w, 0, 1, sums);
+    return laplacianResult(sums, w, h);
+}
+
+double laplacianVariance16Scalar(const uint16_t *px, uint32_t w, uint32_t h, uint32_t shift)
+{
+    LaplacianSums sums = { 0, 0 };
+
+    for (uint32_t y = 1; y + 1 < h; y++)
+        laplacianRowScalar(px + (size_t)y * w, w, shift, 1, sums);
+    return laplacianResult(sums, w, h);
+}
+
+double laplacianVariance8(const uint8_t *px, uint32_t w, uint32_t h)
+{
+    LaplacianSums sums = { 0, 0 };
+#if defined(KERNELS_X86)
+    bool avx2 = cpuHasAVX2();
+#endif
+
+    for (uint32_t y = 1; y + 1 < h; y++)
+    {
+        const uint8_t *row = px + (size_t)y * w;
+        uint32_t x = 1;
+#if defined(KERNELS_X86)
+        x = avx2 ? laplacianRow8AVX2(row, w, sums) : laplacianRow8SSE2(row, w, sums);
+#elif defined(KERNELS_NEON)
+        x = laplacianRow8NEON(row, w, sums);
+#endif
+        laplacianRowScalar(row, w, 0, x, sums);
+    }
+    return laplacianResult(sums, w, h);
+}
+
+double laplacianVariance16(const uint16_t *px, uint32_t w, uint32_t h, uint32_t shift)
+{
+    LaplacianSums sums = { 0, 0 };
+#if defined(KERNELS_X86)
+    bool avx2 = cpuHasAVX2();
+#endif
+
+    for (uint32_t y = 1; y + 1 < h; y++)
+    {
+        const uint16_t *row = px + (size_t)y * w;
+        uint32_t x = 1;
+#if defined(KERNELS_X86)
+        x = avx2 ? laplacianRow16AVX2(row, w, shift, sums) : laplacianRow16SSE2(row, w, shift, sums);
+#elif defined(KERNELS_NEON)
+        x = laplacianRow16NEON(row, w, shift, sums);
+#endif
+        laplacianRowScalar(row, w, shift, x, sums);
+    }
+    return laplacianResult(sums, w, h);
+}
+
+/////////////////////////////////////////////////////////
+/// Frame difference
+/////////////////////////////////////////////////////////
+
+uint64_t frameDifference8Scalar(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    return sum;
+}
+
+uint64_t frameDifference16Scalar(const uint16_t *a, const uint16_t *b, size_t n)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    return sum;
+}
+
+/* 8-bit differences go through psadbw straight into 64-bit lanes. 16-bit
+ * ones are summed in 32-bit lanes, which are emptied every DIFF_BLOCK16
+ * pixels before they can overflow. */
+static const size_t DIFF_BLOCK16 = 65536;
+
+#ifdef KERNELS_X86
+TARGET_AVX2 static size_t frameDifference8AVX2(const uint8_t *a, const uint8_t *b, size_t n, uint64_t &sum)
+{
+    __m256i acc = _mm256_setzero_si256();
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                               _mm256_loadu_si256((const __m256i *)(b + i))));
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return i;
+}
+
+static size_t frameDifference8SSE2(const uint8_t *a, const uint8_t *b, size_t n, size_t start, uint64_t &sum)
+{
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lanes[2];
+    size_t i = start;
+
+    for (; i + 16 <= n; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += lanes[0] + lanes[1];
+    return i;
+}
+
+TARGET_AVX2 static size_t frameDifference16AVX2(const uint16_t *a, const uint16_t *b, size_t n, uint64_t &sum)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i + 16 <= n)
+    {
+        size_t end = std::min(n, i + DIFF_BLOCK16);
+        __m256i acc = zero;
+        uint32_t lanes[8];
+
+        for (; i + 16 <= end; i += 16)
+        {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+            __m256i d = _mm256_or_si256(_mm256_subs_epu16(va, vb), _mm256_subs_epu16(vb, va));
+            acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_unpacklo_epi16(d, zero), _mm256_unpackhi_epi16(d, zero)));
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (int j = 0; j < 8; j++)
+            sum += lanes[j];
+    }
+    return i;
+}
+
+static size_t frameDifference16SSE2(const uint16_t *a, const uint16_t *b, size_t n, size_t start, uint64_t &sum)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = start;
+
+    while (i + 8 <= n)
+    {
+        size_t end = std::min(n, i + DIFF_BLOCK16);
+        __m128i acc = zero;
+        uint32_t lanes[4];
+
+        for (; i + 8 <= end; i += 8)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i d = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(d, zero), _mm_unpackhi_epi16(d, zero)));
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return i;
+}
+#endif
+
+#ifdef KERNELS_NEON
+static size_t frameDifference8NEON(const uint8_t *a, const uint8_t *b, size_t n, uint64_t &sum)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+        acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)))));
+    sum += vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+    return i;
+}
+
+static size_t frameDifference16NEON(const uint16_t *a, const uint16_t *b, size_t n, uint64_t &sum)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+        acc = vpadalq_u32(acc, vpaddlq_u16(vabdq_u16(vld1q_u16(a + i), vld1q_u16(b + i))));
+    sum += vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+    return i;
+}
+#endif
+
+uint64_t frameDifference8(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = frameDifference8AVX2(a, b, n, sum);
+    done = frameDifference8SSE2(a, b, n, done, sum);
+#elif defined(KERNELS_NEON)
+    done = frameDifference8NEON(a, b, n, sum);
+#endif
+
+    return sum + frameDifference8Scalar(a + done, b + done, n - done);
+}
+
+uint64_t frameDifference16(const uint16_t *a, const uint16_t *b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t done = 0;
+
+#if defined(KERNELS_X86)
+    if (cpuHasAVX2())
+        done = frameDifference16AVX2(a, b, n, sum);
+    done = frameDifference16SSE2(a, b, n, done, sum);
+#elif defined(KERNELS_NEON)
+    done = frameDifference16NEON(a, b, n, sum);
+#endif
+
+    return sum + frameDifference16Scalar(a + done, b + done, n - done);
+}
+
+void binSum8(uint16_t *dst, const uint8_t *src, uint32_t w, uint32_t h, uint32_t srcStride, uint32_t bin)
+{
+    uint32_t ow = w / bin, oh = h / bin;
+    uint32_t used = ow * bin;
+    std::vector<uint16_t> acc(used);
+
+    for (uint32_t oy = 0; oy < oh; oy++)
+    {
+        std::fill(acc.begin(), acc.end(), 0);
+        for (uint32_t r = 0; r < bin; r++)
+            accumulateRow8(&acc[0], src + (size_t)(oy * bin + r) * srcStride, used);
+
+        uint16_t *out = dst + (size_t)oy * ow;
+        for (uint32_t ox = 0; ox < ow; ox++)
+        {
+            const uint16_t *a = &acc[ox * bin];
+            uint16_t sum = 0;
+            for (uint32_t c = 0; c < bin; c++)
+                sum += a[c];
+            out[ox] = sum;
+        }
+    }
+}
+
+void binAverage16(uint16_t *dst, const uint8_t *src, uint32_t w, uint32_t h, uint32_t srcStride, uint32_t bin, bool bigEndian)
+{
+    uint32_t ow = w / bin, oh = h / bin;
+    uint32_t used = ow * bin;
+    uint32_t area = bin * bin;
+    std::vector<uint32_t> acc(used);
+
+    for (uint32_t oy = 0; oy < oh; oy++)
+    {
+        std::fill(acc.begin(), acc.end(), 0);
+        for (uint32_t r = 0; r < bin; r++)
+            accumulateRow16(&acc[0], src + (size_t)(oy * bin + r) * srcStride, used, bigEndian);
+
+        uint16_t *out = dst + (size_t)oy * ow;
+        for (uint32_t ox = 0; ox < ow; ox++)
+        {
+            const uint32_t *a = &acc[ox * bin];
+            uint32_t sum = 0;
+            for (uint32_t c = 0; c < bin; c++)
+                sum += a[c];
+            out[ox] = (uint16_t)((sum + area / 2) / area);
+        }
+    }
+}
@@ -0,0 +1,93 @@
+/**
+ * Pixel kernels used on the frame path of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FRAME_KERNELS_H
+#define FRAME_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Each kernel has a scalar version and SSE2/AVX2 (x86) or NEON (ARM)
+ * versions. AVX2 is picked at run time when the CPU has it, so the same
+ * binary runs on older hosts. */
+
+// Copy n big-endian 16-bit samples from src into dst in host byte order
+void unpackBigEndian16(uint16_t *dst, const uint8_t *src, size_t n);
+void unpackBigEndian16Scalar(uint16_t *dst, const uint8_t *src, size_t n);
+
+/* bin x bin software binning of a w x h region. Output is (w / bin) x (h / bin);
+ * leftover columns and rows are dropped. Strides are in bytes.
+ * 8-bit input is summed into 16-bit output, which cannot overflow for bin <= 16.
+ * 16-bit input is averaged so the result keeps the sensor's scale. */
+void binSum8(uint16_t *dst, const uint8_t *src, uint32_t w, uint32_t h, uint32_t srcStride, uint32_t bin);
+void binAverage16(uint16_t *dst, const uint8_t *src, uint32_t w, uint32_t h, uint32_t srcStride, uint32_t bin, bool bigEndian);
+
+/* Sub-exposure stacking: add n samples into a 32-bit accumulator. 16-bit
+ * input is either big-endian straight from the camera or in host order. */
+void stackAdd8(uint32_t *acc, const uint8_t *src, size_t n);
+void stackAdd8Scalar(uint32_t *acc, const uint8_t *src, size_t n);
+void stackAdd16(uint32_t *acc, const uint8_t *src, size_t n, bool bigEndian);
+
+/* Dark subtraction and flat fielding fused into one pass over n pixels:
+ * px = (px - dark) * invFlat, rounded and clamped to the pixel range.
+ * Either dark or invFlat may be NULL. invFlat is the reciprocal of the
+ * normalised flat. 32-bit stacks scale the dark by darkScale sub-exposures. */
+void calibrate8(uint8_t *px, const float *dark, const float *invFlat, size_t n);
+void calibrate8Scalar(uint8_t *px, const float *dark, const float *invFlat, size_t n);
+void calibrate16(uint16_t *px, const float *dark, const float *invFlat, size_t n);
+void calibrate16Scalar(uint16_t *px, const float *dark, const float *invFlat, size_t n);
+void calibrate32(uint32_t *px, const float *dark, float darkScale, const float *invFlat, size_t n);
+
+/* Per-pixel combine of count frames into a master: the median, or with
+ * kappa > 0 the mean of what is left after clipping at kappa sigma around
+ * the median. Pixels [offset, offset + n) of every frame go to out[0, n). */
+void combine16(const uint16_t *const *frames, uint32_t count, size_t offset, size_t n, float kappa, float *out);
+void combine16Scalar(const uint16_t *const *frames, uint32_t count, size_t offset, size_t n, float kappa, float *out);
+
+/* One pass statistics of n pixels: exact min, max, sum and sum of squares,
+ * and a histogram. 8-bit pixels get 256 bins, 16-bit ones 65536 >> shift
+ * bins indexed by px >> shift. The histogram is filled, not added to. */
+struct FrameStats
+{
+    uint32_t min, max;
+    uint64_t sum;
+    uint64_t sumSquares;
+};
+
+void frameStats8(const uint8_t *px, size_t n, uint32_t *hist, FrameStats &stats);
+void frameStats8Scalar(const uint8_t *px, size_t n, uint32_t *hist, FrameStats &stats);
+void frameStats16(const uint16_t *px, size_t n, uint32_t shift, uint32_t *hist, FrameStats &stats);
+void frameStats16Scalar(const uint16_t *px, size_t n, uint32_t shift, uint32_t *hist, FrameStats &stats);
+
+/* Sharpness score for lucky imaging: the variance of the 4-neighbour
+ * Laplacian over the interior of a w x h frame. 16-bit pixels are shifted
+ * right by shift first and must then fit in 12 bits. */
+double laplacianVariance8(const uint8_t *px, uint32_t w, uint32_t h);
+double laplacianVariance8Scalar(const uint8_t *px, uint32_t w, uint32_t h);
+double laplacianVariance16(const uint16_t *px, uint32_t w, uint32_t h, uint32_t shift);
+double laplacianVariance16Scalar(const uint16_t *px, uint32_t w, uint32_t h, uint32_t shift);
+
+/* Sum of absolute differences between two frames of n pixels, for change
+ * detection on a stream */
+uint64_t frameDifference8(const uint8_t *a, const uint8_t *b, size_t n);
+uint64_t frameDifference8Scalar(const uint8_t *a, const uint8_t *b, size_t n);
+uint64_t frameDifference16(const uint16_t *a, const uint16_t *b, size_t n);
+uint64_t frameDifference16Scalar(const uint16_t *a, const uint16_t *b, size_t n);
+
+#endif // FRAME_KERNELS_H
@@ -0,0 +1,136 @@
+/**
+ * Binary frame log of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "frame_log.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const char FRAME_LOG_MAGIC[8] = { 'P', 'G', 'F', 'R', 'L', 'O', 'G', '1' };
+
+// Disk space is reserved this far ahead
+static const uint64_t RESERVE_STEP = 256 << 20;
+// Mapped at a time, moved along as the log grows
+static const size_t WINDOW_SIZE = 64 << 20;
+
+FrameLog::FrameLog() : fd(-1), frameBytes(0), rowBytes(0), frames(0), end(0), reserved(0), window(NULL), windowStart(0), windowSize(0)
+{
+}
+
+FrameLog::~FrameLog()
+{
+    close();
+}
+
+bool FrameLog::open(const std::string &name, const FrameLogHeader &header)
+{
+    close();
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        ::close(fd);
+        fd = -1;
+        unlink(name.c_str());
+        return false;
+    }
+
+    path = name;
+    frameBytes = header.frameBytes;
+    rowBytes = header.width * (header.bpp / 8);
+    frames = 0;
+    end = reserved = sizeof(header);
+    return true;
+}
+
+bool FrameLog::append(const FrameLogRecord &record, const uint8_t *frame, size_t stride)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    size_t bytes = sizeof(record) + frameBytes;
+    uint8_t *dst;
+
+    if (fd < 0)
+        return false;
+
+    if (end + bytes > reserved)
+    {
+        uint64_t step = std::max(RESERVE_STEP, (uint64_t)bytes);
+        if (posix_fallocate(fd, reserved, step) != 0)
+            return false;
+        reserved += step;
+    }
+
+    // Records may straddle pages but never the window
+    if (!window || end + bytes > windowStart + windowSize)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+
+        if (window)
+            munmap(window, windowSize);
+        windowStart = end - end % page;
+        windowSize = std::max(WINDOW_SIZE, (bytes + 2 * page) / page * page);
+        window = (uint8_t *)mmap(NULL, windowSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, windowStart);
+        if (window == MAP_FAILED)
+        {
+            window = NULL;
+            return false;
+        }
+    }
+
+    dst = window + (end - windowStart);
+    memcpy(dst, &record, sizeof(record));
+    dst += sizeof(record);
+    // Padded rows are packed, the log holds only the pixels
+    if (stride == rowBytes || !rowBytes)
+        memcpy(dst, frame, frameBytes);
+    else
+        for (size_t row = 0; row < frameBytes / rowBytes; row++)
+            memcpy(dst + row * rowBytes, frame + row * stride, rowBytes);
+    end += bytes;
+    frames++;
+    return true;
+}
+
+void FrameLog::close()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (fd < 0)
+        return;
+
+    if (window)
+        munmap(window, windowSize);
+    window = NULL;
+
+    if (pwrite(fd, &frames, sizeof(frames), offsetof(FrameLogHeader, frames)) != (ssize_t)sizeof(frames) ||
+            ftruncate(fd, end) != 0)
+    {
+        // The records are all there, a reader finds their end as in a crashed log
+    }
+    ::close(fd);
+    fd = -1;
+}
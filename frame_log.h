@@ -0,0 +1,115 @@
+/**
+ * Binary frame log of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FRAME_LOG_H
+#define FRAME_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+/* A log file is a FrameLogHeader followed by one FrameLogRecord and the
+ * frame exactly as the camera sent it per frame, all in host byte order
+ * except for 16-bit samples, which stay big-endian as they came off the
+ * bus. frames is only filled in when the log is closed. A log left behind
+ * by a crash has 0 there and keeps the zeros reserved past its last frame,
+ * so its frames end at the first record with a timestamp of 0. */
+struct FrameLogHeader
+{
+    char magic[8];
+    uint32_t width, height;
+    uint32_t bpp;               // 8 or 16
+    uint32_t bigEndian;
+    uint32_t x, y;              // region of interest on the sensor
+    uint32_t frameBytes;
+    uint32_t frames;
+    float shutter;              // seconds
+    float gain;                 // dB
+    double start;               // UTC when logging started
+    uint8_t reserved[8];
+};
+
+enum
+{
+    FRAME_LOG_CYCLE_SYNC = 1    // start comes from the camera's bus cycle timestamp
+};
+
+struct FrameLogRecord
+{
+    double start;               // UTC exposure start, seconds since 1970
+    uint64_t timestamp;         // dc1394 host time in microseconds the last packet arrived
+    uint32_t frameCounter;      // the camera's embedded counter, 0 when it has none
+    uint32_t flags;
+    uint32_t dropped;           // frames lost right before this one
+    uint32_t reserved;
+};
+
+extern const char FRAME_LOG_MAGIC[8];
+
+/* Appends go through a window of the file mapped into memory, so logging a
+ * frame is a copy. Space is reserved ahead in large steps; running out of
+ * disk fails an append rather than faulting on the mapping. */
+class FrameLog
+{
+public:
+    FrameLog();
+    ~FrameLog();
+
+    bool open(const std::string &path, const FrameLogHeader &header);
+    // Safe to call from another thread than open and close. Rows of frame are stride bytes apart.
+    bool append(const FrameLogRecord &record, const uint8_t *frame, size_t stride);
+    // Write the frame count, trim the reserved space and close
+    void close();
+
+    bool isOpen() const
+    {
+        return fd >= 0;
+    }
+    const std::string &name() const
+    {
+        return path;
+    }
+    // Bytes and frames so far
+    uint64_t size() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return end;
+    }
+    uint32_t count() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return frames;
+    }
+
+private:
+    mutable std::mutex lock;
+    std::string path;
+    int fd;
+    size_t frameBytes;
+    size_t rowBytes;
+    uint32_t frames;
+    uint64_t end;               // where the next record goes
+    uint64_t reserved;          // file size allocated so far
+    uint8_t *window;
+    uint64_t windowStart;
+    size_t windowSize;
+};
+
+#endif // FRAME_LOG_H
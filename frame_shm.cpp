@@ -0,0 +1,130 @@
+/**
+ * Shared memory frame ring of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "frame_shm.h"
+
+#include <fcntl.h>
+#include <new>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const char FRAME_SHM_MAGIC[8] = { 'P', 'G', 'F', 'R', 'S', 'H', 'M', '1' };
+
+// Readers in other processes rely on the atomics working without a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64-bit atomics must be lock free to be shared between processes");
+static_assert(sizeof(FrameShmHeader) == 64 && sizeof(FrameShmSlot) == 64, "ring layout changed");
+
+// Slots start on a page, which keeps the pixels aligned for SIMD readers
+static const size_t PAGE = 4096;
+
+FrameShm::FrameShm() : base(NULL), size(0), slots(0), slotBytes(0), frames(0)
+{
+}
+
+FrameShm::~FrameShm()
+{
+    close();
+}
+
+bool FrameShm::open(const std::string &name, uint32_t count, size_t frameBytes)
+{
+    FrameShmHeader * header;
+    uint32_t i;
+    int fd;
+
+    close();
+
+    slots = count;
+    slotBytes = (sizeof(FrameShmSlot) + frameBytes + PAGE - 1) / PAGE * PAGE;
+    size = PAGE + slots * slotBytes;
+
+    // A new object every time, a reader still mapping the old one is not written under
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, size) != 0)
+    {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    base = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+    {
+        base = NULL;
+        shm_unlink(name.c_str());
+        return false;
+    }
+    path = name;
+    frames = 0;
+
+    header = new (base) FrameShmHeader;
+    header->headerBytes = PAGE;
+    header->slots = slots;
+    header->slotBytes = slotBytes;
+    header->latest.store(0, std::memory_order_relaxed);
+    for (i = 0; i < slots; i++)
+        new (base + PAGE + i * slotBytes) FrameShmSlot();
+
+    // Readers only accept the ring once the magic is there
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, FRAME_SHM_MAGIC, sizeof(header->magic));
+    return true;
+}
+
+void FrameShm::close()
+{
+    if (base == NULL)
+        return;
+    munmap(base, size);
+    shm_unlink(path.c_str());
+    base = NULL;
+}
+
+uint64_t FrameShm::offset(uint64_t frame) const
+{
+    return PAGE + (frame - 1) % slots * slotBytes + sizeof(FrameShmSlot);
+}
+
+uint64_t FrameShm::publish(const FrameShmInfo &info, const uint8_t *image)
+{
+    FrameShmHeader * header = (FrameShmHeader *)base;
+    FrameShmSlot * slot;
+    uint64_t n;
+
+    if (base == NULL || sizeof(FrameShmSlot) + info.bytes > slotBytes)
+        return 0;
+
+    n = ++frames;
+    slot = (FrameShmSlot *)(base + offset(n) - sizeof(FrameShmSlot));
+
+    // Odd while the slot is being filled
+    slot->sequence.store(2 * n - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->info = info;
+    memcpy((uint8_t *)(slot + 1), image, info.bytes);
+
+    slot->sequence.store(2 * n, std::memory_order_release);
+    header->latest.store(n, std::memory_order_release);
+    return n;
+}
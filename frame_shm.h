@@ -0,0 +1,106 @@
+/**
+ * Shared memory frame ring of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FRAME_SHM_H
+#define FRAME_SHM_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/* The ring is a POSIX shared memory object: a FrameShmHeader followed by
+ * slots of slotBytes each, a FrameShmSlot then the pixels, in host byte
+ * order. Frames are numbered from 1 and frame n goes to slot (n - 1) % slots.
+ *
+ * There is no lock. The writer makes a slot's sequence odd, fills it, sets
+ * sequence to 2 * n and then latest to n. A reader takes latest, checks the
+ * slot's sequence is 2 * latest, uses the pixels where they are and reads
+ * sequence again afterwards; if it has changed the writer came round and the
+ * frame has to be dropped. Readers map the object read-only and never write. */
+struct FrameShmHeader
+{
+    char magic[8];
+    uint32_t headerBytes;       // where the first slot starts
+    uint32_t slots;
+    uint64_t slotBytes;         // FrameShmSlot included
+    std::atomic<uint64_t> latest; // the newest complete frame, 0 before the first
+    uint8_t reserved[32];
+};
+
+struct FrameShmInfo
+{
+    double time;                // UTC mid exposure, seconds since 1970
+    double exposure;            // seconds
+    uint32_t width, height;
+    uint32_t bpp;               // 8, 16 or 32
+    uint32_t bytes;
+    uint32_t x, y;              // subframe on the sensor, binned pixels
+    uint32_t binning;
+    uint32_t reserved;
+};
+
+struct FrameShmSlot
+{
+    std::atomic<uint64_t> sequence;
+    FrameShmInfo info;
+    uint8_t reserved[8];
+};
+
+extern const char FRAME_SHM_MAGIC[8];
+
+class FrameShm
+{
+public:
+    FrameShm();
+    ~FrameShm();
+
+    // Creates the object, replacing one left behind under the same name
+    bool open(const std::string &name, uint32_t slots, size_t frameBytes);
+    // Removes the object, readers keep their mapping until they unmap it
+    void close();
+
+    // Returns the frame number, 0 if the frame does not fit a slot
+    uint64_t publish(const FrameShmInfo &info, const uint8_t *image);
+
+    bool isOpen() const
+    {
+        return base != NULL;
+    }
+    const std::string &name() const
+    {
+        return path;
+    }
+    uint32_t slotCount() const
+    {
+        return slots;
+    }
+    // Where a frame's pixels start in the object
+    uint64_t offset(uint64_t frame) const;
+
+private:
+    std::string path;
+    uint8_t *base;
+    size_t size;
+    uint32_t slots;
+    uint64_t slotBytes;
+    uint64_t frames;
+};
+
+#endif // FRAME_SHM_H
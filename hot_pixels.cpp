@@ -0,0 +1,291 @@
+/**
+ * Hot and dead pixel map of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "hot_pixels.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Plain text, one bad pixel per line after the version:
+ *
+ *   version 1
+ *   hot <bin> <x> <y>
+ *   dead <bin> <x> <y>
+ */
+static const int MAP_VERSION = 1;
+
+// Hot: this many (robust) sigma above the dark's median, and at least 1% of full scale
+static const float HOT_SIGMA = 5.0f;
+static const float HOT_FLOOR = 0.01f;
+// Dead: less than half the flat's median response
+static const float DEAD_RESPONSE = 0.5f;
+// More outliers than this fraction means a bad master, not bad pixels
+static const size_t MAX_FRACTION = 100;
+
+static std::string mapDir()
+{
+    const char *home = getenv("HOME");
+    return std::string(home ? home : "/tmp") + "/.indi";
+}
+
+bool HotPixelMap::load(uint64_t guid)
+{
+    char name[64];
+    char line[128], kind[8];
+    unsigned int bin, x, y;
+    int version = 0;
+    FILE *fp;
+
+    clear();
+    snprintf(name, sizeof(name), "/dc1394_pgrey_%016llx.hotpixels", (unsigned long long)guid);
+    path = mapDir() + name;
+
+    fp = fopen(path.c_str(), "r");
+    if (!fp)
+        return false;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (!strncmp(line, "version ", 8))
+        {
+            version = atoi(line + 8);
+        }
+        else if (sscanf(line, "%7s %u %u %u", kind, &bin, &x, &y) == 4 && bin > 0)
+        {
+            BadPixel p;
+            p.source = strcmp(kind, "dead") ? MASTER_DARK : MASTER_FLAT;
+            p.bin = bin;
+            p.x = x;
+            p.y = y;
+            pixels.push_back(p);
+        }
+    }
+    fclose(fp);
+
+    if (version != MAP_VERSION)
+    {
+        pixels.clear();
+        return false;
+    }
+    return true;
+}
+
+void HotPixelMap::clear()
+{
+    pixels.clear();
+    fixes.clear();
+    prepared = false;
+}
+
+bool HotPixelMap::save() const
+{
+    std::string tmp = path + ".tmp";
+    FILE *fp;
+
+    if (path.empty())
+        return false;
+
+    mkdir(mapDir().c_str(), 0755);
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+        return false;
+    fprintf(fp, "version %d\n", MAP_VERSION);
+    for (size_t i = 0; i < pixels.size(); i++)
+        fprintf(fp, "%s %u %u %u\n", pixels[i].source == MASTER_FLAT ? "dead" : "hot", pixels[i].bin, pixels[i].x, pixels[i].y);
+    if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+long HotPixelMap::learn(const MasterKey &key, const float *data)
+{
+    size_t n = (size_t)key.width * key.height;
+    std::vector<float> sample(data, data + n);
+    std::vector<BadPixel> found;
+    float median, sigma, low = -INFINITY, high = INFINITY;
+    size_t i;
+
+    if (key.type == MASTER_BIAS || n == 0)
+        return 0;
+
+    // Median and median absolute deviation, robust against the very pixels we are after
+    std::nth_element(sample.begin(), sample.begin() + n / 2, sample.end());
+    median = sample[n / 2];
+    for (i = 0; i < n; i++)
+        sample[i] = fabsf(data[i] - median);
+    std::nth_element(sample.begin(), sample.begin() + n / 2, sample.end());
+    sigma = 1.4826f * sample[n / 2];
+
+    if (key.type == MASTER_DARK)
+        high = median + std::max(HOT_SIGMA * sigma, HOT_FLOOR * (key.bpp == 16 ? 65535.0f : 255.0f));
+    else if (median > 0)
+        low = DEAD_RESPONSE * median;
+    else
+        return 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (data[i] > high || data[i] < low)
+        {
+            BadPixel p;
+            p.source = key.type;
+            p.bin = key.bin;
+            p.x = key.x + i % key.width;
+            p.y = key.y + i / key.width;
+            found.push_back(p);
+        }
+    }
+    if (found.size() > n / MAX_FRACTION)
+        return -1;
+
+    // What this master covers is now known first hand, older findings there go
+    for (i = 0; i < pixels.size();)
+    {
+        const BadPixel &p = pixels[i];
+        if (p.source == key.type && p.bin == key.bin && p.x >= key.x && p.y >= key.y && p.x < key.x + key.width &&
+                p.y < key.y + key.height)
+        {
+            pixels[i] = pixels.back();
+            pixels.pop_back();
+        }
+        else
+        {
+            i++;
+        }
+    }
+    pixels.insert(pixels.end(), found.begin(), found.end());
+    prepared = false;
+    save();
+
+    return found.size();
+}
+
+void HotPixelMap::prepare(uint32_t bin, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    std::vector<uint32_t> bad;
+
+    if (prepared && bin == preparedBin && x == preparedX && y == preparedY && w == preparedW && h == preparedH)
+        return;
+
+    /* Pixels found at this binning apply as they are; ones found unbinned
+     * spoil the binned pixel they fall into. */
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        uint32_t px, py;
+
+        if (pixels[i].bin == bin)
+        {
+            px = pixels[i].x;
+            py = pixels[i].y;
+        }
+        else if (pixels[i].bin == 1)
+        {
+            px = pixels[i].x / bin;
+            py = pixels[i].y / bin;
+        }
+        else
+        {
+            continue;
+        }
+        if (px >= x && py >= y && px < x + w && py < y + h)
+            bad.push_back((py - y) * w + (px - x));
+    }
+    std::sort(bad.begin(), bad.end());
+    bad.erase(std::unique(bad.begin(), bad.end()), bad.end());
+
+    // In frame order, so correcting walks memory forwards
+    fixes.clear();
+    for (size_t i = 0; i < bad.size(); i++)
+    {
+        uint32_t fx = bad[i] % w, fy = bad[i] / w;
+        Fix f;
+
+        f.index = bad[i];
+        f.count = 0;
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                int nx = (int)fx + dx, ny = (int)fy + dy;
+                uint32_t ni;
+
+                if ((dx == 0 && dy == 0) || nx < 0 || ny < 0 || nx >= (int)w || ny >= (int)h)
+                    continue;
+                ni = (uint32_t)ny * w + nx;
+                if (!std::binary_search(bad.begin(), bad.end(), ni))
+                    f.neighbour[f.count++] = ni;
+            }
+        }
+        // A pixel in a cluster with no good neighbour is left alone
+        if (f.count)
+            fixes.push_back(f);
+    }
+
+    prepared = true;
+    preparedBin = bin;
+    preparedX = x;
+    preparedY = y;
+    preparedW = w;
+    preparedH = h;
+}
+
+template <typename T>
+void HotPixelMap::correctPixels(T *px) const
+{
+    for (size_t i = 0; i < fixes.size(); i++)
+    {
+        const Fix &f = fixes[i];
+        T v[8];
+        uint32_t k, j;
+
+        // At most 8 values, an insertion sort beats anything fancier
+        for (k = 0; k < f.count; k++)
+        {
+            T x = px[f.neighbour[k]];
+            for (j = k; j > 0 && v[j - 1] > x; j--)
+                v[j] = v[j - 1];
+            v[j] = x;
+        }
+        if (f.count & 1)
+            px[f.index] = v[f.count / 2];
+        else
+            px[f.index] = (T)(((uint64_t)v[f.count / 2 - 1] + v[f.count / 2] + 1) / 2);
+    }
+}
+
+void HotPixelMap::correct(uint8_t *px) const
+{
+    correctPixels(px);
+}
+
+void HotPixelMap::correct(uint16_t *px) const
+{
+    correctPixels(px);
+}
+
+void HotPixelMap::correct(uint32_t *px) const
+{
+    correctPixels(px);
+}
@@ -0,0 +1,96 @@
+/**
+ * Hot and dead pixel map of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef HOT_PIXELS_H
+#define HOT_PIXELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "calibration.h"
+
+/* Bad pixels of one camera, learnt from the masters as they are recorded:
+ * hot pixels from darks, dead ones from flats. Kept in ~/.indi per GUID.
+ *
+ * For a given frame geometry the map is turned into a sorted list of frame
+ * offsets, each with the offsets of its good neighbours. Correcting a frame
+ * walks that list and nothing else, so the cost is set by the number of bad
+ * pixels and not by the size of the frame. */
+class HotPixelMap
+{
+public:
+    HotPixelMap() : prepared(false) {}
+
+    bool load(uint64_t guid);
+    void clear();
+
+    /* Replace what is known about the region of this master with its
+     * outliers. Darks give hot pixels, flats (dark subtracted, not yet
+     * inverted) give dead ones. Returns how many were found, or -1 when
+     * there were too many to be believable and nothing was changed. */
+    long learn(const MasterKey &key, const float *data);
+
+    // Build the correction list for a w x h frame at x, y, all in binned pixels
+    void prepare(uint32_t bin, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+
+    // Replace every bad pixel of the prepared frame with the median of its good neighbours
+    void correct(uint8_t *px) const;
+    void correct(uint16_t *px) const;
+    void correct(uint32_t *px) const;
+
+    size_t size() const
+    {
+        return pixels.size();
+    }
+    size_t active() const
+    {
+        return fixes.size();
+    }
+
+private:
+    bool save() const;
+
+    // Position in binned pixels of the full sensor
+    struct BadPixel
+    {
+        uint32_t source;        // MASTER_DARK or MASTER_FLAT
+        uint32_t bin;
+        uint32_t x, y;
+    };
+
+    struct Fix
+    {
+        uint32_t index;
+        uint32_t count;
+        uint32_t neighbour[8];
+    };
+
+    template <typename T>
+    void correctPixels(T *px) const;
+
+    std::string path;
+    std::vector<BadPixel> pixels;
+    std::vector<Fix> fixes;
+    bool prepared;
+    uint32_t preparedBin, preparedX, preparedY, preparedW, preparedH;
+};
+
+#endif // HOT_PIXELS_H
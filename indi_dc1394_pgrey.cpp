@@ -18,16 +18,21 @@
  */
 
 #include <sys/time.h>
+#include <algorithm>
 #include <memory>
 #include <stdint.h>
 #include <arpa/inet.h>
 #include <math.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 
 #include <indiapi.h>
 #include <iostream>
 #include "indi_dc1394_pgrey.h"
+#include "frame_kernels.h"
 #include <dc1394/dc1394.h>
 
 //const int POLLMS = 250;
@@ -35,7 +40,237 @@
 
 const float GAIN_DEFAULT = 1;
 
-std::unique_ptr<DC1394_PGREY> dc1394_pgrey(new DC1394_PGREY());
+enum
+{
+    PIXEL_FORMAT_MONO8,
+    PIXEL_FORMAT_MONO16
+};
+
+enum
+{
+    TRIGGER_FREE_RUN,
+    TRIGGER_SOFTWARE,
+    TRIGGER_EXTERNAL
+};
+
+enum
+{
+    BANDWIDTH_PACKET_SIZE,
+    BANDWIDTH_PACKET_MAX,
+    BANDWIDTH_RATE
+};
+
+enum
+{
+    TIMING_FRAME_COUNTER,
+    TIMING_HOST_OFFSET,
+    TIMING_CYCLE_SYNC
+};
+
+enum
+{
+    CALIBRATION_DARK,
+    CALIBRATION_FLAT,
+    CALIBRATION_RECORD
+};
+
+enum
+{
+    MASTER_FRAMES,
+    MASTER_KAPPA
+};
+
+enum
+{
+    COMBINE_MEDIAN,
+    COMBINE_SIGMA_CLIP
+};
+
+enum
+{
+    HOT_PIXELS_CORRECT,
+    HOT_PIXELS_OFF
+};
+
+enum
+{
+    STATS_MIN,
+    STATS_MAX,
+    STATS_MEAN,
+    STATS_STDDEV,
+    STATS_P01,
+    STATS_MEDIAN,
+    STATS_P99,
+    STATS_SATURATED,
+    STATS_SATURATED_PCT
+};
+
+enum
+{
+    AE_OFF,
+    AE_SHUTTER,
+    AE_SHUTTER_GAIN
+};
+
+enum
+{
+    AE_TARGET,
+    AE_TOLERANCE,
+    AE_MAX_SHUTTER
+};
+
+enum
+{
+    STARS_OFF,
+    STARS_ON
+};
+
+enum
+{
+    STARS_SIGMA,
+    STARS_MIN_AREA
+};
+
+enum
+{
+    FIELD_COUNT,
+    FIELD_HFR,
+    FIELD_BACKGROUND,
+    FIELD_NOISE
+};
+
+enum
+{
+    GUIDE_X,
+    GUIDE_Y,
+    GUIDE_FLUX,
+    GUIDE_HFR,
+    GUIDE_SNR
+};
+
+enum
+{
+    LUCKY_OFF,
+    LUCKY_ON
+};
+
+enum
+{
+    LUCKY_KEEP,
+    LUCKY_WINDOW
+};
+
+enum
+{
+    LUCKY_SCORE,
+    LUCKY_THRESHOLD,
+    LUCKY_SCORED,
+    LUCKY_PASSED
+};
+
+enum
+{
+    EVENTS_OFF,
+    EVENTS_ON
+};
+
+enum
+{
+    EVENT_PRE,
+    EVENT_POST,
+    EVENT_SIGMA,
+    EVENT_BUFFER
+};
+
+enum
+{
+    EVENT_BUFFERED,
+    EVENT_CHANGE,
+    EVENT_SAVED,
+    EVENT_DROPPED
+};
+
+enum
+{
+    TIMING_LOG_OFF,
+    TIMING_LOG_RECORD
+};
+
+enum
+{
+    TIMING_LOG_FRAMES,
+    TIMING_LOG_DROPPED,
+    TIMING_LOG_RATE,
+    TIMING_LOG_SIZE
+};
+
+enum
+{
+    SER_OFF,
+    SER_ON
+};
+
+enum
+{
+    SHM_OFF,
+    SHM_ON
+};
+
+enum
+{
+    COMPRESSION_NONE,
+    COMPRESSION_RICE,
+    COMPRESSION_GZIP
+};
+
+enum
+{
+    COMPRESSION_RATIO,
+    COMPRESSION_TIME
+};
+
+enum
+{
+    SER_FRAMES,
+    SER_SIZE,
+    SER_BACKLOG,
+    SER_BEHIND
+};
+
+// Stream frames scored before lucky imaging starts dropping any
+static const uint32_t LUCKY_MIN_SCORES = 10;
+
+// Frames that may already be exposing with the old settings when auto exposure changes them
+#define AE_SETTLE_FRAMES 2
+
+// 12-bit full scale of 16-bit readout, the camera puts its samples in the top bits
+#define SATURATION_16 0xFFF0
+
+/* Point Grey FRAME_INFO register. With a bit set the camera writes that
+ * value, as a big-endian quadlet, over the start of the image. Quadlets come
+ * in bit order, so timestamp, gain, shutter, frame counter with these four. */
+const uint64_t PGR_FRAME_INFO = 0x12F8;
+const uint32_t FRAME_INFO_PRESENT = 1u << 31;
+const uint32_t FRAME_INFO_TIMESTAMP = 1u << 0;
+const uint32_t FRAME_INFO_GAIN = 1u << 1;
+const uint32_t FRAME_INFO_SHUTTER = 1u << 2;
+const uint32_t FRAME_INFO_COUNTER = 1u << 6;
+const uint32_t FRAME_INFO_MASK = 0x3FF;
+
+// Isochronous cycles per second, 1394 and USB2 high speed alike
+const double ISO_CYCLES_PER_SECOND = 8000.0;
+
+// Corrupt frames tolerated per window before the packet size is lowered
+const int CORRUPT_WINDOW = 20;
+const int CORRUPT_LIMIT = 2;
+
+// One device per camera found at startup, so a single driver process serves a guider and an imager
+const int MAX_CAMERAS = 8;
+static std::unique_ptr<DC1394_PGREY> cameras[MAX_CAMERAS];
+static int cameraCount = 0;
+
+dc1394_t * DC1394_PGREY::context = NULL;
+int DC1394_PGREY::contextUsers = 0;
 
 void ISInit()
 {
@@ -44,31 +279,91 @@ void ISInit()
         return;
 
     isInit = 1;
-    if(dc1394_pgrey.get() == 0) dc1394_pgrey.reset(new DC1394_PGREY());
+
+    dc1394camera_list_t * list = NULL;
+    dc1394_t * dc1394 = DC1394_PGREY::acquireContext();
+    if (dc1394 && dc1394_camera_enumerate(dc1394, &list) == DC1394_SUCCESS)
+    {
+        // Multi-unit cameras show up once per unit, one device is enough
+        uint32_t distinct = 0;
+        for (uint32_t i = 0; i < list->num; i++)
+            if (i == 0 || list->ids[i].guid != list->ids[i - 1].guid)
+                distinct++;
+
+        for (uint32_t i = 0; i < list->num && cameraCount < MAX_CAMERAS; i++)
+        {
+            if (i > 0 && list->ids[i].guid == list->ids[i - 1].guid)
+                continue;
+            // A single camera keeps the plain device name
+            cameras[cameraCount++].reset(new DC1394_PGREY(list->ids[i].guid, distinct > 1));
+        }
+        dc1394_camera_free_list(list);
+    }
+    DC1394_PGREY::releaseContext();
+
+    // Nothing plugged in yet, keep a device around that looks again on connect
+    if (cameraCount == 0)
+        cameras[cameraCount++].reset(new DC1394_PGREY());
 }
 
 void ISGetProperties(const char * dev)
 {
     ISInit();
-    dc1394_pgrey->ISGetProperties(dev);
+    for (int i = 0; i < cameraCount; i++)
+    {
+        DC1394_PGREY * camera = cameras[i].get();
+        if (dev == NULL || !strcmp(dev, camera->getDeviceName()))
+        {
+            camera->ISGetProperties(dev);
+            if (dev != NULL)
+                break;
+        }
+    }
 }
 
 void ISNewSwitch(const char * dev, const char * name, ISState * states, char * names[], int num)
 {
     ISInit();
-    dc1394_pgrey->ISNewSwitch(dev, name, states, names, num);
+    for (int i = 0; i < cameraCount; i++)
+    {
+        DC1394_PGREY * camera = cameras[i].get();
+        if (dev == NULL || !strcmp(dev, camera->getDeviceName()))
+        {
+            camera->ISNewSwitch(dev, name, states, names, num);
+            if (dev != NULL)
+                break;
+        }
+    }
 }
 
 void ISNewText(	const char * dev, const char * name, char * texts[], char * names[], int num)
 {
     ISInit();
-    dc1394_pgrey->ISNewText(dev, name, texts, names, num);
+    for (int i = 0; i < cameraCount; i++)
+    {
+        DC1394_PGREY * camera = cameras[i].get();
+        if (dev == NULL || !strcmp(dev, camera->getDeviceName()))
+        {
+            camera->ISNewText(dev, name, texts, names, num);
+            if (dev != NULL)
+                break;
+        }
+    }
 }
 
 void ISNewNumber(const char * dev, const char * name, double values[], char * names[], int num)
 {
     ISInit();
-    dc1394_pgrey->ISNewNumber(dev, name, values, names, num);
+    for (int i = 0; i < cameraCount; i++)
+    {
+        DC1394_PGREY * camera = cameras[i].get();
+        if (dev == NULL || !strcmp(dev, camera->getDeviceName()))
+        {
+            camera->ISNewNumber(dev, name, values, names, num);
+            if (dev != NULL)
+                break;
+        }
+    }
 }
 
 void ISNewBLOB (const char * dev, const char * name, int sizes[], int blobsizes[], char * blobs[], char * formats[], char * names[], int n)
@@ -86,18 +381,102 @@ void ISNewBLOB (const char * dev, const char * name, int sizes[], int blobsizes[
 void ISSnoopDevice (XMLEle * root)
 {
     ISInit();
-    dc1394_pgrey->ISSnoopDevice(root);
+    for (int i = 0; i < cameraCount; i++)
+        cameras[i]->ISSnoopDevice(root);
+}
+
+dc1394_t * DC1394_PGREY::acquireContext()
+{
+    if (!context)
+        context = dc1394_new();
+    if (context)
+        contextUsers++;
+    return context;
+}
+
+void DC1394_PGREY::releaseContext()
+{
+    if (contextUsers > 0 && --contextUsers == 0)
+    {
+        dc1394_free(context);
+        context = NULL;
+    }
 }
 
 
-DC1394_PGREY::DC1394_PGREY()
+DC1394_PGREY::DC1394_PGREY(uint64_t guid, bool nameByGUID)
 {
+    cameraGUID = guid;
+    connectedGUID = 0;
+    if (nameByGUID)
+    {
+        char name[MAXINDIDEVICE];
+        snprintf(name, MAXINDIDEVICE, "%s %016llx", getDefaultName(), (unsigned long long)guid);
+        setDeviceName(name);
+    }
+
     InExposure = false;
     capturing = false;
+    downloading = false;
+    colorCoding = DC1394_COLOR_CODING_MONO8;
+    bitsPerPixel = 8;
+    binning = 1;
+    triggerMode = TRIGGER_FREE_RUN;
+    shutterRequest = -1;
+    shutterValue = 0;
+    packetSize = packetLimit = 0;
+    packetUnit = packetMax = 0;
+    retunePending = false;
+    corruptFrames = windowFrames = 0;
+    rateBytes = 0;
+    dc1394 = NULL;
+    dcam = NULL;
+    captureQuit = false;
+    notifyPipe[0] = notifyPipe[1] = -1;
+    wakePipe[0] = wakePipe[1] = -1;
+    frameCallbackID = -1;
+    timerID = -1;
+    embeddedBytes = 0;
+    cycleTimerAvailable = false;
+    frameTiming.valid = false;
+    stackTotal = 1;
+    stackDone = 0;
+    buildTotal = 1;
+    buildDone = 0;
+    aeShutter = 0;
+    aeSettle = 0;
+    fullScale = 255;
+    resetLucky();
+    eventCount = 0;
+    eventPublished.tv_sec = eventPublished.tv_nsec = 0;
+    logging = false;
+    logFailed = false;
+    logDropped = 0;
+    serReportedBehind = 0;
+    compressCallbackID = -1;
+    serPublished.tv_sec = serPublished.tv_nsec = 0;
 }
 
 
 bool DC1394_PGREY::Connect()
+{
+    struct timeval start, end;
+
+    gettimeofday(&start, NULL);
+    if (!openCamera())
+    {
+        closeCamera();
+        return false;
+    }
+    gettimeofday(&end, NULL);
+
+    DEBUGF(INDI::Logger::DBG_SESSION, "Connected to camera %016llx in %.2f s (%s capabilities)", (unsigned long long)connectedGUID,
+           (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6, capabilitiesCached ? "cached" : "probed");
+
+    return true;
+}
+
+bool DC1394_PGREY::openCamera()
 {
     dc1394camera_list_t * list;
     dc1394error_t err;
@@ -106,14 +485,12 @@ bool DC1394_PGREY::Connect()
     uint32_t val;
     dc1394format7mode_t fm7;
     dc1394feature_info_t feature;
-    float min, max, temp;
-    dc1394video_modes_t modes;
+    float temp;
     dc1394framerates_t framerates;
-    dc1394color_codings_t codings;
     dc1394color_coding_t current_coding;
     uint32_t depth;
 
-    dc1394 = dc1394_new();
+    dc1394 = acquireContext();
     if (!dc1394)
     {
         return false;
@@ -128,30 +505,50 @@ bool DC1394_PGREY::Connect()
     if (!list->num)
     {
         IDMessage(getDeviceName(), "No DC1394 cameras found!");
+        dc1394_camera_free_list(list);
         return false;
     }
-    dcam = dc1394_camera_new(dc1394, list->ids[0].guid);
-    if (!dcam)
+
+    /* A GUID typed into CAMERA_GUID wins, then the camera this device was
+     * created for, then whatever camera comes first */
+    connectedGUID = 0;
+    if (GuidT[0].text && GuidT[0].text[0])
+        connectedGUID = strtoull(GuidT[0].text, NULL, 16);
+    else if (cameraGUID)
+        connectedGUID = cameraGUID;
+    if (connectedGUID)
     {
-        IDMessage(getDeviceName(), "Unable to connect to camera!");
-        return false;
+        uint32_t i;
+        for (i = 0; i < list->num; i++)
+            if (list->ids[i].guid == connectedGUID)
+                break;
+        if (i == list->num)
+        {
+            IDMessage(getDeviceName(), "Camera %016llx not found!", (unsigned long long)connectedGUID);
+            dc1394_camera_free_list(list);
+            return false;
+        }
     }
-
-    /* Reset camera */
-    err = dc1394_camera_reset(dcam);
-    if (err != DC1394_SUCCESS)
+    else
     {
-        IDMessage(getDeviceName(), "Unable to reset camera!");
-        return false;
+        connectedGUID = list->ids[0].guid;
     }
+    dc1394_camera_free_list(list);
 
-    err = dc1394_video_get_supported_modes(dcam, &modes);
-    if (err != DC1394_SUCCESS)
+    dcam = dc1394_camera_new(dc1394, connectedGUID);
+    if (!dcam)
     {
-        IDMessage(getDeviceName(), "Unable to get list of supported modes");
+        IDMessage(getDeviceName(), "Unable to connect to camera!");
         return false;
     }
-    IDMessage(getDeviceName(), "Number of Supported modes: %d",modes.num);
+
+    calibration.open(connectedGUID);
+    if (calibration.size())
+        DEBUGF(INDI::Logger::DBG_SESSION, "%u calibration masters available.", (unsigned int)calibration.size());
+    if (hotPixels.load(connectedGUID))
+        DEBUGF(INDI::Logger::DBG_SESSION, "Hot pixel map has %u bad pixels.", (unsigned int)hotPixels.size());
+
+    SetCCDCapability(CCD_CAN_ABORT | CCD_CAN_BIN | CCD_CAN_SUBFRAME | CCD_HAS_STREAMING);
 
     // selected_mode = modes.modes[modes.num-1];
 
@@ -159,8 +556,28 @@ bool DC1394_PGREY::Connect()
     
     selected_mode = DC1394_VIDEO_MODE_FORMAT7_1;	//resolution no greater than 640x480, pixel format MONO16 according to technical specifications by manufacturer
 
+    CameraCapabilities caps;
+
+    /* A camera seen before is described by its cache file; once a few cheap
+     * checks agree with it the reset and the full probe are skipped */
+    capabilitiesCached = loadCapabilities(connectedGUID, caps) && verifyCapabilities(caps);
+    if (capabilitiesCached)
+    {
+        applyCapabilities(caps);
+
+        // No reset on this path, so stop whatever a previous session left streaming or armed
+        dc1394_video_set_transmission(dcam, DC1394_OFF);
+        dc1394_external_trigger_set_power(dcam, DC1394_OFF);
+    }
+    else if (!probeCapabilities(caps))
+    {
+        return false;
+    }
+
     IDMessage(getDeviceName(), "Current mode: %d",selected_mode);
 
+    negotiateBusSpeed();
+
     err = dc1394_video_set_mode(dcam, selected_mode);
     if (err != DC1394_SUCCESS)
     {
@@ -168,18 +585,14 @@ bool DC1394_PGREY::Connect()
         return false;
     }
 
-    uint32_t mwidth;
-    uint32_t mheight;
-    err=dc1394_format7_get_max_image_size(dcam,selected_mode, &mwidth, &mheight);
-    if(err != DC1394_SUCCESS){
-	IDMessage(getDeviceName(), "Unable to connect to read maximum image size");
-        return false;
-    }
-    else{
-	    IDMessage(getDeviceName(), "Maximum image size: %ld x %ld", mwidth, mheight);
-    }
+    IDMessage(getDeviceName(), "Maximum image size: %ld x %ld", maxWidth, maxHeight);
+
+    captureMode = selected_mode;
+    binning = 1;
 
-    err = dc1394_format7_set_image_position(dcam,selected_mode, 4, 0);
+    /* Start with the full sensor, UpdateCCDFrame narrows it down on request */
+    roiX = roiY = 0;
+    err = dc1394_format7_set_image_position(dcam,selected_mode, roiX, roiY);
     if (err != DC1394_SUCCESS)
     {
         IDMessage(getDeviceName(), "Could not set image upper left corner position");
@@ -187,93 +600,62 @@ bool DC1394_PGREY::Connect()
     }
 
 
-    err = dc1394_format7_set_image_size(dcam,selected_mode,640,480);
+    err = dc1394_format7_set_image_size(dcam,selected_mode,maxWidth,maxHeight);
     if (err != DC1394_SUCCESS)
     {
         IDMessage(getDeviceName(), "Could not set format7 image size");
         return false;
     }
  
-    //Test8
-    //err = dc1394_format7_set_color_coding(dcam,selected_mode,DC1394_COLOR_CODING_MONO16);
-    err = dc1394_format7_set_color_coding(dcam,selected_mode,DC1394_COLOR_CODING_MONO8);
+    err = dc1394_format7_set_color_coding(dcam,selected_mode,colorCoding);
     if (err != DC1394_SUCCESS)
     {
         IDMessage(getDeviceName(), "Could not set format7 color coding");
         return false;
     }
 
-    err = dc1394_video_get_data_depth(dcam,&depth);
-    if (err != DC1394_SUCCESS)
+    packetLimit = 0;
+    if (!applyPacketSize())
     {
-        IDMessage(getDeviceName(), "Could not get camera color depth");
-        return false;
+        IDMessage(getDeviceName(), "Could not set format7 packet size");
     }
-    IDMessage(getDeviceName(), "Data depth: %d", depth);
-    
-    err = dc1394_format7_get_color_codings(dcam,selected_mode,&codings);
-    if (err != DC1394_SUCCESS)
+
+    /* Read back what was just configured, only worth the round trips the
+     * first time a camera is seen */
+    if (!capabilitiesCached)
     {
-        IDMessage(getDeviceName(), "Unable to get list of supported color codings");
-        return false;
-    }
-    IDMessage(getDeviceName(), "Number of Supported modes: %d",codings.num);
-    //IDMessage(getDeviceName(), "Supported modes: %d",codings.codings);
+        err = dc1394_video_get_data_depth(dcam,&depth);
+        if (err != DC1394_SUCCESS)
+        {
+            IDMessage(getDeviceName(), "Could not get camera color depth");
+            return false;
+        }
+        IDMessage(getDeviceName(), "Data depth: %d", depth);
 
-    int cusu;
-    for(cusu=0; cusu<codings.num; cusu++){
-	    if(codings.codings[cusu]==DC1394_COLOR_CODING_MONO8){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_MONO8", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_YUV411){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_YUV411", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_YUV422){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_YUV422", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_YUV444){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_YUV444", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RGB8){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RGB8", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_MONO16){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_MONO16", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RGB16){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RGB16", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_MONO16S){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_MONO16S", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RGB16S){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RGB16S", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RAW8){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RAW8", cusu);
-	    }
-	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RAW16){
-		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RAW16", cusu);
-	    }
-	    else{
-		IDMessage(getDeviceName(), "Coding not in the list of libdc1394");
-	    }
-    }
+        err = dc1394_format7_get_color_coding(dcam,selected_mode,&current_coding);
+        if (err != DC1394_SUCCESS)
+        {
+            IDMessage(getDeviceName(), "Unable to get current color coding");
+            return false;
+        }
+        if(current_coding != colorCoding){
+	        IDMessage(getDeviceName(), "Color was not set correctly");
+        }
+        else{
+            IDMessage(getDeviceName(), "%s set correctly", bitsPerPixel == 16 ? "MONO16" : "MONO8");
+        }
 
-    err = dc1394_format7_get_color_coding(dcam,selected_mode,&current_coding);
-    if (err != DC1394_SUCCESS)
-    {
-        IDMessage(getDeviceName(), "Unable to get current color coding");
-        return false;
-    }
-    //Test8
-    //if(current_coding != DC1394_COLOR_CODING_MONO16){
-    if(current_coding != DC1394_COLOR_CODING_MONO8){
-	    IDMessage(getDeviceName(), "Color was not set correctly");
+        err = dc1394_get_image_size_from_video_mode(dcam, selected_mode, &width,&height);
+        if (err != DC1394_SUCCESS)
+        {
+            IDMessage(getDeviceName(), "Unable to get mode size!");
+            return false;
+        }
     }
-    else{
-        //IDMessage(getDeviceName(), "MONO16 set correctly");
-        IDMessage(getDeviceName(), "MONO8 set correctly");
+    else
+    {
+        width = maxWidth;
+        height = maxHeight;
     }
     //Apparently, framerates make sense only with non-scalable video formats. Timestamp: 20230409
     /*
@@ -313,13 +695,6 @@ bool DC1394_PGREY::Connect()
 
     DEBUG(INDI::Logger::DBG_SESSION,  "Connected in format7");
 
-    err = dc1394_get_image_size_from_video_mode(dcam, selected_mode, &width,&height);
-    if (err != DC1394_SUCCESS)
-    {
-        IDMessage(getDeviceName(), "Unable to get mode size!");
-        return false;
-    }
-
     IDMessage(getDeviceName(), "Current Mode frame width=%d, height=%d",width,height);
 
     /* Disable Auto exposure control */
@@ -349,7 +724,7 @@ bool DC1394_PGREY::Connect()
         return false;
     }
 
-    /* Get the longest possible exposure length */
+    /* Manual shutter in seconds, its range was read by probeCapabilities */
     err = dc1394_feature_set_mode(dcam, DC1394_FEATURE_SHUTTER, DC1394_FEATURE_MODE_MANUAL);
     if (err != DC1394_SUCCESS)
     {
@@ -360,16 +735,8 @@ bool DC1394_PGREY::Connect()
     {
         IDMessage(getDeviceName(), "Failed to enable absolute shutter control.");
     }
-    err = dc1394_feature_get_absolute_boundaries(dcam, DC1394_FEATURE_SHUTTER, &min, &max);
-    if (err != DC1394_SUCCESS)
-    {
-        IDMessage(getDeviceName(), "Could not get max shutter length");
-    }
-    else
-    {
-        IDMessage(getDeviceName(), "Min exposure = %f, Max = %f",min,max);
-    }
-
+    shutterRequest = -1;
+    triggerMode = TRIGGER_FREE_RUN;
 
     /* Set absolute gain control */
     err = dc1394_feature_set_absolute_control(dcam, DC1394_FEATURE_GAIN, DC1394_ON);
@@ -378,17 +745,6 @@ bool DC1394_PGREY::Connect()
         IDMessage(getDeviceName(), "Failed to enable absolute gain control.");
     }
 
-    /* get and save min/max gain values */
-    err = dc1394_feature_get_absolute_boundaries(dcam, DC1394_FEATURE_GAIN, &gain_min, &gain_max);
-    if (err != DC1394_SUCCESS)
-    {
-        IDMessage(getDeviceName(), "Could not get max gain value");
-    }
-    else
-    {
-        IDMessage(getDeviceName(), "Min gain = %f, Max = %f",gain_min,gain_max);
-    }
-
     /* Set brightness */
     err = dc1394_feature_set_mode(dcam, DC1394_FEATURE_BRIGHTNESS, DC1394_FEATURE_MODE_MANUAL);
     if (err != DC1394_SUCCESS)
@@ -438,7 +794,21 @@ bool DC1394_PGREY::Connect()
         temperatureCanRead = false;
     }
 
-    err = dc1394_capture_setup(dcam,5, DC1394_CAPTURE_FLAGS_DEFAULT);
+    enableEmbeddedInfo();
+
+    err = dc1394_capture_setup(dcam, DMA_BUFFERS, DC1394_CAPTURE_FLAGS_DEFAULT);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to set up capture ring");
+        return false;
+    }
+
+    if (!startCaptureThread())
+    {
+        IDMessage(getDeviceName(), "Unable to start capture thread");
+        dc1394_capture_stop(dcam);
+        return false;
+    }
 
     return true;
 }
@@ -469,16 +839,40 @@ float DC1394_PGREY::GetTemperature()
 }
 
 bool DC1394_PGREY::Disconnect()
+{
+    closeCamera();
+
+    IDMessage(getDeviceName(), "Point Grey Chameleon disconnected successfully!");
+    return true;
+}
+
+void DC1394_PGREY::closeCamera()
 {
     if (dcam)
     {
+        if (capturing)
+            StopStreaming();
+        if (logging)
+            stopTimingLog();
+        // Don't leave the camera armed for whoever opens it next
+        if (triggerMode != TRIGGER_FREE_RUN)
+            setTriggerMode(TRIGGER_FREE_RUN);
+        stopCaptureThread();
         dc1394_capture_stop(dcam);
         dc1394_camera_free(dcam);
+        dcam = NULL;
         temperatureCanRead = false;
     }
+    calibration.close();
+    hotPixels.clear();
+    frameShm.close();
+    stopCompression();
 
-    IDMessage(getDeviceName(), "Point Grey Chameleon disconnected successfully!");
-    return true;
+    if (dc1394)
+    {
+        releaseContext();
+        dc1394 = NULL;
+    }
 }
 
 const char * DC1394_PGREY::getDefaultName()
@@ -501,6 +895,218 @@ bool DC1394_PGREY::initProperties()
     IUFillNumber(&TemperatureN[0], "TEMPERATURE", "Camera Temp. (C)", "%.2f", -50, 70, 0.1, 0);
     IUFillNumberVector(&TemperatureNP, TemperatureN, 1, getDeviceName(), "Temperature", "Temp.", MAIN_CONTROL_TAB, IP_RO, 1, IPS_IDLE);
 
+    // Which camera to open, as a hex GUID. Empty means the one this device was created for.
+    IUFillText(&GuidT[0], "GUID", "GUID", "");
+    IUFillTextVector(&GuidTP, GuidT, 1, getDeviceName(), "CAMERA_GUID", "Camera", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+    // 8-bit or full dynamic range 16-bit readout
+    IUFillSwitch(&PixelFormatS[PIXEL_FORMAT_MONO8], "MONO8", "Mono 8-bit", ISS_ON);
+    IUFillSwitch(&PixelFormatS[PIXEL_FORMAT_MONO16], "MONO16", "Mono 16-bit", ISS_OFF);
+    IUFillSwitchVector(&PixelFormatSP, PixelFormatS, 2, getDeviceName(), "PIXEL_FORMAT", "Pixel Format", IMAGE_SETTING_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    // How exposures are started; external triggers come in on GPIO0
+    IUFillSwitch(&TriggerModeS[TRIGGER_FREE_RUN], "FREE_RUN", "Free running", ISS_ON);
+    IUFillSwitch(&TriggerModeS[TRIGGER_SOFTWARE], "SOFTWARE", "Software trigger", ISS_OFF);
+    IUFillSwitch(&TriggerModeS[TRIGGER_EXTERNAL], "EXTERNAL", "External trigger", ISS_OFF);
+    IUFillSwitchVector(&TriggerModeSP, TriggerModeS, 3, getDeviceName(), "TRIGGER_MODE", "Trigger", IMAGE_SETTING_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    // Negotiated Format7 packet size and the data rate it achieves
+    IUFillNumber(&BandwidthN[BANDWIDTH_PACKET_SIZE], "PACKET_SIZE", "Packet size (bytes)", "%.0f", 0, 65536, 0, 0);
+    IUFillNumber(&BandwidthN[BANDWIDTH_PACKET_MAX], "PACKET_MAX", "Max packet size (bytes)", "%.0f", 0, 65536, 0, 0);
+    IUFillNumber(&BandwidthN[BANDWIDTH_RATE], "RATE", "Throughput (MB/s)", "%.2f", 0, 1000, 0, 0);
+    IUFillNumberVector(&BandwidthNP, BandwidthN, 3, getDeviceName(), "BANDWIDTH_INFO", "Bandwidth", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    // Where the last exposure's timing came from and how far off the host was
+    IUFillNumber(&TimingN[TIMING_FRAME_COUNTER], "FRAME_COUNTER", "Frame counter", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&TimingN[TIMING_HOST_OFFSET], "HOST_OFFSET", "Start vs host (ms)", "%.3f", -1e6, 1e6, 0, 0);
+    IUFillNumber(&TimingN[TIMING_CYCLE_SYNC], "CYCLE_SYNC", "Bus cycle timer", "%.0f", 0, 1, 0, 0);
+    IUFillNumberVector(&TimingNP, TimingN, 3, getDeviceName(), "FRAME_TIMING", "Timing", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    /* Light frames can be calibrated before they leave the driver. With
+     * RECORD on, bias, dark and flat frames become the masters instead. */
+    IUFillSwitch(&CalibrationS[CALIBRATION_DARK], "DARK", "Subtract dark", ISS_OFF);
+    IUFillSwitch(&CalibrationS[CALIBRATION_FLAT], "FLAT", "Divide flat", ISS_OFF);
+    IUFillSwitch(&CalibrationS[CALIBRATION_RECORD], "RECORD", "Record masters", ISS_OFF);
+    IUFillSwitchVector(&CalibrationSP, CalibrationS, 3, getDeviceName(), "CALIBRATION", "Calibration", IMAGE_SETTING_TAB, IP_RW, ISR_NOFMANY, 0, IPS_IDLE);
+    IUFillText(&CalibrationT[CALIBRATION_DARK], "DARK", "Dark", "none");
+    IUFillText(&CalibrationT[CALIBRATION_FLAT], "FLAT", "Flat", "none");
+    IUFillTextVector(&CalibrationTP, CalibrationT, 2, getDeviceName(), "CALIBRATION_MASTERS", "Masters", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    // How many frames a recorded master is built from, and how they are combined
+    IUFillNumber(&MasterN[MASTER_FRAMES], "FRAMES", "Frames", "%.0f", 1, 100, 1, 1);
+    IUFillNumber(&MasterN[MASTER_KAPPA], "KAPPA", "Clip (sigma)", "%.1f", 1, 10, 0.5, 3);
+    IUFillNumberVector(&MasterNP, MasterN, 2, getDeviceName(), "MASTER_BUILD", "Master", IMAGE_SETTING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillSwitch(&MasterCombineS[COMBINE_MEDIAN], "MEDIAN", "Median", ISS_ON);
+    IUFillSwitch(&MasterCombineS[COMBINE_SIGMA_CLIP], "SIGMA_CLIP", "Sigma clip", ISS_OFF);
+    IUFillSwitchVector(&MasterCombineSP, MasterCombineS, 2, getDeviceName(), "MASTER_COMBINE", "Combine", IMAGE_SETTING_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+
+    // What the last delivered frame looks like, without having to download it
+    IUFillNumber(&StatisticsN[STATS_MIN], "MIN", "Min", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_MAX], "MAX", "Max", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_MEAN], "MEAN", "Mean", "%.2f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_STDDEV], "STDDEV", "Std dev", "%.2f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_P01], "P01", "1st percentile", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_MEDIAN], "MEDIAN", "Median", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_P99], "P99", "99th percentile", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_SATURATED], "SATURATED", "Saturated pixels", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StatisticsN[STATS_SATURATED_PCT], "SATURATED_PCT", "Saturated (%)", "%.3f", 0, 100, 0, 0);
+    IUFillNumberVector(&StatisticsNP, StatisticsN, 9, getDeviceName(), "FRAME_STATISTICS", "Statistics", IMAGE_INFO_TAB, IP_RO, 0,
+                       IPS_IDLE);
+    // 32 equal bins over the whole pixel range
+    for (int i = 0; i < 32; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "BIN_%02d", i);
+        IUFillNumber(&HistogramN[i], name, name, "%.0f", 0, 4294967295.0, 0, 0);
+    }
+    IUFillNumberVector(&HistogramNP, HistogramN, 32, getDeviceName(), "FRAME_HISTOGRAM", "Histogram", IMAGE_INFO_TAB, IP_RO, 0,
+                       IPS_IDLE);
+
+    /* Star detection for guiding and focusing loops, which then only need
+     * these numbers rather than the frames */
+    IUFillSwitch(&StarDetectionS[STARS_OFF], "OFF", "Off", ISS_ON);
+    IUFillSwitch(&StarDetectionS[STARS_ON], "ON", "On", ISS_OFF);
+    IUFillSwitchVector(&StarDetectionSP, StarDetectionS, 2, getDeviceName(), "STAR_DETECTION", "Star detection", IMAGE_SETTING_TAB,
+                       IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&StarSettingsN[STARS_SIGMA], "SIGMA", "Threshold (sigma)", "%.1f", 2, 50, 0.5, 5);
+    IUFillNumber(&StarSettingsN[STARS_MIN_AREA], "MIN_AREA", "Min area (px)", "%.0f", 1, 100, 1, 3);
+    IUFillNumberVector(&StarSettingsNP, StarSettingsN, 2, getDeviceName(), "STAR_DETECTION_SETTINGS", "Star detection",
+                       IMAGE_SETTING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillNumber(&StarFieldN[FIELD_COUNT], "COUNT", "Stars", "%.0f", 0, 1000, 0, 0);
+    IUFillNumber(&StarFieldN[FIELD_HFR], "HFR", "Median HFR (px)", "%.2f", 0, 1000, 0, 0);
+    IUFillNumber(&StarFieldN[FIELD_BACKGROUND], "BACKGROUND", "Background", "%.1f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&StarFieldN[FIELD_NOISE], "NOISE", "Noise", "%.2f", 0, 4294967295.0, 0, 0);
+    IUFillNumberVector(&StarFieldNP, StarFieldN, 4, getDeviceName(), "STAR_FIELD", "Stars", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+    IUFillNumber(&GuideStarN[GUIDE_X], "X", "X (px)", "%.3f", 0, 100000, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_Y], "Y", "Y (px)", "%.3f", 0, 100000, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_FLUX], "FLUX", "Flux", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_HFR], "HFR", "HFR (px)", "%.2f", 0, 1000, 0, 0);
+    IUFillNumber(&GuideStarN[GUIDE_SNR], "SNR", "SNR", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumberVector(&GuideStarNP, GuideStarN, 5, getDeviceName(), "GUIDE_STAR", "Guide star", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    // Lucky imaging, for planetary and double star streams
+    IUFillSwitch(&LuckyS[LUCKY_OFF], "OFF", "Off", ISS_ON);
+    IUFillSwitch(&LuckyS[LUCKY_ON], "ON", "On", ISS_OFF);
+    IUFillSwitchVector(&LuckySP, LuckyS, 2, getDeviceName(), "LUCKY_IMAGING", "Lucky imaging", IMAGE_SETTING_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&LuckySettingsN[LUCKY_KEEP], "KEEP", "Keep best (%)", "%.0f", 1, 100, 1, 10);
+    IUFillNumber(&LuckySettingsN[LUCKY_WINDOW], "WINDOW", "Window (frames)", "%.0f", LUCKY_MIN_SCORES, 5000, 10, 200);
+    IUFillNumberVector(&LuckySettingsNP, LuckySettingsN, 2, getDeviceName(), "LUCKY_IMAGING_SETTINGS", "Lucky imaging",
+                       IMAGE_SETTING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillNumber(&LuckyStatsN[LUCKY_SCORE], "SCORE", "Sharpness", "%.1f", 0, 1e12, 0, 0);
+    IUFillNumber(&LuckyStatsN[LUCKY_THRESHOLD], "THRESHOLD", "Threshold", "%.1f", 0, 1e12, 0, 0);
+    IUFillNumber(&LuckyStatsN[LUCKY_SCORED], "SCORED", "Frames scored", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&LuckyStatsN[LUCKY_PASSED], "PASSED", "Frames passed", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumberVector(&LuckyStatsNP, LuckyStatsN, 4, getDeviceName(), "LUCKY_IMAGING_STATS", "Lucky imaging", IMAGE_INFO_TAB,
+                       IP_RO, 0, IPS_IDLE);
+
+    // Event capture, for meteors and occultations
+    IUFillSwitch(&EventS[EVENTS_OFF], "OFF", "Off", ISS_ON);
+    IUFillSwitch(&EventS[EVENTS_ON], "ON", "On", ISS_OFF);
+    IUFillSwitchVector(&EventSP, EventS, 2, getDeviceName(), "EVENT_CAPTURE", "Event capture", IMAGE_SETTING_TAB, IP_RW, ISR_1OFMANY,
+                       0, IPS_IDLE);
+    IUFillSwitch(&EventTriggerS[0], "TRIGGER", "Trigger", ISS_OFF);
+    IUFillSwitchVector(&EventTriggerSP, EventTriggerS, 1, getDeviceName(), "EVENT_TRIGGER", "Event", IMAGE_SETTING_TAB, IP_RW,
+                       ISR_ATMOST1, 0, IPS_IDLE);
+    IUFillNumber(&EventSettingsN[EVENT_PRE], "PRE", "Before trigger (s)", "%.1f", 0, 600, 1, 2);
+    IUFillNumber(&EventSettingsN[EVENT_POST], "POST", "After trigger (s)", "%.1f", 0, 600, 1, 3);
+    IUFillNumber(&EventSettingsN[EVENT_SIGMA], "SIGMA", "Change trigger (sigma, 0 off)", "%.1f", 0, 1000, 1, 10);
+    IUFillNumber(&EventSettingsN[EVENT_BUFFER], "BUFFER", "Buffer (MB)", "%.0f", 16, 16384, 64, 256);
+    IUFillNumberVector(&EventSettingsNP, EventSettingsN, 4, getDeviceName(), "EVENT_CAPTURE_SETTINGS", "Event capture",
+                       IMAGE_SETTING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillText(&EventDirT[0], "DIR", "Directory", getenv("HOME") ? getenv("HOME") : "/tmp");
+    IUFillTextVector(&EventDirTP, EventDirT, 1, getDeviceName(), "EVENT_CAPTURE_DIR", "Event capture", IMAGE_SETTING_TAB, IP_RW, 0,
+                     IPS_IDLE);
+    IUFillNumber(&EventStatusN[EVENT_BUFFERED], "BUFFERED", "Buffered (s)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumber(&EventStatusN[EVENT_CHANGE], "CHANGE", "Change (sigma)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumber(&EventStatusN[EVENT_SAVED], "SAVED", "Events saved", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&EventStatusN[EVENT_DROPPED], "DROPPED", "Frames dropped", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumberVector(&EventStatusNP, EventStatusN, 4, getDeviceName(), "EVENT_CAPTURE_STATUS", "Event capture", IMAGE_INFO_TAB,
+                       IP_RO, 0, IPS_IDLE);
+
+    // SER recording of the stream
+    IUFillSwitch(&SerS[SER_OFF], "OFF", "Off", ISS_ON);
+    IUFillSwitch(&SerS[SER_ON], "ON", "On", ISS_OFF);
+    IUFillSwitchVector(&SerSP, SerS, 2, getDeviceName(), "SER_RECORD", "SER recording", IMAGE_SETTING_TAB, IP_RW, ISR_1OFMANY, 0,
+                       IPS_IDLE);
+    IUFillSwitch(&SerDirectS[SER_OFF], "OFF", "Off", ISS_OFF);
+    IUFillSwitch(&SerDirectS[SER_ON], "ON", "On", ISS_ON);
+    IUFillSwitchVector(&SerDirectSP, SerDirectS, 2, getDeviceName(), "SER_DIRECT_IO", "SER direct I/O", IMAGE_SETTING_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&SerSettingsN[0], "BUFFER", "Buffer (MB)", "%.0f", 8, 4096, 8, 64);
+    IUFillNumberVector(&SerSettingsNP, SerSettingsN, 1, getDeviceName(), "SER_SETTINGS", "SER recording", IMAGE_SETTING_TAB, IP_RW, 0,
+                       IPS_IDLE);
+    IUFillText(&SerDirT[0], "DIR", "Directory", getenv("HOME") ? getenv("HOME") : "/tmp");
+    IUFillTextVector(&SerDirTP, SerDirT, 1, getDeviceName(), "SER_DIR", "SER recording", IMAGE_SETTING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillNumber(&SerStatusN[SER_FRAMES], "FRAMES", "Frames", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&SerStatusN[SER_SIZE], "SIZE", "Size (MB)", "%.1f", 0, 1e9, 0, 0);
+    IUFillNumber(&SerStatusN[SER_BACKLOG], "BACKLOG", "Buffer in use (%)", "%.0f", 0, 100, 0, 0);
+    IUFillNumber(&SerStatusN[SER_BEHIND], "BEHIND", "Frames not recorded", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumberVector(&SerStatusNP, SerStatusN, 4, getDeviceName(), "SER_STATUS", "SER recording", IMAGE_INFO_TAB, IP_RO, 0,
+                       IPS_IDLE);
+
+    // Shared memory export of exposures
+    IUFillSwitch(&ShmS[SHM_OFF], "OFF", "Off", ISS_ON);
+    IUFillSwitch(&ShmS[SHM_ON], "ON", "On", ISS_OFF);
+    IUFillSwitchVector(&ShmSP, ShmS, 2, getDeviceName(), "SHM_EXPORT", "Shared memory", IMAGE_SETTING_TAB, IP_RW, ISR_1OFMANY, 0,
+                       IPS_IDLE);
+    IUFillNumber(&ShmSettingsN[0], "SLOTS", "Frames kept", "%.0f", 2, 64, 1, 4);
+    IUFillNumberVector(&ShmSettingsNP, ShmSettingsN, 1, getDeviceName(), "SHM_SETTINGS", "Shared memory", IMAGE_SETTING_TAB, IP_RW, 0,
+                       IPS_IDLE);
+    IUFillBLOB(&ShmFrameB, "FRAME", "Frame", ".shm");
+    IUFillBLOBVector(&ShmFrameBP, &ShmFrameB, 1, getDeviceName(), "SHM_FRAME", "Shared memory", IMAGE_INFO_TAB, IP_RO, 60, IPS_IDLE);
+
+    // Tile compression of the frames sent to clients
+    IUFillSwitch(&CompressionS[COMPRESSION_NONE], "NONE", "None", ISS_ON);
+    IUFillSwitch(&CompressionS[COMPRESSION_RICE], "RICE", "Rice", ISS_OFF);
+    IUFillSwitch(&CompressionS[COMPRESSION_GZIP], "GZIP", "Gzip", ISS_OFF);
+    IUFillSwitchVector(&CompressionSP, CompressionS, 3, getDeviceName(), "FITS_TILE_COMPRESSION", "Tile compression", IMAGE_SETTING_TAB,
+                       IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&CompressionSettingsN[0], "THREADS", "Threads (0 = per core)", "%.0f", 0, 64, 1, 0);
+    IUFillNumberVector(&CompressionSettingsNP, CompressionSettingsN, 1, getDeviceName(), "FITS_TILE_COMPRESSION_SETTINGS",
+                       "Tile compression", IMAGE_SETTING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillNumber(&CompressionStatusN[COMPRESSION_RATIO], "RATIO", "Ratio", "%.2f", 0, 1000, 0, 0);
+    IUFillNumber(&CompressionStatusN[COMPRESSION_TIME], "TIME", "Time (s)", "%.3f", 0, 3600, 0, 0);
+    IUFillNumberVector(&CompressionStatusNP, CompressionStatusN, 2, getDeviceName(), "FITS_TILE_COMPRESSION_STATUS",
+                       "Tile compression", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    // Timing log, for occultations on a small region of interest
+    IUFillSwitch(&TimingLogS[TIMING_LOG_OFF], "OFF", "Off", ISS_ON);
+    IUFillSwitch(&TimingLogS[TIMING_LOG_RECORD], "RECORD", "Record", ISS_OFF);
+    IUFillSwitchVector(&TimingLogSP, TimingLogS, 2, getDeviceName(), "TIMING_LOG", "Timing log", IMAGE_SETTING_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&TimingLogN[0], "EXPOSURE", "Exposure (s)", "%.4f", 0.0001, 32, 0.001, 0.01);
+    IUFillNumberVector(&TimingLogNP, TimingLogN, 1, getDeviceName(), "TIMING_LOG_SETTINGS", "Timing log", IMAGE_SETTING_TAB, IP_RW,
+                       0, IPS_IDLE);
+    IUFillText(&TimingLogDirT[0], "DIR", "Directory", getenv("HOME") ? getenv("HOME") : "/tmp");
+    IUFillTextVector(&TimingLogDirTP, TimingLogDirT, 1, getDeviceName(), "TIMING_LOG_DIR", "Timing log", IMAGE_SETTING_TAB, IP_RW, 0,
+                     IPS_IDLE);
+    IUFillNumber(&TimingLogStatusN[TIMING_LOG_FRAMES], "FRAMES", "Frames", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&TimingLogStatusN[TIMING_LOG_DROPPED], "DROPPED", "Dropped", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&TimingLogStatusN[TIMING_LOG_RATE], "RATE", "Rate (fps)", "%.1f", 0, 100000, 0, 0);
+    IUFillNumber(&TimingLogStatusN[TIMING_LOG_SIZE], "SIZE", "Size (MB)", "%.1f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&TimingLogStatusNP, TimingLogStatusN, 4, getDeviceName(), "TIMING_LOG_STATUS", "Timing log", IMAGE_INFO_TAB,
+                       IP_RO, 0, IPS_IDLE);
+
+    // Driver side auto exposure, the camera's own stays off
+    IUFillSwitch(&AutoExposureS[AE_OFF], "OFF", "Off", ISS_ON);
+    IUFillSwitch(&AutoExposureS[AE_SHUTTER], "SHUTTER", "Shutter", ISS_OFF);
+    IUFillSwitch(&AutoExposureS[AE_SHUTTER_GAIN], "SHUTTER_GAIN", "Shutter and gain", ISS_OFF);
+    IUFillSwitchVector(&AutoExposureSP, AutoExposureS, 3, getDeviceName(), "AUTO_EXPOSURE", "Auto exposure", IMAGE_SETTING_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&AutoExposureN[AE_TARGET], "TARGET", "Target median (%)", "%.0f", 1, 95, 1, 40);
+    IUFillNumber(&AutoExposureN[AE_TOLERANCE], "TOLERANCE", "Tolerance (%)", "%.1f", 0.5, 20, 0.5, 5);
+    IUFillNumber(&AutoExposureN[AE_MAX_SHUTTER], "MAX_SHUTTER", "Longest shutter (s)", "%.3f", 0.001, 32, 0.1, 1);
+    IUFillNumberVector(&AutoExposureNP, AutoExposureN, 3, getDeviceName(), "AUTO_EXPOSURE_SETTINGS", "Auto exposure", IMAGE_SETTING_TAB,
+                       IP_RW, 0, IPS_IDLE);
+
+    // Bad pixels are learnt from recorded dark and flat masters
+    IUFillSwitch(&HotPixelS[HOT_PIXELS_CORRECT], "CORRECT", "Correct", ISS_ON);
+    IUFillSwitch(&HotPixelS[HOT_PIXELS_OFF], "OFF", "Off", ISS_OFF);
+    IUFillSwitchVector(&HotPixelSP, HotPixelS, 2, getDeviceName(), "HOT_PIXELS", "Hot pixels", IMAGE_SETTING_TAB, IP_RW,
+                       ISR_1OFMANY, 0, IPS_IDLE);
+
     setDefaultPollingPeriod(250);
 
     return true;
@@ -510,30 +1116,162 @@ void DC1394_PGREY::ISGetProperties(const char * dev)
 {
     INDI::CCD::ISGetProperties(dev);
 
+    // Needed before connecting, so it is defined here rather than in updateProperties
+    defineText(&GuidTP);
+    loadConfig(true, GuidTP.name);
 }
 
-bool DC1394_PGREY::updateProperties()
+bool DC1394_PGREY::ISNewText(const char * dev, const char * name, char * texts[], char * names[], int n)
 {
-    // Call parent update properties first
-    INDI::CCD::updateProperties();
-
+    if (dev && !strcmp(dev, getDeviceName()))
+    {
+        if (!strcmp(name, GuidTP.name))
+        {
+            IUUpdateText(&GuidTP, texts, names, n);
+            GuidTP.s = IPS_OK;
+            IDSetText(&GuidTP, isConnected() ? "Camera selection takes effect on the next connection." : NULL);
+            return true;
+        }
+
+        if (!strcmp(name, SerDirTP.name))
+        {
+            IUUpdateText(&SerDirTP, texts, names, n);
+            SerDirTP.s = IPS_OK;
+            IDSetText(&SerDirTP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, TimingLogDirTP.name))
+        {
+            IUUpdateText(&TimingLogDirTP, texts, names, n);
+            TimingLogDirTP.s = IPS_OK;
+            IDSetText(&TimingLogDirTP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, EventDirTP.name))
+        {
+            IUUpdateText(&EventDirTP, texts, names, n);
+            EventDirTP.s = IPS_OK;
+            IDSetText(&EventDirTP, NULL);
+            return true;
+        }
+    }
+
+    return INDI::CCD::ISNewText(dev, name, texts, names, n);
+}
+
+bool DC1394_PGREY::updateProperties()
+{
+    // Call parent update properties first
+    INDI::CCD::updateProperties();
+
     if (isConnected())
     {
 
         setupParams();
 
         // Start the timer
-        SetTimer(POLLMS);
+        timerID = SetTimer(POLLMS);
         // Set gain GUI control to real min/max gain values
         IUFillNumber(&SettingsN[0], "GAIN_VALUE", "Camera Gain (dB)", "%.2f", gain_min, gain_max, (gain_max-gain_min)/99, GAIN_DEFAULT);
 
         defineNumber(&SettingsNP);
         defineNumber(&TemperatureNP);
+        defineSwitch(&PixelFormatSP);
+        defineSwitch(&TriggerModeSP);
+        defineNumber(&BandwidthNP);
+        defineNumber(&TimingNP);
+        defineSwitch(&CalibrationSP);
+        defineText(&CalibrationTP);
+        defineNumber(&MasterNP);
+        defineSwitch(&MasterCombineSP);
+        defineSwitch(&HotPixelSP);
+        defineNumber(&StatisticsNP);
+        defineSwitch(&AutoExposureSP);
+        defineSwitch(&StarDetectionSP);
+        defineNumber(&StarSettingsNP);
+        defineNumber(&StarFieldNP);
+        defineNumber(&GuideStarNP);
+        defineSwitch(&LuckySP);
+        defineNumber(&LuckySettingsNP);
+        defineNumber(&LuckyStatsNP);
+        defineSwitch(&EventSP);
+        defineSwitch(&EventTriggerSP);
+        defineNumber(&EventSettingsNP);
+        defineText(&EventDirTP);
+        defineNumber(&EventStatusNP);
+        defineSwitch(&CompressionSP);
+        defineNumber(&CompressionSettingsNP);
+        defineNumber(&CompressionStatusNP);
+        defineSwitch(&ShmSP);
+        defineNumber(&ShmSettingsNP);
+        defineBLOB(&ShmFrameBP);
+        defineSwitch(&SerSP);
+        defineSwitch(&SerDirectSP);
+        defineNumber(&SerSettingsNP);
+        defineText(&SerDirTP);
+        defineNumber(&SerStatusNP);
+        defineSwitch(&TimingLogSP);
+        defineNumber(&TimingLogNP);
+        defineText(&TimingLogDirTP);
+        defineNumber(&TimingLogStatusNP);
+        defineNumber(&AutoExposureNP);
+        defineNumber(&HistogramNP);
+
+        // The camera comes up free running, bring it in line with the switch
+        if (IUFindOnSwitchIndex(&TriggerModeSP) != TRIGGER_FREE_RUN && !setTriggerMode(IUFindOnSwitchIndex(&TriggerModeSP)))
+        {
+            IUResetSwitch(&TriggerModeSP);
+            TriggerModeS[TRIGGER_FREE_RUN].s = ISS_ON;
+            TriggerModeSP.s = IPS_ALERT;
+            IDSetSwitch(&TriggerModeSP, NULL);
+        }
     }
     else
     {
         deleteProperty(SettingsNP.name);
         deleteProperty(TemperatureNP.name);
+        deleteProperty(PixelFormatSP.name);
+        deleteProperty(TriggerModeSP.name);
+        deleteProperty(BandwidthNP.name);
+        deleteProperty(TimingNP.name);
+        deleteProperty(CalibrationSP.name);
+        deleteProperty(CalibrationTP.name);
+        deleteProperty(MasterNP.name);
+        deleteProperty(MasterCombineSP.name);
+        deleteProperty(HotPixelSP.name);
+        deleteProperty(StatisticsNP.name);
+        deleteProperty(AutoExposureSP.name);
+        deleteProperty(StarDetectionSP.name);
+        deleteProperty(StarSettingsNP.name);
+        deleteProperty(StarFieldNP.name);
+        deleteProperty(GuideStarNP.name);
+        deleteProperty(LuckySP.name);
+        deleteProperty(LuckySettingsNP.name);
+        deleteProperty(LuckyStatsNP.name);
+        deleteProperty(EventSP.name);
+        deleteProperty(EventTriggerSP.name);
+        deleteProperty(EventSettingsNP.name);
+        deleteProperty(EventDirTP.name);
+        deleteProperty(EventStatusNP.name);
+        deleteProperty(CompressionSP.name);
+        deleteProperty(CompressionSettingsNP.name);
+        deleteProperty(CompressionStatusNP.name);
+        deleteProperty(ShmSP.name);
+        deleteProperty(ShmSettingsNP.name);
+        deleteProperty(ShmFrameBP.name);
+        deleteProperty(SerSP.name);
+        deleteProperty(SerDirectSP.name);
+        deleteProperty(SerSettingsNP.name);
+        deleteProperty(SerDirTP.name);
+        deleteProperty(SerStatusNP.name);
+        deleteProperty(TimingLogSP.name);
+        deleteProperty(TimingLogNP.name);
+        deleteProperty(TimingLogDirTP.name);
+        deleteProperty(TimingLogStatusNP.name);
+        deleteProperty(AutoExposureNP.name);
+        deleteProperty(HistogramNP.name);
     }
 
     return true;
@@ -541,13 +1279,43 @@ bool DC1394_PGREY::updateProperties()
 
 bool DC1394_PGREY::UpdateCCDBin(int binx, int biny)
 {
+    uint32_t prevBinning = binning;
 
-    if (binx != 1 || biny != 1)
+    if (binx != biny || binx < 1 || binx > MAX_BIN)
     {
-        DEBUG(INDI::Logger::DBG_ERROR, "Camera currently does not support binning.");
+        DEBUGF(INDI::Logger::DBG_ERROR, "Only symmetric binning from 1x1 to %dx%d is supported.", MAX_BIN, MAX_BIN);
         return false;
     }
-    return true;
+
+    if (InExposure || logging)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot change binning while exposing.");
+        return false;
+    }
+
+    binning = binx;
+    if (!applySubframe(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH()))
+    {
+        if (!hardwareBin[binning])
+        {
+            binning = prevBinning;
+            return false;
+        }
+        // The binned Format7 mode would not take our settings, bin in software instead
+        hardwareBin[binning] = false;
+        if (!applySubframe(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH()))
+        {
+            binning = prevBinning;
+            return false;
+        }
+    }
+
+    if (binning > 1)
+        DEBUGF(INDI::Logger::DBG_SESSION, "%s %dx%d binning.", hardwareBin[binning] ? "Hardware" : "Software", binx, biny);
+
+    PrimaryCCD.setBPP(outputBPP());
+
+    return INDI::CCD::UpdateCCDBin(binx, biny);
 }
 
 void DC1394_PGREY::setupParams()
@@ -555,16 +1323,18 @@ void DC1394_PGREY::setupParams()
 
     float temp;
 
+    uint32_t scale = hardwareBin[binning] ? binning : 1;
+
     // The Pointgrey Chameleon has Sony ICX445 CCD sensor
-    //Test8
-    //SetCCDParams(width, height, 16, 7.5, 7.5);
-    SetCCDParams(width, height, 8, 7.5, 7.5);
+    SetCCDParams(maxWidth, maxHeight, bitsPerPixel, 7.5, 7.5);
+
+    // SetCCDParams resets the frame to the full sensor, keep the subframe the camera is actually set to
+    PrimaryCCD.setFrame(roiX * scale, roiY * scale, width * scale, height * scale);
+    PrimaryCCD.setBin(binning, binning);
 
     // How much memory we need for the frame buffer
     int nbuf;
-    //Test8
     nbuf = PrimaryCCD.getXRes() * PrimaryCCD.getYRes() * PrimaryCCD.getBPP()/8;
-    //nbuf = PrimaryCCD.getXRes() * PrimaryCCD.getYRes() * 16/8;
     //DEBUG(INDI::Logger::DBG_SESSION, "xres:%d, yres:%d", PrimaryCCD.getXres, PrimaryCCD.getYres);
     nbuf += 4096; //  leave a little extra at the end
     PrimaryCCD.setFrameBufferSize(nbuf);
@@ -572,24 +1342,354 @@ void DC1394_PGREY::setupParams()
 }
 
 
+bool DC1394_PGREY::UpdateCCDFrame(int x, int y, int w, int h)
+{
+    if (InExposure || logging)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot change subframe while exposing.");
+        return false;
+    }
+
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 || (uint32_t)(x + w) > maxWidth || (uint32_t)(y + h) > maxHeight)
+    {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Subframe (%d,%d) %dx%d is outside the %ux%u sensor.", x, y, w, h, maxWidth, maxHeight);
+        return false;
+    }
+
+    return applySubframe(x, y, w, h);
+}
+
+bool DC1394_PGREY::applySubframe(int x, int y, int w, int h)
+{
+    uint32_t left, top, roiW, roiH;
+    // With hardware binning the camera counts in binned pixels, INDI always in sensor pixels
+    uint32_t scale = hardwareBin[binning] ? binning : 1;
+    const Format7Geometry &g = geometry[scale];
+
+    /* Round the requested box outwards to the camera's position and size units,
+     * so the region the client asked for is always inside what we read out */
+    left = x / scale;
+    top = y / scale;
+    roiW = (x + w + scale - 1) / scale - left;
+    roiH = (y + h + scale - 1) / scale - top;
+    left -= left % g.unitPosX;
+    top -= top % g.unitPosY;
+    roiW = ((x / scale + roiW - left + g.unitSizeX - 1) / g.unitSizeX) * g.unitSizeX;
+    roiH = ((y / scale + roiH - top + g.unitSizeY - 1) / g.unitSizeY) * g.unitSizeY;
+    roiW = std::min(roiW, g.maxWidth - g.maxWidth % g.unitSizeX);
+    roiH = std::min(roiH, g.maxHeight - g.maxHeight % g.unitSizeY);
+    // Slide the box back inside the sensor if rounding pushed it over the edge
+    if (left + roiW > g.maxWidth)
+        left = (g.maxWidth - roiW) - (g.maxWidth - roiW) % g.unitPosX;
+    if (top + roiH > g.maxHeight)
+        top = (g.maxHeight - roiH) - (g.maxHeight - roiH) % g.unitPosY;
+
+    if (g.mode != captureMode || left != roiX || top != roiY || roiW != width || roiH != height)
+    {
+        if (!configureFormat7(g.mode, colorCoding, left, top, roiW, roiH))
+            return false;
+
+        DEBUGF(INDI::Logger::DBG_SESSION, "Hardware ROI set to (%u,%u) %ux%u", roiX, roiY, width, height);
+    }
+
+    return INDI::CCD::UpdateCCDFrame(roiX * scale, roiY * scale, width * scale, height * scale);
+}
+
+bool DC1394_PGREY::readFormat7Geometry(dc1394video_mode_t mode, Format7Geometry &g)
+{
+    dc1394error_t err;
+
+    g.mode = mode;
+    err = dc1394_format7_get_max_image_size(dcam, mode, &g.maxWidth, &g.maxHeight);
+    if (err != DC1394_SUCCESS)
+        return false;
+
+    /* Subframes have to start and extend in whole Format7 units */
+    err = dc1394_format7_get_unit_position(dcam, mode, &g.unitPosX, &g.unitPosY);
+    if (err != DC1394_SUCCESS || !g.unitPosX || !g.unitPosY)
+    {
+        g.unitPosX = g.unitPosY = 1;
+    }
+    err = dc1394_format7_get_unit_size(dcam, mode, &g.unitSizeX, &g.unitSizeY);
+    if (err != DC1394_SUCCESS || !g.unitSizeX || !g.unitSizeY)
+    {
+        g.unitSizeX = g.unitSizeY = 1;
+    }
+
+    return true;
+}
+
+void DC1394_PGREY::findBinnedModes(const dc1394video_modes_t &modes)
+{
+    Format7Geometry g;
+    uint32_t i, bin;
+
+    for (bin = 1; bin <= MAX_BIN; bin++)
+        hardwareBin[bin] = false;
+    hardwareBin[1] = true;
+
+    /* A Format7 mode whose maximum image is the working mode's divided by a
+     * whole factor reads the sensor out binned by that factor. Sizes are
+     * allowed to differ by a few percent, sensors often lose some edge rows. */
+    for (i = 0; i < modes.num; i++)
+    {
+        if (modes.modes[i] < DC1394_VIDEO_MODE_FORMAT7_MIN || modes.modes[i] > DC1394_VIDEO_MODE_FORMAT7_MAX ||
+                modes.modes[i] == selected_mode)
+            continue;
+        if (!readFormat7Geometry(modes.modes[i], g) || !g.maxWidth || !g.maxHeight)
+            continue;
+
+        bin = (maxWidth + g.maxWidth / 2) / g.maxWidth;
+        if (bin < 2 || bin > MAX_BIN || hardwareBin[bin])
+            continue;
+        if (abs((int)(g.maxWidth * bin) - (int)maxWidth) * 50 > (int)maxWidth ||
+                abs((int)(g.maxHeight * bin) - (int)maxHeight) * 50 > (int)maxHeight)
+            continue;
+
+        geometry[bin] = g;
+        hardwareBin[bin] = true;
+        IDMessage(getDeviceName(), "Format7 mode %d provides %dx%d hardware binning", g.mode, bin, bin);
+    }
+}
+
+bool DC1394_PGREY::probeCapabilities(CameraCapabilities &caps)
+{
+    dc1394error_t err;
+    dc1394video_modes_t modes;
+    dc1394color_codings_t codings;
+    bool complete = true;
+    uint32_t i;
+
+    /* Reset camera */
+    err = dc1394_camera_reset(dcam);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to reset camera!");
+        return false;
+    }
+
+    err = dc1394_video_get_supported_modes(dcam, &modes);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to get list of supported modes");
+        return false;
+    }
+    IDMessage(getDeviceName(), "Number of Supported modes: %d",modes.num);
+
+    if (!readFormat7Geometry(selected_mode, geometry[1]))
+    {
+	IDMessage(getDeviceName(), "Unable to connect to read maximum image size");
+        return false;
+    }
+    maxWidth = geometry[1].maxWidth;
+    maxHeight = geometry[1].maxHeight;
+
+    findBinnedModes(modes);
+
+    err = dc1394_format7_get_color_codings(dcam,selected_mode,&codings);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to get list of supported color codings");
+        return false;
+    }
+    IDMessage(getDeviceName(), "Number of Supported modes: %d",codings.num);
+    //IDMessage(getDeviceName(), "Supported modes: %d",codings.codings);
+
+    int cusu;
+    for(cusu=0; cusu<codings.num; cusu++){
+	    if(codings.codings[cusu]==DC1394_COLOR_CODING_MONO8){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_MONO8", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_YUV411){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_YUV411", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_YUV422){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_YUV422", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_YUV444){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_YUV444", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RGB8){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RGB8", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_MONO16){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_MONO16", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RGB16){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RGB16", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_MONO16S){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_MONO16S", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RGB16S){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RGB16S", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RAW8){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RAW8", cusu);
+	    }
+	    else if(codings.codings[cusu]==DC1394_COLOR_CODING_RAW16){
+		IDMessage(getDeviceName(), "Supported color coding %d: DC1394_COLOR_CODING_RAW16", cusu);
+	    }
+	    else{
+		IDMessage(getDeviceName(), "Coding not in the list of libdc1394");
+	    }
+    }
+
+    err = dc1394_feature_get_absolute_boundaries(dcam, DC1394_FEATURE_SHUTTER, &shutter_min, &shutter_max);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Could not get max shutter length");
+        complete = false;
+    }
+    else
+    {
+        IDMessage(getDeviceName(), "Min exposure = %f, Max = %f",shutter_min,shutter_max);
+    }
+
+    /* get and save min/max gain values */
+    err = dc1394_feature_get_absolute_boundaries(dcam, DC1394_FEATURE_GAIN, &gain_min, &gain_max);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Could not get max gain value");
+        complete = false;
+    }
+    else
+    {
+        IDMessage(getDeviceName(), "Min gain = %f, Max = %f",gain_min,gain_max);
+    }
+
+    // Only a full set of answers is worth remembering
+    if (!complete)
+        return true;
+
+    caps.vendor = dcam->vendor ? dcam->vendor : "";
+    caps.model = dcam->model ? dcam->model : "";
+    caps.modes.assign(modes.modes, modes.modes + modes.num);
+    caps.codings.assign(codings.codings, codings.codings + codings.num);
+    caps.geometry.clear();
+    for (i = 1; i <= MAX_BIN; i++)
+        if (hardwareBin[i])
+            caps.geometry.push_back(std::make_pair(i, geometry[i]));
+    caps.shutterMin = shutter_min;
+    caps.shutterMax = shutter_max;
+    caps.gainMin = gain_min;
+    caps.gainMax = gain_max;
+
+    if (!saveCapabilities(connectedGUID, caps))
+        DEBUG(INDI::Logger::DBG_WARNING, "Could not save the camera capability cache");
+
+    return true;
+}
+
+bool DC1394_PGREY::verifyCapabilities(const CameraCapabilities &caps)
+{
+    uint32_t w, h;
+
+    /* Vendor and model come from the config ROM dc1394_camera_new already
+     * read, the maximum image size costs a single register read */
+    if (caps.vendor != (dcam->vendor ? dcam->vendor : "") || caps.model != (dcam->model ? dcam->model : ""))
+        return false;
+    if (std::find(caps.modes.begin(), caps.modes.end(), selected_mode) == caps.modes.end())
+        return false;
+    if (caps.geometry[0].second.mode != selected_mode)
+        return false;
+    if (dc1394_format7_get_max_image_size(dcam, selected_mode, &w, &h) != DC1394_SUCCESS)
+        return false;
+
+    return w == caps.geometry[0].second.maxWidth && h == caps.geometry[0].second.maxHeight;
+}
+
+void DC1394_PGREY::applyCapabilities(const CameraCapabilities &caps)
+{
+    uint32_t bin;
+    size_t i;
+
+    for (bin = 1; bin <= MAX_BIN; bin++)
+        hardwareBin[bin] = false;
+    for (i = 0; i < caps.geometry.size(); i++)
+    {
+        bin = caps.geometry[i].first;
+        if (bin < 1 || bin > MAX_BIN)
+            continue;
+        geometry[bin] = caps.geometry[i].second;
+        hardwareBin[bin] = true;
+    }
+    maxWidth = geometry[1].maxWidth;
+    maxHeight = geometry[1].maxHeight;
+
+    shutter_min = caps.shutterMin;
+    shutter_max = caps.shutterMax;
+    gain_min = caps.gainMin;
+    gain_max = caps.gainMax;
+}
+
 bool DC1394_PGREY::AbortExposure()
 {
     InExposure = false;
+    downloading = false;
+
+    // A free running camera would otherwise keep sending frames nobody wants, a stack in particular
+    if (triggerMode == TRIGGER_FREE_RUN && !capturing)
+        dc1394_video_set_transmission(dcam, DC1394_OFF);
     return true;
 }
 
 float DC1394_PGREY::CalcTimeLeft()
 {
     double timesince;
-    double timeleft;
-    struct timeval now;
-    gettimeofday(&now,NULL);
+    struct timespec now;
+
+    // Monotonic, so NTP stepping the wall clock mid-exposure doesn't matter
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timesince = (now.tv_sec - ExpStart.tv_sec) + (now.tv_nsec - ExpStart.tv_nsec) / 1e9;
+
+    return ExposureRequest - timesince;
+}
+
+bool DC1394_PGREY::setShutter(float seconds)
+{
+    dc1394error_t err;
+
+    if (seconds == shutterRequest)
+        return true;
+
+    err = dc1394_feature_set_absolute_value(dcam, DC1394_FEATURE_SHUTTER, seconds);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to set shutter value.");
+        shutterRequest = -1;
+        return false;
+    }
+    shutterRequest = seconds;
+
+    err = dc1394_feature_get_absolute_value(dcam, DC1394_FEATURE_SHUTTER, &shutterValue);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to get shutter value.");
+        shutterValue = seconds;
+    }
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Set shutter value to %f.", shutterValue);
+
+    return true;
+}
+
+bool DC1394_PGREY::setGain(float dB)
+{
+    dc1394error_t err;
 
-    timesince=(double)(now.tv_sec * 1000.0 + now.tv_usec/1000) - (double)(ExpStart.tv_sec * 1000.0 + ExpStart.tv_usec/1000);
-    timesince=timesince/1000;
+    if (dB == SettingsN[0].value)
+        return true;
 
-    timeleft=ExposureRequest-timesince;
-    return timeleft;
+    err = dc1394_feature_set_absolute_value(dcam, DC1394_FEATURE_GAIN, dB);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Could not Set gain ");
+        return false;
+    }
+    SettingsN[0].value = dB;
+    IDSetNumber(&SettingsNP, NULL);
+
+    return true;
 }
 
 bool DC1394_PGREY::ISNewNumber(const char * dev, const char * name, double values[], char * names[], int n)
@@ -629,31 +1729,396 @@ bool DC1394_PGREY::ISNewNumber(const char * dev, const char * name, double value
 
             return true;
         }
-        else if(!strcmp(name,TemperatureNP.name))
+        else if (!strcmp(name, StarSettingsNP.name))
         {
-            if((temp = GetTemperature()) >= 0)
+            IUUpdateNumber(&StarSettingsNP, values, names, n);
+            StarSettingsNP.s = IPS_OK;
+            IDSetNumber(&StarSettingsNP, NULL);
+            return true;
+        }
+        else if (!strcmp(name, CompressionSettingsNP.name))
+        {
+            IUUpdateNumber(&CompressionSettingsNP, values, names, n);
+            CompressionSettingsNP.s = IPS_OK;
+            IDSetNumber(&CompressionSettingsNP, compressor.running() ? "The thread count takes effect when compression is next turned on." : NULL);
+            return true;
+        }
+        else if (!strcmp(name, ShmSettingsNP.name))
+        {
+            IUUpdateNumber(&ShmSettingsNP, values, names, n);
+            ShmSettingsNP.s = IPS_OK;
+            // Readers find the new ring under the same name
+            if (frameShm.isOpen() && !openShm())
             {
-                TemperatureN[0].value = temp;
-                IDMessage(getDeviceName(), "New temp set ");
-                IDSetNumber(&TemperatureNP, NULL);
+                ShmSettingsNP.s = IPS_ALERT;
+                ShmSP.s = IPS_ALERT;
+                IDSetSwitch(&ShmSP, NULL);
             }
+            IDSetNumber(&ShmSettingsNP, NULL);
             return true;
         }
-    }
-
-    // If we didn't process anything above, let the parent handle it.
-    return INDI::CCD::ISNewNumber(dev,name,values,names,n);
-}
-
-
-
-bool DC1394_PGREY::ISNewSwitch(const char * dev, const char * name, ISState * states, char * names[], int n)
-{
-
-    //  Nobody has claimed this, so, ignore it
-    return INDI::CCD::ISNewSwitch(dev, name, states, names, n);
-}
-
+        else if (!strcmp(name, SerSettingsNP.name))
+        {
+            IUUpdateNumber(&SerSettingsNP, values, names, n);
+            SerSettingsNP.s = IPS_OK;
+            IDSetNumber(&SerSettingsNP, ser.running() ? "The buffer size takes effect on the next recording." : NULL);
+            return true;
+        }
+        else if (!strcmp(name, TimingLogNP.name))
+        {
+            IUUpdateNumber(&TimingLogNP, values, names, n);
+            TimingLogNP.s = IPS_OK;
+            IDSetNumber(&TimingLogNP, logging ? "The exposure takes effect on the next log." : NULL);
+            return true;
+        }
+        else if (!strcmp(name, EventSettingsNP.name))
+        {
+            IUUpdateNumber(&EventSettingsNP, values, names, n);
+            EventSettingsNP.s = IPS_OK;
+            IDSetNumber(&EventSettingsNP, events.running() ? "The buffer size takes effect on the next stream." : NULL);
+            return true;
+        }
+        else if (!strcmp(name, LuckySettingsNP.name))
+        {
+            IUUpdateNumber(&LuckySettingsNP, values, names, n);
+            // A new window starts over rather than judging by a mix of old and new
+            resetLucky();
+            LuckySettingsNP.s = IPS_OK;
+            IDSetNumber(&LuckySettingsNP, NULL);
+            return true;
+        }
+        else if (!strcmp(name, AutoExposureNP.name))
+        {
+            IUUpdateNumber(&AutoExposureNP, values, names, n);
+            AutoExposureNP.s = IPS_OK;
+            IDSetNumber(&AutoExposureNP, NULL);
+            return true;
+        }
+        else if (!strcmp(name, MasterNP.name))
+        {
+            IUUpdateNumber(&MasterNP, values, names, n);
+            MasterNP.s = IPS_OK;
+            IDSetNumber(&MasterNP, NULL);
+            return true;
+        }
+        else if(!strcmp(name,TemperatureNP.name))
+        {
+            if((temp = GetTemperature()) >= 0)
+            {
+                TemperatureN[0].value = temp;
+                IDMessage(getDeviceName(), "New temp set ");
+                IDSetNumber(&TemperatureNP, NULL);
+            }
+            return true;
+        }
+    }
+
+    // If we didn't process anything above, let the parent handle it.
+    return INDI::CCD::ISNewNumber(dev,name,values,names,n);
+}
+
+
+
+bool DC1394_PGREY::ISNewSwitch(const char * dev, const char * name, ISState * states, char * names[], int n)
+{
+    if (dev && !strcmp(dev, getDeviceName()))
+    {
+        if (!strcmp(name, PixelFormatSP.name))
+        {
+            int prevIndex = IUFindOnSwitchIndex(&PixelFormatSP);
+
+            if (InExposure || capturing || logging)
+            {
+                DEBUG(INDI::Logger::DBG_ERROR, "Cannot change pixel format while exposing or streaming.");
+                PixelFormatSP.s = IPS_ALERT;
+                IDSetSwitch(&PixelFormatSP, NULL);
+                return true;
+            }
+
+            IUUpdateSwitch(&PixelFormatSP, states, names, n);
+            int index = IUFindOnSwitchIndex(&PixelFormatSP);
+            if (index == prevIndex)
+            {
+                PixelFormatSP.s = IPS_OK;
+                IDSetSwitch(&PixelFormatSP, NULL);
+                return true;
+            }
+
+            if (!setColorCoding(index == PIXEL_FORMAT_MONO16 ? DC1394_COLOR_CODING_MONO16 : DC1394_COLOR_CODING_MONO8))
+            {
+                IUResetSwitch(&PixelFormatSP);
+                PixelFormatS[prevIndex].s = ISS_ON;
+                PixelFormatSP.s = IPS_ALERT;
+                IDSetSwitch(&PixelFormatSP, NULL);
+                return true;
+            }
+
+            PixelFormatSP.s = IPS_OK;
+            IDSetSwitch(&PixelFormatSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, StarDetectionSP.name))
+        {
+            IUUpdateSwitch(&StarDetectionSP, states, names, n);
+            StarDetectionSP.s = IPS_OK;
+            IDSetSwitch(&StarDetectionSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CompressionSP.name))
+        {
+            IUUpdateSwitch(&CompressionSP, states, names, n);
+            if (CompressionS[COMPRESSION_NONE].s == ISS_ON)
+            {
+                stopCompression();
+                CompressionSP.s = IPS_IDLE;
+            }
+            else if (compressor.running() || startCompression())
+            {
+                CompressionSP.s = IPS_OK;
+            }
+            else
+            {
+                IUResetSwitch(&CompressionSP);
+                CompressionS[COMPRESSION_NONE].s = ISS_ON;
+                CompressionSP.s = IPS_ALERT;
+            }
+            IDSetSwitch(&CompressionSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, ShmSP.name))
+        {
+            IUUpdateSwitch(&ShmSP, states, names, n);
+            if (ShmS[SHM_OFF].s == ISS_ON)
+            {
+                frameShm.close();
+                ShmSP.s = IPS_IDLE;
+            }
+            else if (frameShm.isOpen() || openShm())
+            {
+                ShmSP.s = IPS_OK;
+            }
+            else
+            {
+                IUResetSwitch(&ShmSP);
+                ShmS[SHM_OFF].s = ISS_ON;
+                ShmSP.s = IPS_ALERT;
+            }
+            IDSetSwitch(&ShmSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, SerSP.name))
+        {
+            IUUpdateSwitch(&SerSP, states, names, n);
+            if (SerS[SER_OFF].s == ISS_ON)
+            {
+                if (ser.running())
+                    stopSer();
+                SerSP.s = IPS_IDLE;
+            }
+            else if (!capturing)
+            {
+                // Recording starts with the stream
+                SerSP.s = IPS_OK;
+            }
+            else if (ser.running() || startSer())
+            {
+                SerSP.s = IPS_BUSY;
+            }
+            else
+            {
+                IUResetSwitch(&SerSP);
+                SerS[SER_OFF].s = ISS_ON;
+                SerSP.s = IPS_ALERT;
+            }
+            IDSetSwitch(&SerSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, SerDirectSP.name))
+        {
+            IUUpdateSwitch(&SerDirectSP, states, names, n);
+            SerDirectSP.s = IPS_OK;
+            IDSetSwitch(&SerDirectSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, TimingLogSP.name))
+        {
+            IUUpdateSwitch(&TimingLogSP, states, names, n);
+            if (TimingLogS[TIMING_LOG_OFF].s == ISS_ON)
+            {
+                if (logging)
+                    stopTimingLog();
+                TimingLogSP.s = IPS_IDLE;
+            }
+            else if (logging || startTimingLog())
+            {
+                TimingLogSP.s = IPS_BUSY;
+            }
+            else
+            {
+                IUResetSwitch(&TimingLogSP);
+                TimingLogS[TIMING_LOG_OFF].s = ISS_ON;
+                TimingLogSP.s = IPS_ALERT;
+            }
+            IDSetSwitch(&TimingLogSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, EventSP.name))
+        {
+            IUUpdateSwitch(&EventSP, states, names, n);
+            if (EventS[EVENTS_OFF].s == ISS_ON)
+            {
+                events.stop();
+                reportEvents();
+            }
+            else if (capturing && !events.running() && !startEvents())
+            {
+                IUResetSwitch(&EventSP);
+                EventS[EVENTS_OFF].s = ISS_ON;
+                EventSP.s = IPS_ALERT;
+                IDSetSwitch(&EventSP, NULL);
+                return true;
+            }
+            EventSP.s = EventS[EVENTS_ON].s == ISS_ON ? IPS_BUSY : IPS_IDLE;
+            IDSetSwitch(&EventSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, EventTriggerSP.name))
+        {
+            struct timeval now;
+
+            IUResetSwitch(&EventTriggerSP);
+            if (!events.running())
+            {
+                EventTriggerSP.s = IPS_ALERT;
+                IDSetSwitch(&EventTriggerSP, "Event capture is not running.");
+                return true;
+            }
+            gettimeofday(&now, NULL);
+            events.trigger(now.tv_sec + now.tv_usec / 1e6, EventSettingsN[EVENT_PRE].value, EventSettingsN[EVENT_POST].value);
+            EventTriggerSP.s = IPS_OK;
+            IDSetSwitch(&EventTriggerSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, LuckySP.name))
+        {
+            IUUpdateSwitch(&LuckySP, states, names, n);
+            resetLucky();
+            LuckySP.s = LuckyS[LUCKY_ON].s == ISS_ON ? IPS_BUSY : IPS_IDLE;
+            IDSetSwitch(&LuckySP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, AutoExposureSP.name))
+        {
+            IUUpdateSwitch(&AutoExposureSP, states, names, n);
+            // Start from wherever the shutter is now
+            aeShutter = shutterValue > 0 ? shutterValue : 0;
+            aeSettle = 0;
+            AutoExposureSP.s = AutoExposureS[AE_OFF].s == ISS_ON ? IPS_IDLE : IPS_BUSY;
+            IDSetSwitch(&AutoExposureSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, HotPixelSP.name))
+        {
+            IUUpdateSwitch(&HotPixelSP, states, names, n);
+            HotPixelSP.s = IPS_OK;
+            IDSetSwitch(&HotPixelSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, MasterCombineSP.name))
+        {
+            IUUpdateSwitch(&MasterCombineSP, states, names, n);
+            MasterCombineSP.s = IPS_OK;
+            IDSetSwitch(&MasterCombineSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CalibrationSP.name))
+        {
+            IUUpdateSwitch(&CalibrationSP, states, names, n);
+            CalibrationSP.s = IPS_OK;
+            IDSetSwitch(&CalibrationSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, TriggerModeSP.name))
+        {
+            int prevIndex = IUFindOnSwitchIndex(&TriggerModeSP);
+
+            if (InExposure || capturing || logging)
+            {
+                DEBUG(INDI::Logger::DBG_ERROR, "Cannot change trigger mode while exposing or streaming.");
+                TriggerModeSP.s = IPS_ALERT;
+                IDSetSwitch(&TriggerModeSP, NULL);
+                return true;
+            }
+
+            IUUpdateSwitch(&TriggerModeSP, states, names, n);
+            int index = IUFindOnSwitchIndex(&TriggerModeSP);
+
+            // Before connecting only the choice is recorded, updateProperties applies it
+            if (isConnected() && !setTriggerMode(index))
+            {
+                IUResetSwitch(&TriggerModeSP);
+                TriggerModeS[prevIndex].s = ISS_ON;
+                TriggerModeSP.s = IPS_ALERT;
+                IDSetSwitch(&TriggerModeSP, NULL);
+                return true;
+            }
+
+            TriggerModeSP.s = IPS_OK;
+            IDSetSwitch(&TriggerModeSP, NULL);
+            return true;
+        }
+    }
+
+
+    //  Nobody has claimed this, so, ignore it
+    return INDI::CCD::ISNewSwitch(dev, name, states, names, n);
+}
+
+
+bool DC1394_PGREY::saveConfigItems(FILE * fp)
+{
+    INDI::CCD::saveConfigItems(fp);
+
+    IUSaveConfigSwitch(fp, &PixelFormatSP);
+    IUSaveConfigSwitch(fp, &TriggerModeSP);
+    IUSaveConfigSwitch(fp, &CalibrationSP);
+    IUSaveConfigNumber(fp, &MasterNP);
+    IUSaveConfigSwitch(fp, &MasterCombineSP);
+    IUSaveConfigSwitch(fp, &HotPixelSP);
+    IUSaveConfigNumber(fp, &AutoExposureNP);
+    IUSaveConfigSwitch(fp, &StarDetectionSP);
+    IUSaveConfigNumber(fp, &StarSettingsNP);
+    IUSaveConfigSwitch(fp, &LuckySP);
+    IUSaveConfigNumber(fp, &LuckySettingsNP);
+    IUSaveConfigNumber(fp, &EventSettingsNP);
+    IUSaveConfigText(fp, &EventDirTP);
+    IUSaveConfigSwitch(fp, &CompressionSP);
+    IUSaveConfigNumber(fp, &CompressionSettingsNP);
+    IUSaveConfigSwitch(fp, &ShmSP);
+    IUSaveConfigNumber(fp, &ShmSettingsNP);
+    IUSaveConfigSwitch(fp, &SerDirectSP);
+    IUSaveConfigNumber(fp, &SerSettingsNP);
+    IUSaveConfigText(fp, &SerDirTP);
+    IUSaveConfigNumber(fp, &TimingLogNP);
+    IUSaveConfigText(fp, &TimingLogDirTP);
+    IUSaveConfigText(fp, &GuidTP);
+
+    return true;
+}
 
 /*void DC1394_PGREY::addFITSKeywords(fitsfile * fptr, CCDChip * targetChip)
 {
@@ -665,9 +2130,43 @@ bool DC1394_PGREY::ISNewSwitch(const char * dev, const char * name, ISState * st
 /////////////////////////////////////////////////////////
 /// Add applicable FITS keywords to header (copied from atikccd driver)
 /////////////////////////////////////////////////////////
-void DC1394_PGREY::addFITSKeywords(INDI::CCDChip *targetChip)
+void DC1394_PGREY::addFITSKeywords(INDI::CCDChip *targetChip, std::vector<INDI::FITSRecord> &fitsKeywords)
 {
-    INDI::CCD::addFITSKeywords(targetChip);
+    INDI::CCD::addFITSKeywords(targetChip, fitsKeywords);
+
+    if (frameTiming.valid)
+    {
+        char date[64];
+        struct tm tm;
+        int64_t ms = (int64_t)llround(frameTiming.mid * 1000);
+        time_t secs = (time_t)(ms / 1000);
+
+        gmtime_r(&secs, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(date + strlen(date), sizeof(date) - strlen(date), ".%03d", (int)(ms % 1000));
+
+        fitsKeywords.push_back({"DATE-AVG", date, "UTC mid-exposure"});
+        fitsKeywords.push_back({"MJD-AVG", frameTiming.mid / 86400.0 + 40587.0, 8, "MJD mid-exposure"});
+        fitsKeywords.push_back({"TIMESRC", frameTiming.cycleSync ? "CAMERA" : "HOST", "Mid-exposure time source"});
+        fitsKeywords.push_back({"TOFFSET", frameTiming.hostOffset * 1000, 3, "[ms] Exposure start minus host start"});
+        if (!appliedDark.empty())
+            fitsKeywords.push_back({"CALDARK", appliedDark.c_str(), "Master subtracted in the driver"});
+        if (!appliedFlat.empty())
+            fitsKeywords.push_back({"CALFLAT", appliedFlat.c_str(), "Master flat applied in the driver"});
+        if (buildTotal > 1)
+            fitsKeywords.push_back({"NCOMBINE", (int64_t)buildTotal, "Frames combined into this master"});
+        if (stackTotal > 1)
+        {
+            fitsKeywords.push_back({"STACKCNT", (int64_t)stackTotal, "Sub-exposures summed"});
+            fitsKeywords.push_back({"SUBEXP", (double)shutterValue, 6, "[s] Sub-exposure time"});
+        }
+        if (frameTiming.embedded)
+        {
+            fitsKeywords.push_back({"FRAMECNT", (int64_t)frameTiming.frameCounter, "Camera frame counter"});
+            fitsKeywords.push_back({"CAMSHUT", (int64_t)frameTiming.shutterRaw, "Camera shutter register"});
+            fitsKeywords.push_back({"CAMGAIN", (int64_t)frameTiming.gainRaw, "Camera gain register"});
+        }
+    }
 
     /*if (m_isHorizon)
     {
@@ -679,8 +2178,8 @@ void DC1394_PGREY::addFITSKeywords(INDI::CCDChip *targetChip)
 
 void DC1394_PGREY::TimerHit()
 {
-    long timeleft;
-    int timerID = -1;
+    float timeleft;
+    int next = POLLMS;
     float temp;
 
     if(isConnected() == false)
@@ -688,64 +2187,39 @@ void DC1394_PGREY::TimerHit()
         return;  //  No need to reset timer if we are not connected anymore
     }
 
-    if (InExposure)
+    /* The timer only reports progress. The frame itself arrives through the
+     * capture pipe as soon as it is read out, so nothing here waits for it. */
+    if (InExposure && !downloading)
     {
         timeleft = CalcTimeLeft();
-        if (timeleft < 1.0)
+        if (timeleft > 0)
         {
-            if (timeleft > 0.25)
-            {
-                //  a quarter of a second or more - just set a tighter timer
-                timerID = SetTimer(250);
-            }
-            else
-            {
-                if (timeleft > 0.07)
-                {
-                    //  use an even tighter timer
-                    timerID = SetTimer(50);
-                }
-                else
-                {
-                    //  it's real close now, so spin on it
-                    if (timeleft > 0)
-                    {
-                        int slv;
-                        slv = 100000 * timeleft;
-                        usleep(slv);
-                    }
-
-                    /* We're done exposing */
-                    DEBUG(INDI::Logger::DBG_SESSION,  "Exposure done, downloading image...");
-
-                    PrimaryCCD.setExposureLeft(0);
-                    InExposure = false;
-                    /* grab and save image */
-                    grabImage();
-                }
-            }
+            PrimaryCCD.setExposureLeft(timeleft);
+
+            // Wake up right when the exposure ends instead of up to a poll period later
+            if (timeleft * 1000 < next)
+                next = std::max(1, (int)ceil(timeleft * 1000));
         }
         else
         {
-            if (isDebug())
-            {
-                IDLog("With time left %ld\n", timeleft);
-                IDLog("image not yet ready....\n");
-            }
-            PrimaryCCD.setExposureLeft(timeleft);
+            DEBUG(INDI::Logger::DBG_SESSION,  "Exposure done, downloading image...");
+            PrimaryCCD.setExposureLeft(0);
+            downloading = true;
         }
     }
 
-    // read temperature sensor (if enabled)
-    if(temperatureCanRead && (temp = GetTemperature()) >= 0)
+    if (logging)
+        publishTimingLog();
+
+    // read temperature sensor (if enabled), but not on the extra wakeups that close an exposure
+    if(temperatureCanRead && next == POLLMS && (temp = GetTemperature()) >= 0)
     {
         TemperatureN[0].value = temp;
         IDSetNumber(&TemperatureNP, NULL);
     }
 
 
-    if (timerID == -1)
-        SetTimer(POLLMS);
+    timerID = SetTimer(next);
 
     return;
 }
@@ -900,16 +2374,24 @@ IPState DC1394_PGREY::GuideWest(float ms)
     return IPS_OK;
 }*/
 
-void DC1394_PGREY::grabImage()
+void DC1394_PGREY::grabImage(dc1394video_frame_t * frame)
 {
-    unsigned char * myimage;
-    dc1394error_t err;
-    dc1394video_frame_t * frame;
-    uint32_t uheight, uwidth;
-    uint16_t val;
-    struct timeval start, end;
+    size_t moved;
+    double copyTime;
+    struct timespec start, copyStart, end;
+
+    if (stackTotal > 1)
+    {
+        stackFrame(frame);
+        return;
+    }
+    if (buildTotal > 1)
+    {
+        buildFrame(frame);
+        return;
+    }
 
-    IDMessage(getDeviceName(), "Bytes allocated for image: %ld", frame->allocated_image_bytes);
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Bytes allocated for image: %ld", frame->allocated_image_bytes);
 
     // Let's get a pointer to the frame buffer
     unsigned char * image = PrimaryCCD.getFrameBuffer();
@@ -917,115 +2399,1989 @@ void DC1394_PGREY::grabImage()
     // Get width and height
     int width = PrimaryCCD.getSubW() / PrimaryCCD.getBinX();
     int height = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
-    IDMessage(getDeviceName(), "Size: (%d,%d)", width, height);
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Size: (%d,%d)", width, height);
 
-    memset(image, 0, PrimaryCCD.getFrameBufferSize());
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    gettimeofday(&start, NULL);
-    
-    IDMessage(getDeviceName(), "Next instruction is dequeue");
+    InExposure = false;
+    downloading = false;
+
+    // A triggered camera stays armed for the next exposure
+    if (triggerMode == TRIGGER_FREE_RUN)
+        dc1394_video_set_transmission(dcam,DC1394_OFF);
 
-    err=dc1394_capture_dequeue(dcam, DC1394_CAPTURE_POLICY_WAIT, &frame);
-        IDMessage(getDeviceName(), "Dequeued!");
-    if (err != DC1394_SUCCESS)
-    {
-        IDMessage(getDeviceName(), "Could not capture frame");
-    }
-    //dc1394_get_image_size_from_video_mode(dcam,DC1394_VIDEO_MODE_1280x960_MONO16, &uwidth, &uheight);
-    dc1394_get_image_size_from_video_mode(dcam,selected_mode, &uwidth, &uheight);
     if (DC1394_TRUE == dc1394_capture_is_frame_corrupt(dcam, frame))
     {
         IDMessage(getDeviceName(), "Corrupt frame!");
-    	IDMessage(getDeviceName(), "Size of corrupt frame: (%ld,%ld)", uwidth, uheight);
+    	IDMessage(getDeviceName(), "Size of corrupt frame: (%ld,%ld)", frame->size[0], frame->size[1]);
+        PrimaryCCD.setExposureFailed();
         return ;
     }
 
-    //Test8
-    //memcpy(image,frame->image,height*width*2);
-    memcpy(image,frame->image,height*width);
-
-    // release buffer
-    dc1394_capture_enqueue(dcam, frame);
-
-    dc1394_video_set_transmission(dcam,DC1394_OFF);
-
-    IDMessage(getDeviceName(), "Download complete.");
-    gettimeofday(&end, NULL);
-    IDMessage(getDeviceName(), "Download took %.2f s", (float)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec))/ 1000000);
+    /* The DMA buffer is copied into the frame buffer exactly once. Every byte
+     * of the frame is overwritten, so there is no need to clear it first. */
+    clock_gettime(CLOCK_MONOTONIC, &copyStart);
+    moved = convertFrame(frame, image);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    DEBUG(INDI::Logger::DBG_DEBUG, "Download complete.");
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Download took %.3f s", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    copyTime = (end.tv_sec - copyStart.tv_sec) + (end.tv_nsec - copyStart.tv_nsec) / 1e9;
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Frame handoff copied %lu bytes in %.0f ns (%.0f MB/s)", (unsigned long)moved, copyTime * 1e9,
+           copyTime > 0 ? moved / copyTime / 1e6 : 0);
+
+    calibrateFrame();
+    if (PrimaryCCD.getFrameType() == INDI::CCDChip::LIGHT_FRAME)
+        correctHotPixels(image, PrimaryCCD.getBPP());
+    publishFrameStatistics(image, PrimaryCCD.getBPP());
+    if (PrimaryCCD.getFrameType() == INDI::CCDChip::LIGHT_FRAME)
+        findStars(image, PrimaryCCD.getBPP());
+    publishFrameTiming();
 
     // Let INDI::CCD know we're done filling the image buffer
     ExposureComplete(&PrimaryCCD);
 }
 
-bool DC1394_PGREY::StartExposure(float duration)
+void DC1394_PGREY::stackFrame(dc1394video_frame_t * frame)
 {
+    uint32_t * acc = (uint32_t *)PrimaryCCD.getFrameBuffer();
+    uint32_t w = frame->size[0];
+    uint32_t h = frame->size[1];
+    uint32_t row;
+    bool last;
 
-    dc1394error_t err;
-    float fval, temp;
-    dc1394video_frame_t * frame;
-
-    ExposureRequest = duration;
-
-    // Since we have only have one CCD with one chip, we set the exposure duration of the primary CCD
-    //Test8
-    //PrimaryCCD.setBPP(16);
-    PrimaryCCD.setBPP(8);
-    PrimaryCCD.setExposureDuration(duration);
-
-    gettimeofday(&ExpStart,NULL);
+    // A lost sub-exposure is taken again, the stack has to add up to the requested time
+    if (DC1394_TRUE == dc1394_capture_is_frame_corrupt(dcam, frame))
+    {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Corrupt sub-exposure %u of %u, taking it again", stackDone + 1, stackTotal);
+        if (triggerMode == TRIGGER_SOFTWARE)
+            dc1394_software_trigger_set_power(dcam, DC1394_ON);
+        return;
+    }
 
-    InExposure = true;
+    if (stackDone == 0)
+        stackStart = frameTiming.start;
+    last = ++stackDone == stackTotal;
 
-    IDMessage(getDeviceName(), "Triggering a %f second exposure ",duration);
+    /* Get the next sub-exposure going before summing this one. Free running,
+     * transmission is simply left on until the last one is in. */
+    if (!last && triggerMode == TRIGGER_SOFTWARE)
+        dc1394_software_trigger_set_power(dcam, DC1394_ON);
+    if (last && triggerMode == TRIGGER_FREE_RUN)
+        dc1394_video_set_transmission(dcam, DC1394_OFF);
 
-    err = dc1394_feature_set_absolute_value(dcam, DC1394_FEATURE_SHUTTER, duration);
-    if (err != DC1394_SUCCESS)
+    if (binning > 1 && !hardwareBin[binning])
     {
-        IDMessage(getDeviceName(), "Unable to set shutter value.");
+        // Bin first, that shrinks what has to be added by the binning area
+        stackScratch.resize((size_t)(w / binning) * (h / binning) * 2);
+        convertFrame(frame, &stackScratch[0]);
+        stackAdd16(acc, &stackScratch[0], stackScratch.size() / 2, false);
     }
-    err = dc1394_feature_get_absolute_value(dcam, DC1394_FEATURE_SHUTTER, &fval);
-    if (err != DC1394_SUCCESS)
+    else
     {
-        IDMessage(getDeviceName(), "Unable to get shutter value.");
+        // Straight from the DMA buffer, no intermediate copy
+        for (row = 0; row < h; row++)
+        {
+            const uint8_t * src = frame->image + (size_t)row * frame->stride;
+            if (bitsPerPixel == 16)
+                stackAdd16(acc + (size_t)row * w, src, w, !frame->little_endian);
+            else
+                stackAdd8(acc + (size_t)row * w, src, w);
+        }
     }
-    IDMessage(getDeviceName(), "Set shutter value to %f.", fval);
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Sub-exposure %u of %u stacked", stackDone, stackTotal);
 
+    if (!last)
+        return;
 
-    // Flush the DMA buffer
-    while (1)
-    {
-        err=dc1394_capture_dequeue(dcam, DC1394_CAPTURE_POLICY_POLL, &frame);
-        if (err != DC1394_SUCCESS)
+    InExposure = false;
+    downloading = false;
+
+    // The stack runs from the start of the first sub-exposure to the end of the last
+    frameTiming.mid = (stackStart + frameTiming.start + shutterValue) / 2;
+    frameTiming.start = stackStart;
+    publishFrameTiming();
+
+    DEBUGF(INDI::Logger::DBG_SESSION, "Stack of %u sub-exposures complete.", stackTotal);
+    calibrateFrame();
+    if (PrimaryCCD.getFrameType() == INDI::CCDChip::LIGHT_FRAME)
+        correctHotPixels(PrimaryCCD.getFrameBuffer(), 32);
+    ExposureComplete(&PrimaryCCD);
+}
+
+void DC1394_PGREY::buildFrame(dc1394video_frame_t * frame)
+{
+    size_t n = (size_t)(PrimaryCCD.getSubW() / PrimaryCCD.getBinX()) * (PrimaryCCD.getSubH() / PrimaryCCD.getBinY());
+    uint16_t * slot;
+    bool last;
+
+    if (DC1394_TRUE == dc1394_capture_is_frame_corrupt(dcam, frame))
+    {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Corrupt frame %u of %u, taking it again", buildDone + 1, buildTotal);
+        if (triggerMode == TRIGGER_SOFTWARE)
+            dc1394_software_trigger_set_power(dcam, DC1394_ON);
+        return;
+    }
+
+    last = ++buildDone == buildTotal;
+    if (!last && triggerMode == TRIGGER_SOFTWARE)
+        dc1394_software_trigger_set_power(dcam, DC1394_ON);
+    if (last && triggerMode == TRIGGER_FREE_RUN)
+        dc1394_video_set_transmission(dcam, DC1394_OFF);
+
+    // Frames are kept at 16 bits whatever the readout, that is what the combine works on
+    slot = &buildFrames[(buildDone - 1) * n];
+    if (outputBPP() == 16)
+    {
+        convertFrame(frame, (uint8_t *)slot);
+    }
+    else
+    {
+        stackScratch.resize(n);
+        convertFrame(frame, &stackScratch[0]);
+        std::copy(stackScratch.begin(), stackScratch.begin() + n, slot);
+    }
+    DEBUGF(INDI::Logger::DBG_SESSION, "Master frame %u of %u captured.", buildDone, buildTotal);
+
+    if (!last)
+        return;
+
+    InExposure = false;
+    downloading = false;
+    publishFrameTiming();
+
+    recordMaster();
+    std::vector<uint16_t>().swap(buildFrames);
+    ExposureComplete(&PrimaryCCD);
+}
+
+void DC1394_PGREY::correctHotPixels(uint8_t * image, uint8_t bpp)
+{
+    uint32_t bin = PrimaryCCD.getBinX();
+
+    if (HotPixelS[HOT_PIXELS_CORRECT].s != ISS_ON || hotPixels.size() == 0)
+        return;
+
+    // Only rebuilt when the subframe or binning has changed
+    hotPixels.prepare(bin, PrimaryCCD.getSubX() / bin, PrimaryCCD.getSubY() / bin, PrimaryCCD.getSubW() / bin,
+                      PrimaryCCD.getSubH() / bin);
+    switch (bpp)
+    {
+        case 8:
+            hotPixels.correct(image);
+            break;
+        case 16:
+            hotPixels.correct((uint16_t *)image);
+            break;
+        default:
+            hotPixels.correct((uint32_t *)image);
+            break;
+    }
+}
+
+uint32_t DC1394_PGREY::saturationLevel(uint8_t bpp)
+{
+    if (bpp == 8)
+        return 255;
+    // Software binned 8-bit frames hold sums, 16-bit readout has the 12-bit samples in the top bits
+    if (bitsPerPixel == 8)
+        return 255 * binning * binning;
+    return SATURATION_16;
+}
+
+void DC1394_PGREY::findStars(const uint8_t * image, uint8_t bpp)
+{
+    StarDetectParams params;
+    StarField field;
+    struct timespec start, end;
+    std::vector<double> hfr;
+    const Star * guide = NULL;
+
+    if (StarDetectionS[STARS_ON].s != ISS_ON || bpp > 16)
+        return;
+
+    params.sigma = StarSettingsN[STARS_SIGMA].value;
+    params.minArea = StarSettingsN[STARS_MIN_AREA].value;
+    params.saturation = saturationLevel(bpp);
+    params.maxStars = 50;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    detectStars(image, bpp, PrimaryCCD.getSubW() / PrimaryCCD.getBinX(), PrimaryCCD.getSubH() / PrimaryCCD.getBinY(), params, field);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Focus on the median HFR of the unsaturated stars, guide on the brightest of them
+    for (size_t i = 0; i < field.stars.size(); i++)
+    {
+        if (field.stars[i].saturated)
+            continue;
+        if (!guide)
+            guide = &field.stars[i];
+        hfr.push_back(field.stars[i].hfr);
+    }
+    std::sort(hfr.begin(), hfr.end());
+
+    StarFieldN[FIELD_COUNT].value = field.stars.size();
+    StarFieldN[FIELD_HFR].value = hfr.empty() ? 0 : hfr[hfr.size() / 2];
+    StarFieldN[FIELD_BACKGROUND].value = field.background;
+    StarFieldN[FIELD_NOISE].value = field.noise;
+    StarFieldNP.s = hfr.empty() ? IPS_ALERT : IPS_OK;
+    IDSetNumber(&StarFieldNP, NULL);
+
+    if (guide)
+    {
+        GuideStarN[GUIDE_X].value = guide->x;
+        GuideStarN[GUIDE_Y].value = guide->y;
+        GuideStarN[GUIDE_FLUX].value = guide->flux;
+        GuideStarN[GUIDE_HFR].value = guide->hfr;
+        GuideStarN[GUIDE_SNR].value = guide->snr;
+        GuideStarNP.s = IPS_OK;
+    }
+    else
+    {
+        GuideStarNP.s = IPS_ALERT;
+    }
+    IDSetNumber(&GuideStarNP, NULL);
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Found %u stars in %.3f ms", (unsigned int)field.stars.size(),
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+void DC1394_PGREY::resetLucky()
+{
+    luckyScores.clear();
+    luckyNext = 0;
+    luckyScored = 0;
+    luckyPassed = 0;
+    luckyPublished.tv_sec = 0;
+    luckyPublished.tv_nsec = 0;
+}
+
+bool DC1394_PGREY::luckyFrame(const uint8_t * image, uint8_t bpp)
+{
+    uint32_t w = PrimaryCCD.getSubW() / PrimaryCCD.getBinX(), h = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
+    uint32_t window = LuckySettingsN[LUCKY_WINDOW].value;
+    float score, threshold = 0;
+    bool pass;
+    struct timespec now;
+
+    if (LuckyS[LUCKY_ON].s != ISS_ON || bpp > 16)
+        return true;
+
+    // 16-bit readout has the 12-bit samples in the top bits, software binned 8-bit frames fit 12 bits as they are
+    if (bpp == 8)
+        score = laplacianVariance8(image, w, h);
+    else
+        score = laplacianVariance16((const uint16_t *)image, w, h, bitsPerPixel == 8 ? 0 : 4);
+
+    /* Judge against the frames before this one: passing takes a score in the
+     * best KEEP percent of the window. Until the window has a few scores
+     * there is nothing to judge by and everything goes through. */
+    pass = luckyScores.size() < LUCKY_MIN_SCORES;
+    if (!pass)
+    {
+        size_t rank = (size_t)(luckyScores.size() * (1 - LuckySettingsN[LUCKY_KEEP].value / 100));
+        luckyScratch = luckyScores;
+        rank = std::min(rank, luckyScratch.size() - 1);
+        std::nth_element(luckyScratch.begin(), luckyScratch.begin() + rank, luckyScratch.end());
+        threshold = luckyScratch[rank];
+        pass = score >= threshold;
+    }
+
+    if (luckyScores.size() < window)
+        luckyScores.push_back(score);
+    else
+        luckyScores[luckyNext] = score;
+    luckyNext = (luckyNext + 1) % window;
+    luckyScored++;
+    if (pass)
+        luckyPassed++;
+
+    // Once a second is plenty for a client to follow
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != luckyPublished.tv_sec)
+    {
+        luckyPublished = now;
+        LuckyStatsN[LUCKY_SCORE].value = score;
+        LuckyStatsN[LUCKY_THRESHOLD].value = threshold;
+        LuckyStatsN[LUCKY_SCORED].value = luckyScored;
+        LuckyStatsN[LUCKY_PASSED].value = luckyPassed;
+        LuckyStatsNP.s = IPS_OK;
+        IDSetNumber(&LuckyStatsNP, NULL);
+    }
+
+    return pass;
+}
+
+bool DC1394_PGREY::startEvents()
+{
+    uint32_t w = PrimaryCCD.getSubW() / PrimaryCCD.getBinX(), h = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
+
+    if (!events.start(w, h, outputBPP(), (size_t)EventSettingsN[EVENT_BUFFER].value << 20, EventDirT[0].text))
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Event capture buffer is too small for two frames.");
+        return false;
+    }
+    DEBUGF(INDI::Logger::DBG_SESSION, "Event capture holds the last %u frames.", events.capacity());
+    return true;
+}
+
+void DC1394_PGREY::reportEvents()
+{
+    std::string path;
+    uint32_t frames;
+
+    while (events.finished(path, frames))
+    {
+        if (frames)
+        {
+            eventCount++;
+            DEBUGF(INDI::Logger::DBG_SESSION, "Saved %u event frames to %s", frames, path.c_str());
+        }
+        else
+        {
+            DEBUGF(INDI::Logger::DBG_ERROR, "Could not save event frames to %s", path.c_str());
+        }
+    }
+}
+
+double DC1394_PGREY::streamFrameTime()
+{
+    struct timeval wall;
+
+    if (frameTiming.valid)
+        return frameTiming.mid;
+    gettimeofday(&wall, NULL);
+    return wall.tv_sec + wall.tv_usec / 1e6;
+}
+
+void DC1394_PGREY::captureEvent(const uint8_t * image, uint8_t bpp)
+{
+    struct timespec now;
+    double time, change;
+
+    if (!events.running() || bpp > 16)
+        return;
+
+    time = streamFrameTime();
+    change = events.push(image, time);
+    if (EventSettingsN[EVENT_SIGMA].value > 0 && change >= EventSettingsN[EVENT_SIGMA].value)
+    {
+        if (!events.recording())
+            DEBUGF(INDI::Logger::DBG_SESSION, "Event triggered by a %.1f sigma change.", change);
+        events.trigger(time, EventSettingsN[EVENT_PRE].value, EventSettingsN[EVENT_POST].value);
+    }
+    reportEvents();
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != eventPublished.tv_sec)
+    {
+        eventPublished = now;
+        EventStatusN[EVENT_BUFFERED].value = events.buffered();
+        EventStatusN[EVENT_CHANGE].value = change;
+        EventStatusN[EVENT_SAVED].value = eventCount;
+        EventStatusN[EVENT_DROPPED].value = events.dropped;
+        EventStatusNP.s = events.dropped ? IPS_ALERT : events.recording() ? IPS_BUSY : IPS_OK;
+        IDSetNumber(&EventStatusNP, NULL);
+    }
+}
+
+bool DC1394_PGREY::openShm()
+{
+    std::string name = std::string("/indi_pgrey_") + getDeviceName();
+    size_t i;
+
+    // Device names have spaces, shared memory names are kept to a portable set
+    for (i = 1; i < name.size(); i++)
+        if (!isalnum((unsigned char)name[i]))
+            name[i] = '_';
+
+    // Room for a full frame stack, the widest thing an exposure produces
+    if (!frameShm.open(name, ShmSettingsN[0].value, (size_t)PrimaryCCD.getXRes() * PrimaryCCD.getYRes() * 4))
+    {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Could not create shared memory %s: %s", name.c_str(), strerror(errno));
+        return false;
+    }
+    DEBUGF(INDI::Logger::DBG_SESSION, "Exposures go to shared memory %s, %u frames kept.", name.c_str(), frameShm.slotCount());
+    return true;
+}
+
+bool DC1394_PGREY::publishShm()
+{
+    FrameShmInfo info = FrameShmInfo();
+    uint32_t bin = PrimaryCCD.getBinX();
+    uint64_t frame;
+    int len;
+
+    info.time = streamFrameTime();
+    info.exposure = PrimaryCCD.getExposureDuration();
+    info.width = PrimaryCCD.getSubW() / bin;
+    info.height = PrimaryCCD.getSubH() / bin;
+    info.bpp = PrimaryCCD.getBPP();
+    info.bytes = info.width * info.height * (info.bpp / 8);
+    info.x = PrimaryCCD.getSubX() / bin;
+    info.y = PrimaryCCD.getSubY() / bin;
+    info.binning = bin;
+
+    frame = frameShm.publish(info, PrimaryCCD.getFrameBuffer());
+    if (frame == 0)
+    {
+        DEBUG(INDI::Logger::DBG_WARNING, "Frame does not fit shared memory, sending it the usual way.");
+        return false;
+    }
+
+    len = snprintf(shmDescriptor, sizeof(shmDescriptor),
+                   "name=%s frame=%llu offset=%llu width=%u height=%u bpp=%u bytes=%u time=%.6f exposure=%g\n",
+                   frameShm.name().c_str(), (unsigned long long)frame, (unsigned long long)frameShm.offset(frame), info.width,
+                   info.height, info.bpp, info.bytes, info.time, info.exposure);
+    ShmFrameB.blob = shmDescriptor;
+    ShmFrameB.bloblen = ShmFrameB.size = len;
+    ShmFrameBP.s = IPS_OK;
+    IDSetBLOB(&ShmFrameBP, NULL);
+    return true;
+}
+
+bool DC1394_PGREY::ExposureComplete(INDI::CCDChip * targetChip)
+{
+    if (targetChip != &PrimaryCCD)
+        return INDI::CCD::ExposureComplete(targetChip);
+
+    // Clients read the frame from shared memory
+    if (frameShm.isOpen() && publishShm())
+        return completeLocally(targetChip);
+
+    // The exposure is over as far as clients are concerned, the file follows when it is compressed
+    if (compressor.running() && (UploadS[0].s == ISS_ON || UploadS[2].s == ISS_ON) && compressFrame())
+        return completeLocally(targetChip);
+
+    return INDI::CCD::ExposureComplete(targetChip);
+}
+
+/* Ends the exposure without uploading the frame to clients, they get it
+ * some other way. Saving it on the driver's side still goes ahead. */
+bool DC1394_PGREY::completeLocally(INDI::CCDChip * targetChip)
+{
+    ISState upload[3];
+    bool local, rc;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        upload[i] = UploadS[i].s;
+    local = upload[1] == ISS_ON || upload[2] == ISS_ON;
+    IUResetSwitch(&UploadSP);
+    UploadS[1].s = local ? ISS_ON : ISS_OFF;
+
+    rc = INDI::CCD::ExposureComplete(targetChip);
+
+    for (i = 0; i < 3; i++)
+        UploadS[i].s = upload[i];
+    return rc;
+}
+
+// Written the way INDI::CCD writes them into its own files
+static void writeFITSKeywords(fitsfile * fptr, const std::vector<INDI::FITSRecord> &keywords)
+{
+    size_t i;
+
+    for (i = 0; i < keywords.size(); i++)
+    {
+        const INDI::FITSRecord &keyword = keywords[i];
+        int status = 0;
+
+        switch (keyword.type())
+        {
+            case INDI::FITSRecord::VOID:
+                break;
+            case INDI::FITSRecord::COMMENT:
+                fits_write_comment(fptr, keyword.comment().c_str(), &status);
+                break;
+            case INDI::FITSRecord::STRING:
+                fits_update_key_str(fptr, keyword.key().c_str(), keyword.valueString().c_str(), keyword.comment().c_str(), &status);
+                break;
+            case INDI::FITSRecord::LONGLONG:
+                fits_update_key_lng(fptr, keyword.key().c_str(), keyword.valueInt(), keyword.comment().c_str(), &status);
+                break;
+            case INDI::FITSRecord::DOUBLE:
+                fits_update_key_dbl(fptr, keyword.key().c_str(), keyword.valueDouble(), keyword.decimal(),
+                                    keyword.comment().c_str(), &status);
+                break;
+        }
+    }
+}
+
+bool DC1394_PGREY::startCompression()
+{
+    if (!compressor.start(CompressionSettingsN[0].value))
+    {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Could not start compression: %s", strerror(errno));
+        return false;
+    }
+    compressCallbackID = IEAddCallback(compressor.notifyFd(), compressCallbackHelper, this);
+    DEBUGF(INDI::Logger::DBG_SESSION, "Frames for clients are tile compressed on %u threads.", compressor.threadCount());
+    return true;
+}
+
+void DC1394_PGREY::stopCompression()
+{
+    if (compressCallbackID >= 0)
+    {
+        IERmCallback(compressCallbackID);
+        compressCallbackID = -1;
+    }
+    compressor.stop();
+}
+
+bool DC1394_PGREY::compressFrame()
+{
+    std::vector<INDI::FITSRecord> keywords;
+    uint32_t bin = PrimaryCCD.getBinX();
+    int method = CompressionS[COMPRESSION_RICE].s == ISS_ON ? FITS_RICE : FITS_GZIP;
+
+    // Already compressed tiles gain nothing from INDI deflating the whole file again
+    if (PrimaryCCD.isCompressed())
+        return false;
+
+    // Taken now, the frame settings may have changed by the time the file is written
+    addFITSKeywords(&PrimaryCCD, keywords);
+    if (compressor.submit(PrimaryCCD.getFrameBuffer(), PrimaryCCD.getSubW() / bin, PrimaryCCD.getSubH() / bin, PrimaryCCD.getBPP(),
+                          method, [keywords](fitsfile * fptr, int *) { writeFITSKeywords(fptr, keywords); }))
+        return true;
+
+    DEBUG(INDI::Logger::DBG_WARNING, "Compression is falling behind, sending this frame uncompressed.");
+    return false;
+}
+
+void DC1394_PGREY::sendCompressed()
+{
+    FitsCompressed result;
+
+    while (compressor.finished(result))
+    {
+        if (result.data == NULL)
+        {
+            DEBUG(INDI::Logger::DBG_ERROR, "Compressing a frame failed, it could not be sent.");
+            CompressionStatusNP.s = IPS_ALERT;
+            IDSetNumber(&CompressionStatusNP, NULL);
+            continue;
+        }
+
+        uploadFile(&PrimaryCCD, result.data, result.size, true, false);
+        free(result.data);
+
+        CompressionStatusN[COMPRESSION_RATIO].value = (double)result.rawBytes / result.size;
+        CompressionStatusN[COMPRESSION_TIME].value = result.seconds;
+        CompressionStatusNP.s = IPS_OK;
+        IDSetNumber(&CompressionStatusNP, NULL);
+        DEBUGF(INDI::Logger::DBG_DEBUG, "Frame compressed %.2f times in %.3f s", CompressionStatusN[COMPRESSION_RATIO].value,
+               result.seconds);
+    }
+}
+
+bool DC1394_PGREY::startSer()
+{
+    uint32_t w = PrimaryCCD.getSubW() / PrimaryCCD.getBinX(), h = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
+    struct timeval now;
+    struct tm tm;
+    char name[64];
+    std::string path;
+
+    gettimeofday(&now, NULL);
+    gmtime_r(&now.tv_sec, &tm);
+    strftime(name, sizeof(name), "/%Y%m%dT%H%M%S.ser", &tm);
+    path = std::string(SerDirT[0].text) + name;
+
+    if (!ser.start(path, w, h, outputBPP(), (size_t)SerSettingsN[0].value << 20, SerDirectS[SER_ON].s == ISS_ON))
+    {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Could not create %s", path.c_str());
+        return false;
+    }
+    serReportedBehind = 0;
+    DEBUGF(INDI::Logger::DBG_SESSION, "Recording to %s%s", path.c_str(),
+           SerDirectS[SER_ON].s == ISS_ON && !ser.directIO ? ", without direct I/O, which the filesystem refused" : "");
+    return true;
+}
+
+void DC1394_PGREY::stopSer()
+{
+    bool ok = ser.stop();
+
+    publishSer();
+    if (ok)
+        DEBUGF(INDI::Logger::DBG_SESSION, "Recorded %u frames to %s", ser.frames, ser.name().c_str());
+    else
+        DEBUGF(INDI::Logger::DBG_ERROR, "Recording to %s failed after %u frames", ser.name().c_str(), ser.frames);
+    if (ser.behind)
+        DEBUGF(INDI::Logger::DBG_WARNING, "%u frames were not recorded because the disk could not keep up.", ser.behind);
+}
+
+void DC1394_PGREY::publishSer()
+{
+    SerStatusN[SER_FRAMES].value = ser.frames;
+    SerStatusN[SER_SIZE].value = ser.written() / 1048576.0;
+    SerStatusN[SER_BACKLOG].value = ser.backlog() * 100;
+    SerStatusN[SER_BEHIND].value = ser.behind;
+    SerStatusNP.s = ser.behind ? IPS_ALERT : ser.running() ? IPS_BUSY : IPS_OK;
+    IDSetNumber(&SerStatusNP, NULL);
+}
+
+void DC1394_PGREY::recordFrame(const uint8_t * image)
+{
+    struct timespec now;
+
+    if (!ser.running())
+        return;
+
+    ser.push(image, streamFrameTime());
+
+    // Back-pressure is reported as it happens, at most once a second
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec == serPublished.tv_sec)
+        return;
+    serPublished = now;
+    publishSer();
+
+    if (ser.behind != serReportedBehind)
+    {
+        DEBUGF(INDI::Logger::DBG_WARNING, "SER writer is behind the stream, %u frames not recorded so far.", ser.behind);
+        serReportedBehind = ser.behind;
+    }
+    if (ser.failed)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Writing the SER file failed, the disk is full or failing.");
+        stopSer();
+        IUResetSwitch(&SerSP);
+        SerS[SER_OFF].s = ISS_ON;
+        SerSP.s = IPS_ALERT;
+        IDSetSwitch(&SerSP, NULL);
+    }
+}
+
+bool DC1394_PGREY::measureFrame(const uint8_t * image, uint8_t bpp)
+{
+    size_t n = (size_t)(PrimaryCCD.getSubW() / PrimaryCCD.getBinX()) * (PrimaryCCD.getSubH() / PrimaryCCD.getBinY());
+    uint32_t shift = 0, saturation;
+    struct timespec start, end;
+    FrameStats stats;
+    uint64_t below = 0, saturated = 0;
+    double mean;
+    size_t bins, b;
+    int p = STATS_P01;
+
+    if (n == 0 || bpp > 16)
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    saturation = saturationLevel(bpp);
+    if (bpp == 8)
+    {
+        bins = 256;
+        histogram.resize(bins);
+        frameStats8(image, n, &histogram[0], stats);
+    }
+    else
+    {
+        // Software binned 8-bit sums stay below 4096, 12-bit samples sit in the top bits
+        if (bitsPerPixel != 8)
+            shift = 4;
+        bins = (bitsPerPixel == 8 ? 4096 : 65536) >> shift;
+        histogram.resize(65536 >> shift);
+        frameStats16((const uint16_t *)image, n, shift, &histogram[0], stats);
+    }
+
+    // Percentiles to the resolution of a histogram bin
+    const double fractions[] = { 0.01, 0.5, 0.99 };
+    for (b = 0; b < bins && p <= STATS_P99; b++)
+    {
+        below += histogram[b];
+        while (p <= STATS_P99 && below > fractions[p - STATS_P01] * n)
+            StatisticsN[p++].value = b << shift;
+    }
+    for (b = saturation >> shift; b < histogram.size(); b++)
+        saturated += histogram[b];
+    for (b = 0; b < 32; b++)
+        HistogramN[b].value = 0;
+    for (b = 0; b < bins; b++)
+        HistogramN[b * 32 / bins].value += histogram[b];
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    mean = (double)stats.sum / n;
+    StatisticsN[STATS_MIN].value = stats.min;
+    StatisticsN[STATS_MAX].value = stats.max;
+    StatisticsN[STATS_MEAN].value = mean;
+    StatisticsN[STATS_STDDEV].value = sqrt(std::max(0.0, (double)stats.sumSquares / n - mean * mean));
+    StatisticsN[STATS_SATURATED].value = saturated;
+    StatisticsN[STATS_SATURATED_PCT].value = 100.0 * saturated / n;
+    StatisticsNP.s = saturated ? IPS_ALERT : IPS_OK;
+    fullScale = saturation;
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Frame statistics took %.3f ms", (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return true;
+}
+
+void DC1394_PGREY::publishFrameStatistics(const uint8_t * image, uint8_t bpp)
+{
+    if (!measureFrame(image, bpp))
+        return;
+
+    IDSetNumber(&StatisticsNP, NULL);
+    HistogramNP.s = IPS_OK;
+    IDSetNumber(&HistogramNP, NULL);
+
+    // Calibration frames are taken at whatever the client asked for
+    if (PrimaryCCD.getFrameType() == INDI::CCDChip::LIGHT_FRAME || PrimaryCCD.getFrameType() == INDI::CCDChip::FLAT_FRAME)
+        autoExpose();
+}
+
+void DC1394_PGREY::autoExpose()
+{
+    double target, tolerance, median, ratio, light, shutter, gain;
+
+    if (AutoExposureS[AE_OFF].s == ISS_ON)
+        return;
+
+    // Frames already exposing when the settings last changed tell nothing about them
+    if (aeSettle > 0)
+    {
+        aeSettle--;
+        return;
+    }
+
+    target = AutoExposureN[AE_TARGET].value / 100 * fullScale;
+    tolerance = AutoExposureN[AE_TOLERANCE].value / 100 * fullScale;
+    median = std::max(1.0, StatisticsN[STATS_MEDIAN].value);
+    if (aeShutter <= 0)
+        aeShutter = shutterValue;
+    if (fabs(median - target) <= tolerance || aeShutter <= 0)
+    {
+        if (AutoExposureSP.s != IPS_OK)
+        {
+            AutoExposureSP.s = IPS_OK;
+            IDSetSwitch(&AutoExposureSP, NULL);
+        }
+        return;
+    }
+
+    /* The sensor is linear, so the light to collect scales by target / median.
+     * A saturated median says only "too much", so back off in large steps. */
+    ratio = median >= fullScale ? 0.25 : target / median;
+    ratio = std::min(16.0, std::max(1.0 / 16, ratio));
+    gain = SettingsN[0].value;
+    // The gain stays put in shutter-only mode, so only the shutter has to cover the change
+    light = aeShutter * ratio;
+    if (AutoExposureS[AE_SHUTTER_GAIN].s == ISS_ON)
+        light *= pow(10, gain / 20);
+
+    // Shutter first, up to its limit; gain only makes up what the shutter cannot
+    shutter = std::min(light, (double)std::min(AutoExposureN[AE_MAX_SHUTTER].value, (double)shutter_max));
+    shutter = std::max(shutter, (double)shutter_min);
+    if (AutoExposureS[AE_SHUTTER_GAIN].s == ISS_ON)
+        gain = std::min((double)gain_max, std::max((double)gain_min, 20 * log10(light / shutter)));
+
+    // Both registers in one go, and only for a change worth the bus traffic
+    if (fabs(shutter / aeShutter - 1) < 0.02 && fabs(gain - SettingsN[0].value) < 0.1)
+        return;
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Auto exposure: median %.0f, target %.0f, shutter %.4f -> %.4f s, gain %.2f -> %.2f dB", median,
+           target, aeShutter, shutter, SettingsN[0].value, gain);
+    aeShutter = shutter;
+    if (capturing)
+    {
+        // The frame rate may cap the shutter, go on from what the camera actually does
+        if (setShutter(aeShutter))
+            aeShutter = shutterValue;
+        aeSettle = AE_SETTLE_FRAMES;
+    }
+    setGain(gain);
+    if (AutoExposureSP.s != IPS_BUSY)
+    {
+        AutoExposureSP.s = IPS_BUSY;
+        IDSetSwitch(&AutoExposureSP, NULL);
+    }
+}
+
+void DC1394_PGREY::calibrateFrame()
+{
+    uint32_t bin = PrimaryCCD.getBinX();
+    uint32_t x = PrimaryCCD.getSubX() / bin;
+    uint32_t y = PrimaryCCD.getSubY() / bin;
+    uint32_t w = PrimaryCCD.getSubW() / bin;
+    uint32_t h = PrimaryCCD.getSubH() / bin;
+    uint8_t * image = PrimaryCCD.getFrameBuffer();
+    const MasterFrame * dark = NULL;
+    const MasterFrame * flat = NULL;
+    struct timespec start, end;
+    uint32_t row;
+
+    appliedDark.clear();
+    appliedFlat.clear();
+
+    if (PrimaryCCD.getFrameType() != INDI::CCDChip::LIGHT_FRAME)
+    {
+        if (CalibrationS[CALIBRATION_RECORD].s == ISS_ON)
+            recordMaster();
+        return;
+    }
+
+    // A stack is matched against darks of one sub-exposure, scaled up by their number
+    if (CalibrationS[CALIBRATION_DARK].s == ISS_ON)
+        dark = calibration.findDark(outputBPP(), bin, x, y, w, h, SettingsN[0].value, ExposureRequest / stackTotal,
+                                    temperatureCanRead ? TemperatureN[0].value : NAN);
+    if (CalibrationS[CALIBRATION_FLAT].s == ISS_ON)
+        flat = calibration.findFlat(bin, x, y, w, h);
+
+    IUSaveText(&CalibrationT[CALIBRATION_DARK], dark ? dark->describe().c_str() : "none");
+    IUSaveText(&CalibrationT[CALIBRATION_FLAT], flat ? flat->describe().c_str() : "none");
+    CalibrationTP.s = ((CalibrationS[CALIBRATION_DARK].s == ISS_ON && !dark) || (CalibrationS[CALIBRATION_FLAT].s == ISS_ON && !flat)) ?
+                      IPS_ALERT : IPS_OK;
+    IDSetText(&CalibrationTP, NULL);
+
+    if (!dark && !flat)
+        return;
+
+    // One pass over the frame, row by row since masters may cover more than this subframe
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (row = 0; row < h; row++)
+    {
+        const float * d = dark ? dark->at(x, y + row) : NULL;
+        const float * f = flat ? flat->at(x, y + row) : NULL;
+        size_t offset = (size_t)row * w;
+
+        switch (PrimaryCCD.getBPP())
+        {
+            case 8:
+                calibrate8(image + offset, d, f, w);
+                break;
+            case 16:
+                calibrate16((uint16_t *)image + offset, d, f, w);
+                break;
+            default:
+                calibrate32((uint32_t *)image + offset, d, stackTotal, f, w);
+                break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (dark)
+        appliedDark = dark->describe();
+    if (flat)
+        appliedFlat = flat->describe();
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Calibration took %.2f ms", (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+void DC1394_PGREY::learnBadPixels(const MasterKey &key, const float * data)
+{
+    long found = hotPixels.learn(key, data);
+
+    if (found < 0)
+        DEBUGF(INDI::Logger::DBG_WARNING, "Too many outliers in this %s to be bad pixels, hot pixel map left as it was.",
+               key.type == MASTER_DARK ? "dark" : "flat");
+    else
+        DEBUGF(INDI::Logger::DBG_SESSION, "%ld %s pixels in this master, %u bad pixels mapped in total.", found,
+               key.type == MASTER_DARK ? "hot" : "dead", (unsigned int)hotPixels.size());
+}
+
+template <typename T>
+static void pixelsToFloat(const T * px, size_t n, float * out)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = px[i];
+}
+
+void DC1394_PGREY::recordMaster()
+{
+    MasterKey key;
+    const MasterFrame * master;
+    std::string warning;
+    char combine[32];
+    size_t n, i;
+
+    if (PrimaryCCD.getBPP() > 16)
+    {
+        DEBUG(INDI::Logger::DBG_WARNING, "Masters are not recorded from stacked exposures.");
+        return;
+    }
+
+    key.bpp = PrimaryCCD.getBPP();
+    key.bin = PrimaryCCD.getBinX();
+    key.x = PrimaryCCD.getSubX() / key.bin;
+    key.y = PrimaryCCD.getSubY() / key.bin;
+    key.width = PrimaryCCD.getSubW() / key.bin;
+    key.height = PrimaryCCD.getSubH() / key.bin;
+    key.gain = SettingsN[0].value;
+    key.exposure = ExposureRequest;
+    key.temperature = temperatureCanRead ? TemperatureN[0].value : NAN;
+    key.frames = buildTotal;
+    switch (PrimaryCCD.getFrameType())
+    {
+        case INDI::CCDChip::BIAS_FRAME:
+            key.type = MASTER_BIAS;
+            break;
+        case INDI::CCDChip::DARK_FRAME:
+            key.type = MASTER_DARK;
+            break;
+        default:
+            key.type = MASTER_FLAT;
+            break;
+    }
+
+    n = (size_t)key.width * key.height;
+    std::vector<float> data(n);
+    if (buildTotal > 1)
+    {
+        std::vector<const uint16_t *> frames(buildTotal);
+        float kappa = MasterCombineS[COMBINE_SIGMA_CLIP].s == ISS_ON ? MasterN[MASTER_KAPPA].value : 0;
+        float maxValue = key.bpp == 16 ? 65535.0f : 255.0f;
+        struct timespec start, end;
+
+        for (i = 0; i < buildTotal; i++)
+            frames[i] = &buildFrames[i * n];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        combineFrames(frames, n, kappa, &data[0]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        DEBUGF(INDI::Logger::DBG_SESSION, "Combined %u frames in %.2f s.", buildTotal,
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+        if (kappa > 0)
+            snprintf(combine, sizeof(combine), "sigma clip %.1f", kappa);
+        else
+            strcpy(combine, "median");
+
+        // The client gets the combined frame, before a flat is turned into its reciprocal
+        for (i = 0; i < n; i++)
+        {
+            long v = lrintf(std::min(std::max(data[i], 0.0f), maxValue));
+            if (key.bpp == 16)
+                ((uint16_t *)PrimaryCCD.getFrameBuffer())[i] = v;
+            else
+                PrimaryCCD.getFrameBuffer()[i] = v;
+        }
+    }
+    else
+    {
+        strcpy(combine, "single frame");
+        if (key.bpp == 16)
+            pixelsToFloat((const uint16_t *)PrimaryCCD.getFrameBuffer(), n, &data[0]);
+        else
+            pixelsToFloat(PrimaryCCD.getFrameBuffer(), n, &data[0]);
+    }
+
+    if (key.type == MASTER_DARK)
+        learnBadPixels(key, &data[0]);
+
+    if (key.type == MASTER_FLAT)
+    {
+        // Take out the dark (or bias) of the flat's own exposure, then store 1 / normalised flat
+        const MasterFrame * dark = calibration.findDark(key.bpp, key.bin, key.x, key.y, key.width, key.height, key.gain,
+                                   key.exposure, key.temperature);
+        double sum = 0;
+        float mean;
+
+        for (uint32_t row = 0; dark && row < key.height; row++)
+        {
+            const float * d = dark->at(key.x, key.y + row);
+            for (uint32_t col = 0; col < key.width; col++)
+                data[(size_t)row * key.width + col] -= d[col];
+        }
+        learnBadPixels(key, &data[0]);
+        for (i = 0; i < n; i++)
+            sum += data[i];
+        mean = sum / n;
+        if (mean <= 0)
+        {
+            DEBUG(INDI::Logger::DBG_ERROR, "Flat frame has no signal, not recorded.");
+            return;
+        }
+        for (i = 0; i < n; i++)
+            data[i] = data[i] > 0 ? mean / data[i] : 1.0f;
+    }
+
+    master = calibration.store(key, &data[0], combine, warning);
+    if (!warning.empty())
+        DEBUGF(INDI::Logger::DBG_WARNING, "%s", warning.c_str());
+    if (!master)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Could not save calibration master.");
+        return;
+    }
+    DEBUGF(INDI::Logger::DBG_SESSION, "Recorded master %s.", master->describe().c_str());
+}
+
+void DC1394_PGREY::publishFrameTiming()
+{
+    frameTiming.hostOffset = frameTiming.start - (ExpStartWall.tv_sec + ExpStartWall.tv_usec / 1e6);
+    TimingN[TIMING_FRAME_COUNTER].value = frameTiming.frameCounter;
+    TimingN[TIMING_HOST_OFFSET].value = frameTiming.hostOffset * 1000;
+    TimingN[TIMING_CYCLE_SYNC].value = frameTiming.cycleSync ? 1 : 0;
+    TimingNP.s = IPS_OK;
+    IDSetNumber(&TimingNP, NULL);
+}
+
+bool DC1394_PGREY::StartExposure(float duration)
+{
+
+    dc1394error_t err;
+    float temp;
+
+    if (logging)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot expose while the timing log is recording.");
+        return false;
+    }
+
+    // With auto exposure on the client's duration only serves as a starting point
+    if (AutoExposureS[AE_OFF].s != ISS_ON && PrimaryCCD.getFrameType() != INDI::CCDChip::BIAS_FRAME &&
+            PrimaryCCD.getFrameType() != INDI::CCDChip::DARK_FRAME)
+    {
+        if (aeShutter <= 0)
+            aeShutter = duration;
+        duration = aeShutter;
+    }
+
+    ExposureRequest = duration;
+    downloading = false;
+
+    /* The shutter tops out at shutter_max (32 s on the Chameleon), longer
+     * requests are split into equal sub-exposures and stacked */
+    stackTotal = 1;
+    stackDone = 0;
+    if (shutter_max > 0 && duration > shutter_max)
+        stackTotal = (uint32_t)ceil(duration / shutter_max);
+
+    // A master recorded from several frames repeats the exposure and combines them
+    buildTotal = 1;
+    buildDone = 0;
+    if (CalibrationS[CALIBRATION_RECORD].s == ISS_ON && PrimaryCCD.getFrameType() != INDI::CCDChip::LIGHT_FRAME &&
+            MasterN[MASTER_FRAMES].value > 1)
+    {
+        if (stackTotal > 1)
+            DEBUG(INDI::Logger::DBG_WARNING, "Masters are not built from stacked exposures.");
+        else
+            buildTotal = (uint32_t)MasterN[MASTER_FRAMES].value;
+    }
+
+    // Since we have only have one CCD with one chip, we set the exposure duration of the primary CCD
+    PrimaryCCD.setBPP(stackTotal > 1 ? 32 : outputBPP());
+    PrimaryCCD.setExposureDuration(duration);
+
+    InExposure = true;
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Triggering a %f second exposure ",duration);
+
+    setShutter(duration / stackTotal);
+
+
+    // Flush the DMA buffer
+    flushCapture();
+
+
+    if (triggerMode == TRIGGER_FREE_RUN)
+    {
+        DEBUG(INDI::Logger::DBG_DEBUG, "start transmission");
+        err = dc1394_video_set_transmission(dcam, DC1394_ON);
+        if (err != DC1394_SUCCESS)
+        {
+            IDMessage(getDeviceName(), "Unable to start transmission");
+            InExposure = false;
+            return false;
+        }
+    }
+    else if (triggerMode == TRIGGER_SOFTWARE)
+    {
+        // Self-clearing: the camera drops the bit again once the exposure starts
+        err = dc1394_software_trigger_set_power(dcam, DC1394_ON);
+        if (err != DC1394_SUCCESS)
+        {
+            IDMessage(getDeviceName(), "Unable to fire software trigger");
+            InExposure = false;
+            return false;
+        }
+    }
+    else
+    {
+        /* Nobody knows when the external trigger fires, so there is nothing
+         * to count down; just wait for the frame */
+        DEBUG(INDI::Logger::DBG_SESSION, "Waiting for external trigger...");
+        downloading = true;
+    }
+
+    // The sensor starts integrating once frames are flowing
+    clock_gettime(CLOCK_MONOTONIC, &ExpStart);
+    gettimeofday(&ExpStartWall, NULL);
+
+    if (stackTotal > 1)
+    {
+        // Clear the accumulator while the first sub-exposure integrates
+        size_t bytes = (size_t)(PrimaryCCD.getSubW() / PrimaryCCD.getBinX()) * (PrimaryCCD.getSubH() / PrimaryCCD.getBinY()) * 4;
+        if ((size_t)PrimaryCCD.getFrameBufferSize() < bytes)
+            PrimaryCCD.setFrameBufferSize(bytes);
+        memset(PrimaryCCD.getFrameBuffer(), 0, bytes);
+        DEBUGF(INDI::Logger::DBG_SESSION, "Stacking %u sub-exposures of %.3f s.", stackTotal, shutterValue);
+    }
+    if (buildTotal > 1)
+    {
+        buildFrames.resize((size_t)buildTotal * (PrimaryCCD.getSubW() / PrimaryCCD.getBinX()) * (PrimaryCCD.getSubH() / PrimaryCCD.getBinY()));
+        DEBUGF(INDI::Logger::DBG_SESSION, "Building master from %u frames.", buildTotal);
+    }
+
+    // Report progress from now on rather than at the next regular poll
+    RemoveTimer(timerID);
+    timerID = SetTimer(std::min((int)POLLMS, std::max(1, (int)ceil(duration * 1000))));
+    /*
+        if(temperatureCanRead && (temp = GetTemperature()) >= 0) {
+    		TemperatureN[0].value = temp;
+    		IDSetNumber(&TemperatureNP, NULL);
+    	}
+    */
+    // actual grabbing to do in grabImage
+    return true;
+}
+
+uint8_t DC1394_PGREY::outputBPP()
+{
+    // Summing 8-bit pixels needs 16 bits to hold the result
+    if (binning > 1 && !hardwareBin[binning])
+        return 16;
+    return bitsPerPixel;
+}
+
+size_t DC1394_PGREY::convertFrame(dc1394video_frame_t * frame, uint8_t * dst)
+{
+    uint32_t w = frame->size[0];
+    uint32_t h = frame->size[1];
+    uint32_t rowbytes = w * bitsPerPixel / 8;
+    uint32_t row;
+
+    if (binning > 1 && !hardwareBin[binning])
+    {
+        if (bitsPerPixel == 16)
+            binAverage16((uint16_t *)dst, frame->image, w, h, frame->stride, binning, !frame->little_endian);
+        else
+            binSum8((uint16_t *)dst, frame->image, w, h, frame->stride, binning);
+        return (size_t)(w / binning) * (h / binning) * 2;
+    }
+
+    if (bitsPerPixel == 16 && !frame->little_endian)
+    {
+        // Camera sends 16-bit samples big-endian
+        if (frame->stride == rowbytes)
+        {
+            unpackBigEndian16((uint16_t *)dst, frame->image, (size_t)w * h);
+        }
+        else
+        {
+            for (row = 0; row < h; row++)
+                unpackBigEndian16((uint16_t *)(dst + (size_t)row * rowbytes), frame->image + (size_t)row * frame->stride, w);
+        }
+    }
+    else if (frame->stride == rowbytes)
+    {
+        memcpy(dst, frame->image, (size_t)rowbytes * h);
+    }
+    else
+    {
+        for (row = 0; row < h; row++)
+            memcpy(dst + (size_t)row * rowbytes, frame->image + (size_t)row * frame->stride, rowbytes);
+    }
+
+    return (size_t)rowbytes * h;
+}
+
+bool DC1394_PGREY::configureFormat7(dc1394video_mode_t mode, dc1394color_coding_t coding, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    dc1394error_t err;
+    bool streaming = capturing;
+    bool transmitting = capturing || triggerMode != TRIGGER_FREE_RUN;
+    bool applied = true;
+
+    // Format7 registers can only change while the capture ring is down
+    if (transmitting)
+        dc1394_video_set_transmission(dcam, DC1394_OFF);
+    stopCaptureThread();
+    dc1394_capture_stop(dcam);
+
+    err = DC1394_SUCCESS;
+    if (mode != captureMode)
+        err = dc1394_video_set_mode(dcam, mode);
+    if (err == DC1394_SUCCESS)
+        err = dc1394_format7_set_roi(dcam, mode, coding, DC1394_USE_MAX_AVAIL, x, y, w, h);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Could not set format7 region of interest");
+        applied = false;
+        dc1394_video_set_mode(dcam, captureMode);
+        dc1394_format7_set_roi(dcam, captureMode, colorCoding, DC1394_USE_MAX_AVAIL, roiX, roiY, width, height);
+    }
+    else
+    {
+        captureMode = mode;
+        colorCoding = coding;
+        roiX = x;
+        roiY = y;
+        width = w;
+        height = h;
+    }
+    bitsPerPixel = (colorCoding == DC1394_COLOR_CODING_MONO16) ? 16 : 8;
+
+    // The usable packet size range depends on the image size, so renegotiate it
+    applyPacketSize();
+
+    err = dc1394_capture_setup(dcam, DMA_BUFFERS, DC1394_CAPTURE_FLAGS_DEFAULT);
+    if (err != DC1394_SUCCESS || !startCaptureThread())
+    {
+        IDMessage(getDeviceName(), "Unable to restart capture");
+        capturing = false;
+        return false;
+    }
+
+    if (streaming)
+        updateStreamFormat();
+    if (transmitting)
+        dc1394_video_set_transmission(dcam, DC1394_ON);
+
+    return applied;
+}
+
+bool DC1394_PGREY::setColorCoding(dc1394color_coding_t coding)
+{
+    bool applied = configureFormat7(captureMode, coding, roiX, roiY, width, height);
+
+    // Frame buffer size follows the bit depth
+    setupParams();
+
+    return applied;
+}
+
+void DC1394_PGREY::negotiateBusSpeed()
+{
+    dc1394error_t err;
+    dc1394speed_t speed;
+
+    /* Ask for 1394b at S800 and fall back to legacy S400. USB cameras accept
+     * or ignore both and run at whatever the USB link gives them. */
+    err = dc1394_video_set_operation_mode(dcam, DC1394_OPERATION_MODE_1394B);
+    if (err == DC1394_SUCCESS)
+        err = dc1394_video_set_iso_speed(dcam, DC1394_ISO_SPEED_800);
+    if (err != DC1394_SUCCESS)
+    {
+        dc1394_video_set_operation_mode(dcam, DC1394_OPERATION_MODE_LEGACY);
+        dc1394_video_set_iso_speed(dcam, DC1394_ISO_SPEED_400);
+    }
+
+    if (dc1394_video_get_iso_speed(dcam, &speed) == DC1394_SUCCESS)
+        IDMessage(getDeviceName(), "ISO speed: %d Mbps", 100 << speed);
+}
+
+bool DC1394_PGREY::applyPacketSize()
+{
+    dc1394error_t err;
+    uint32_t unit, max, recommended, target, actual;
+
+    err = dc1394_format7_get_packet_parameters(dcam, captureMode, &unit, &max);
+    if (err != DC1394_SUCCESS || !max)
+        return false;
+    if (!unit)
+        unit = 4;
+
+    err = dc1394_format7_get_recommended_packet_size(dcam, captureMode, &recommended);
+    if (err != DC1394_SUCCESS || !recommended)
+        recommended = max;
+
+    /* Largest packet means fewest packets per frame and the highest frame rate.
+     * packetLimit is the ceiling learned from corrupt frames, if any. */
+    target = max;
+    if (packetLimit && packetLimit < target)
+        target = packetLimit;
+    target -= target % unit;
+    if (target < unit)
+        target = unit;
+
+    err = dc1394_format7_set_packet_size(dcam, captureMode, target);
+    if (err != DC1394_SUCCESS)
+        return false;
+    if (dc1394_format7_get_packet_size(dcam, captureMode, &actual) != DC1394_SUCCESS)
+        actual = target;
+
+    packetUnit = unit;
+    packetMax = max;
+    packetSize = actual;
+    corruptFrames = windowFrames = 0;
+    rateBytes = 0;
+    gettimeofday(&rateStart, NULL);
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Packet size %u bytes (max %u, recommended %u, unit %u)", actual, max, recommended, unit);
+
+    BandwidthN[BANDWIDTH_PACKET_SIZE].value = packetSize;
+    BandwidthN[BANDWIDTH_PACKET_MAX].value = packetMax;
+    BandwidthNP.s = IPS_OK;
+    if (isConnected())
+        IDSetNumber(&BandwidthNP, NULL);
+
+    return true;
+}
+
+void DC1394_PGREY::trackBandwidth(dc1394video_frame_t * frame, bool corrupt)
+{
+    struct timeval now;
+    double elapsed;
+    uint32_t step;
+
+    gettimeofday(&now, NULL);
+
+    if (!corrupt)
+        rateBytes += frame->image_bytes;
+
+    elapsed = (now.tv_sec - rateStart.tv_sec) + (now.tv_usec - rateStart.tv_usec) / 1e6;
+    if (elapsed >= 1.0)
+    {
+        BandwidthN[BANDWIDTH_RATE].value = rateBytes / elapsed / 1e6;
+        IDSetNumber(&BandwidthNP, NULL);
+        rateBytes = 0;
+        rateStart = now;
+    }
+
+    if (corrupt)
+        corruptFrames++;
+    if (++windowFrames < CORRUPT_WINDOW && corruptFrames < CORRUPT_LIMIT)
+        return;
+
+    if (corruptFrames >= CORRUPT_LIMIT && packetSize > packetUnit)
+    {
+        /* The bus is not keeping up with this packet size, back off by an
+         * eighth of the maximum and try again. */
+        step = std::max(packetUnit, (packetMax / 8) - (packetMax / 8) % packetUnit);
+        packetLimit = packetSize > step ? packetSize - step : packetUnit;
+        DEBUGF(INDI::Logger::DBG_WARNING, "%d corrupt frames at packet size %u, lowering to %u", corruptFrames, packetSize, packetLimit);
+        retunePending = true;
+    }
+    corruptFrames = windowFrames = 0;
+}
+
+bool DC1394_PGREY::enableEmbeddedInfo()
+{
+    uint32_t val, cycle;
+    uint64_t local;
+
+    embeddedBytes = 0;
+
+    // Only 1394 hosts can read the bus cycle timer the camera stamps frames with
+    cycleTimerAvailable = dc1394_read_cycle_timer(dcam, &cycle, &local) == DC1394_SUCCESS;
+
+    if (dc1394_get_control_register(dcam, PGR_FRAME_INFO, &val) != DC1394_SUCCESS || !(val & FRAME_INFO_PRESENT))
+    {
+        DEBUG(INDI::Logger::DBG_SESSION, "Camera has no embedded image info, frames are timed by the host clock.");
+        return false;
+    }
+
+    val = (val & ~FRAME_INFO_MASK) | FRAME_INFO_TIMESTAMP | FRAME_INFO_GAIN | FRAME_INFO_SHUTTER | FRAME_INFO_COUNTER;
+    if (dc1394_set_control_register(dcam, PGR_FRAME_INFO, val) != DC1394_SUCCESS)
+    {
+        DEBUG(INDI::Logger::DBG_WARNING, "Could not enable embedded image info.");
+        return false;
+    }
+    embeddedBytes = 4 * sizeof(uint32_t);
+
+    DEBUGF(INDI::Logger::DBG_SESSION, "Embedded frame timestamps enabled, %s.",
+           cycleTimerAvailable ? "synchronised through the bus cycle timer" : "host clock used for absolute time");
+    return true;
+}
+
+// Cycle timer layout: 7 bits of seconds, 13 bits of 125 us cycles, 12 bits of 1/3072 cycle
+static double cycleTimeSeconds(uint32_t cycleTime)
+{
+    return (cycleTime >> 25) + ((cycleTime >> 12) & 0x1FFF) / ISO_CYCLES_PER_SECOND + (cycleTime & 0xFFF) / (ISO_CYCLES_PER_SECOND * 3072);
+}
+
+void DC1394_PGREY::timeFrame(dc1394video_frame_t * frame, FrameTiming &t)
+{
+    uint32_t cycle;
+    uint64_t local;
+    uint32_t q[4];
+    int i;
+
+    t.valid = true;
+    t.embedded = false;
+    t.cycleSync = false;
+    t.frameCounter = t.shutterRaw = t.gainRaw = 0;
+    t.hostOffset = 0;
+
+    if (embeddedBytes && frame->image_bytes >= embeddedBytes + frame->stride && frame->size[1] > 1)
+    {
+        for (i = 0; i < 4; i++)
         {
-            IDMessage(getDeviceName(), "Flushing DMA buffer failed!");
-            break;
+            const uint8_t *p = frame->image + 4 * i;
+            q[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
         }
-        if (!frame)
+        t.gainRaw = q[1] & 0xFFF;
+        t.shutterRaw = q[2] & 0xFFF;
+        t.frameCounter = q[3];
+        t.embedded = true;
+
+        // Put back pixels for the ones the camera wrote over, the row below is the best guess
+        memcpy(frame->image, frame->image + frame->stride, embeddedBytes);
+    }
+
+    /* The embedded timestamp is the bus cycle time integration started at.
+     * Reading the cycle timer pairs the current cycle time with the host
+     * clock, and the difference between the two cycle times is how long ago
+     * that was. The seconds field wraps every 128 s, far longer than any
+     * frame sits in the ring. */
+    if (t.embedded && cycleTimerAvailable && dc1394_read_cycle_timer(dcam, &cycle, &local) == DC1394_SUCCESS)
+    {
+        t.start = local / 1e6 - fmod(cycleTimeSeconds(cycle) - cycleTimeSeconds(q[0]) + 128.0, 128.0);
+        t.cycleSync = true;
+    }
+    else
+    {
+        // frame->timestamp is when the last packet arrived; one packet goes per isochronous cycle
+        t.start = frame->timestamp / 1e6 - frame->packets_per_frame / ISO_CYCLES_PER_SECOND - shutterValue;
+    }
+    t.mid = t.start + shutterValue / 2;
+}
+
+void DC1394_PGREY::updateStreamFormat()
+{
+    uint32_t softBin = hardwareBin[binning] ? 1 : binning;
+
+    Streamer->setPixelFormat(INDI_MONO, outputBPP());
+    Streamer->setSize(width / softBin, height / softBin);
+}
+
+void DC1394_PGREY::flushCapture()
+{
+    dc1394video_frame_t * frame;
+
+    // Hand back anything the capture thread has queued but nobody consumed yet
+    while (readyFrames.pop(frame))
+    {
+        releaseFrame(frame);
+    }
+}
+
+bool DC1394_PGREY::StartStreaming()
+{
+    dc1394error_t err;
+
+    if (logging)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot stream while the timing log is recording.");
+        return false;
+    }
+
+    /* In streaming mode the camera free-runs: transmission stays on and every
+     * frame the DMA ring fills is handed to the streamer as it arrives. */
+    ExposureRequest = Streamer->getTargetExposure();
+
+    if (setShutter(ExposureRequest))
+    {
+        DEBUGF(INDI::Logger::DBG_SESSION, "Streaming with shutter value %f.", shutterValue);
+    }
+    // Auto exposure takes over from the stream's exposure
+    aeShutter = 0;
+    aeSettle = 0;
+    resetLucky();
+
+    // Streams free-run whatever the trigger mode, StopStreaming arms the trigger again
+    if (triggerMode != TRIGGER_FREE_RUN)
+        dc1394_external_trigger_set_power(dcam, DC1394_OFF);
+
+    updateStreamFormat();
+
+    if (SerS[SER_ON].s == ISS_ON && !startSer())
+    {
+        IUResetSwitch(&SerSP);
+        SerS[SER_OFF].s = ISS_ON;
+        SerSP.s = IPS_ALERT;
+        IDSetSwitch(&SerSP, NULL);
+    }
+    else if (SerS[SER_ON].s == ISS_ON)
+    {
+        SerSP.s = IPS_BUSY;
+        IDSetSwitch(&SerSP, NULL);
+    }
+
+    if (EventS[EVENTS_ON].s == ISS_ON && !startEvents())
+    {
+        EventS[EVENTS_ON].s = ISS_OFF;
+        EventS[EVENTS_OFF].s = ISS_ON;
+        EventSP.s = IPS_ALERT;
+        IDSetSwitch(&EventSP, NULL);
+    }
+
+    flushCapture();
+
+    err = dc1394_video_set_transmission(dcam, DC1394_ON);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to start transmission");
+        return false;
+    }
+
+    capturing = true;
+
+    return true;
+}
+
+bool DC1394_PGREY::StopStreaming()
+{
+    dc1394error_t err;
+
+    capturing = false;
+
+    err = dc1394_video_set_transmission(dcam, DC1394_OFF);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Unable to stop transmission");
+        return false;
+    }
+
+    flushCapture();
+
+    // Waits for an event still being written
+    events.stop();
+    reportEvents();
+    if (ser.running())
+    {
+        stopSer();
+        SerSP.s = SerS[SER_ON].s == ISS_ON ? IPS_OK : IPS_IDLE;
+        IDSetSwitch(&SerSP, NULL);
+    }
+
+    if (triggerMode != TRIGGER_FREE_RUN)
+    {
+        int mode = triggerMode;
+        triggerMode = TRIGGER_FREE_RUN;
+        return setTriggerMode(mode);
+    }
+
+    return true;
+}
+
+bool DC1394_PGREY::setTriggerMode(int mode)
+{
+    dc1394error_t err;
+
+    if (mode == TRIGGER_FREE_RUN)
+    {
+        dc1394_video_set_transmission(dcam, DC1394_OFF);
+        err = dc1394_external_trigger_set_power(dcam, DC1394_OFF);
+        flushCapture();
+        triggerMode = TRIGGER_FREE_RUN;
+        if (err != DC1394_SUCCESS)
         {
-            break;
+            IDMessage(getDeviceName(), "Unable to disable trigger");
+            return false;
         }
-        err=dc1394_capture_enqueue(dcam, frame);	
-            IDMessage(getDeviceName(), "Enqueued");
+        return true;
+    }
+
+    /* Mode 0: every trigger starts one exposure of the length in the shutter
+     * register, so StartExposure keeps setting the shutter as before */
+    err = dc1394_external_trigger_set_mode(dcam, DC1394_TRIGGER_MODE_0);
+    if (err == DC1394_SUCCESS)
+        err = dc1394_external_trigger_set_source(dcam, mode == TRIGGER_SOFTWARE ? DC1394_TRIGGER_SOURCE_SOFTWARE : DC1394_TRIGGER_SOURCE_0);
+    if (err == DC1394_SUCCESS && mode == TRIGGER_EXTERNAL)
+        err = dc1394_external_trigger_set_polarity(dcam, DC1394_TRIGGER_ACTIVE_HIGH);
+    if (err == DC1394_SUCCESS)
+        err = dc1394_external_trigger_set_power(dcam, DC1394_ON);
+    if (err != DC1394_SUCCESS)
+    {
+        IDMessage(getDeviceName(), "Camera does not accept %s triggering", mode == TRIGGER_SOFTWARE ? "software" : "external");
+        dc1394_external_trigger_set_power(dcam, DC1394_OFF);
+        return false;
     }
 
+    // Anything still in the ring was taken free running
+    flushCapture();
 
-    IDMessage(getDeviceName(), "start transmission");
     err = dc1394_video_set_transmission(dcam, DC1394_ON);
     if (err != DC1394_SUCCESS)
     {
         IDMessage(getDeviceName(), "Unable to start transmission");
+        dc1394_external_trigger_set_power(dcam, DC1394_OFF);
         return false;
     }
-    /*
-        if(temperatureCanRead && (temp = GetTemperature()) >= 0) {
-    		TemperatureN[0].value = temp;
-    		IDSetNumber(&TemperatureNP, NULL);
-    	}
-    */
-    // actual grabbing to do in grabImage
+
+    triggerMode = mode;
+    DEBUGF(INDI::Logger::DBG_SESSION, "%s trigger armed.", mode == TRIGGER_SOFTWARE ? "Software" : "External");
+
+    return true;
+}
+
+bool DC1394_PGREY::startTimingLog()
+{
+    FrameLogHeader header;
+    struct timeval now;
+    struct tm tm;
+    char name[64];
+    std::string path;
+
+    if (InExposure || capturing)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot start the timing log while exposing or streaming.");
+        return false;
+    }
+
+    setShutter(TimingLogN[0].value);
+
+    gettimeofday(&now, NULL);
+    gmtime_r(&now.tv_sec, &tm);
+    strftime(name, sizeof(name), "/timing_%Y%m%dT%H%M%S.pglog", &tm);
+    path = std::string(TimingLogDirT[0].text) + name;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_LOG_MAGIC, sizeof(header.magic));
+    header.width = width;
+    header.height = height;
+    header.bpp = bitsPerPixel;
+    header.bigEndian = bitsPerPixel == 16;
+    header.x = roiX;
+    header.y = roiY;
+    header.frameBytes = width * height * (bitsPerPixel / 8);
+    header.shutter = shutterValue;
+    header.gain = SettingsN[0].value;
+    header.start = now.tv_sec + now.tv_usec / 1e6;
+    if (!frameLog.open(path, header))
+    {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Could not create the timing log %s", path.c_str());
+        return false;
+    }
+
+    // Free running at whatever rate the shutter and packet size allow
+    if (triggerMode != TRIGGER_FREE_RUN)
+        dc1394_external_trigger_set_power(dcam, DC1394_OFF);
+
+    flushCapture();
+    logFailed = false;
+    logDropped = 0;
+    logFirst = true;
+    logPeriod = 0;
+    logRateFrames = 0;
+    clock_gettime(CLOCK_MONOTONIC, &logRateStart);
+    logging = true;
+
+    if (dc1394_video_set_transmission(dcam, DC1394_ON) != DC1394_SUCCESS)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to start transmission");
+        logging = false;
+        frameLog.close();
+        unlink(path.c_str());
+        return false;
+    }
+
+    DEBUGF(INDI::Logger::DBG_SESSION, "Logging %ux%u frames at %.4f s to %s", width, height, shutterValue, path.c_str());
+    return true;
+}
+
+void DC1394_PGREY::stopTimingLog()
+{
+    dc1394_video_set_transmission(dcam, DC1394_OFF);
+    logging = false;
+    flushCapture();
+
+    publishTimingLog();
+    frameLog.close();
+    DEBUGF(INDI::Logger::DBG_SESSION, "Timing log %s closed with %u frames, %u dropped.", frameLog.name().c_str(), frameLog.count(),
+           (unsigned int)logDropped);
+
+    if (triggerMode != TRIGGER_FREE_RUN)
+    {
+        int mode = triggerMode;
+        triggerMode = TRIGGER_FREE_RUN;
+        setTriggerMode(mode);
+    }
+}
+
+void DC1394_PGREY::publishTimingLog()
+{
+    struct timespec now;
+    uint32_t frames = frameLog.count();
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - logRateStart.tv_sec) + (now.tv_nsec - logRateStart.tv_nsec) / 1e9;
+    if (elapsed >= 1)
+    {
+        TimingLogStatusN[TIMING_LOG_RATE].value = (frames - logRateFrames) / elapsed;
+        logRateFrames = frames;
+        logRateStart = now;
+    }
+    TimingLogStatusN[TIMING_LOG_FRAMES].value = frames;
+    TimingLogStatusN[TIMING_LOG_DROPPED].value = logDropped;
+    TimingLogStatusN[TIMING_LOG_SIZE].value = frameLog.size() / 1048576.0;
+    TimingLogStatusNP.s = logDropped ? IPS_ALERT : IPS_OK;
+    IDSetNumber(&TimingLogStatusNP, NULL);
+
+    if (logging && logFailed)
+    {
+        DEBUG(INDI::Logger::DBG_ERROR, "Timing log stopped, the disk is full or failing.");
+        stopTimingLog();
+        IUResetSwitch(&TimingLogSP);
+        TimingLogS[TIMING_LOG_OFF].s = ISS_ON;
+        TimingLogSP.s = IPS_ALERT;
+        IDSetSwitch(&TimingLogSP, NULL);
+    }
+}
+
+// Runs on the capture thread
+void DC1394_PGREY::logFrame(dc1394video_frame_t * frame)
+{
+    FrameTiming t;
+    FrameLogRecord record;
+    double interval;
+
+    /* Corrupt frames are left out without counting them here: they leave a
+     * gap in the frame counter or the arrival times, which counts them */
+    if (DC1394_TRUE == dc1394_capture_is_frame_corrupt(dcam, frame) || !height ||
+            frame->image_bytes < (size_t)(height - 1) * frame->stride + width * (bitsPerPixel / 8))
+        return;
+
+    timeFrame(frame, t);
+    memset(&record, 0, sizeof(record));
+    record.start = t.start;
+    record.timestamp = frame->timestamp;
+    record.frameCounter = t.frameCounter;
+    record.flags = t.cycleSync ? FRAME_LOG_CYCLE_SYNC : 0;
+
+    // Without the camera's counter a gap of well over a frame period is all there is to go by
+    if (!logFirst)
+    {
+        if (t.embedded)
+        {
+            record.dropped = t.frameCounter - logLastCounter - 1;
+        }
+        else
+        {
+            interval = frame->timestamp - logLastTimestamp;
+            if (logPeriod > 0 && interval > 1.5 * logPeriod)
+                record.dropped = lround(interval / logPeriod) - 1;
+            else
+                logPeriod = logPeriod > 0 ? 0.9 * logPeriod + 0.1 * interval : interval;
+        }
+    }
+    logFirst = false;
+    logLastCounter = t.frameCounter;
+    logLastTimestamp = frame->timestamp;
+    logDropped += record.dropped;
+
+    if (!frameLog.append(record, frame->image, frame->stride))
+    {
+        logDropped++;
+        logFailed = true;
+    }
+}
+
+bool DC1394_PGREY::startCaptureThread()
+{
+    if (pipe2(notifyPipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        return false;
+    if (pipe2(wakePipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        close(notifyPipe[0]);
+        close(notifyPipe[1]);
+        notifyPipe[0] = notifyPipe[1] = -1;
+        return false;
+    }
+
+    frameCallbackID = IEAddCallback(notifyPipe[0], frameCallbackHelper, this);
+
+    captureQuit = false;
+    captureThread = std::thread(&DC1394_PGREY::captureLoop, this);
+
     return true;
 }
 
+void DC1394_PGREY::stopCaptureThread()
+{
+    dc1394video_frame_t * frame;
+    char c = 0;
+
+    if (!captureThread.joinable())
+        return;
+
+    captureQuit = true;
+    if (write(wakePipe[1], &c, 1) < 0)
+    {
+        // The thread still notices captureQuit on its next poll timeout
+    }
+    captureThread.join();
+
+    /* With the thread gone both queues are ours. Whatever is still in them
+     * points into this capture ring, so it goes back before the caller's
+     * dc1394_capture_stop frees the ring and nothing of it outlives it. */
+    while (readyFrames.pop(frame))
+        dc1394_capture_enqueue(dcam, frame);
+    while (releasedFrames.pop(frame))
+        dc1394_capture_enqueue(dcam, frame);
+
+    if (frameCallbackID >= 0)
+    {
+        IERmCallback(frameCallbackID);
+        frameCallbackID = -1;
+    }
+
+    close(notifyPipe[0]);
+    close(notifyPipe[1]);
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    notifyPipe[0] = notifyPipe[1] = -1;
+    wakePipe[0] = wakePipe[1] = -1;
+}
+
+static void drainPipe(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+void DC1394_PGREY::captureLoop()
+{
+    dc1394error_t err;
+    dc1394video_frame_t * frame;
+    struct pollfd fds[2];
+    char c = 0;
+
+    fds[0].fd = dc1394_capture_get_fileno(dcam);
+    fds[0].events = POLLIN;
+    fds[1].fd = wakePipe[0];
+    fds[1].events = POLLIN;
+
+    while (!captureQuit)
+    {
+        if (poll(fds, 2, 500) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            drainPipe(wakePipe[0]);
+
+        // Give the event loop's finished buffers back to the DMA ring first
+        while (releasedFrames.pop(frame))
+            dc1394_capture_enqueue(dcam, frame);
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        while (1)
+        {
+            err = dc1394_capture_dequeue(dcam, DC1394_CAPTURE_POLICY_POLL, &frame);
+            if (err != DC1394_SUCCESS || !frame)
+                break;
+
+            if (logging)
+            {
+                logFrame(frame);
+                dc1394_capture_enqueue(dcam, frame);
+                continue;
+            }
+
+            // The queue has more slots than the ring has buffers, so this only fails if the ring is misconfigured
+            if (!readyFrames.push(frame))
+            {
+                dc1394_capture_enqueue(dcam, frame);
+                continue;
+            }
+            if (write(notifyPipe[1], &c, 1) < 0)
+            {
+                // Pipe full means a wakeup is already pending
+            }
+        }
+    }
+
+    // Return every buffer we still hold so dc1394_capture_stop can free the ring
+    while (releasedFrames.pop(frame))
+        dc1394_capture_enqueue(dcam, frame);
+}
+
+void DC1394_PGREY::releaseFrame(dc1394video_frame_t * frame)
+{
+    char c = 0;
+
+    releasedFrames.push(frame);
+    if (write(wakePipe[1], &c, 1) < 0)
+    {
+        // Pipe full means a wakeup is already pending
+    }
+}
+
+void DC1394_PGREY::frameCallbackHelper(int fd, void * context)
+{
+    drainPipe(fd);
+    static_cast<DC1394_PGREY *>(context)->processFrames();
+}
+
+void DC1394_PGREY::compressCallbackHelper(int fd, void * context)
+{
+    drainPipe(fd);
+    static_cast<DC1394_PGREY *>(context)->sendCompressed();
+}
+
+void DC1394_PGREY::processFrames()
+{
+    dc1394video_frame_t * frame;
+
+    while (readyFrames.pop(frame))
+    {
+        trackBandwidth(frame, DC1394_TRUE == dc1394_capture_is_frame_corrupt(dcam, frame));
+
+        if (DC1394_TRUE != dc1394_capture_is_frame_corrupt(dcam, frame))
+            timeFrame(frame, frameTiming);
+
+        if (capturing)
+        {
+            if (DC1394_TRUE == dc1394_capture_is_frame_corrupt(dcam, frame))
+            {
+                DEBUG(INDI::Logger::DBG_DEBUG, "Dropping corrupt frame");
+            }
+            else if (outputBPP() == 8 && hardwareBin[binning] && frame->stride == width)
+            {
+                // Already in the streamer's layout, hand the DMA buffer over as-is
+                correctHotPixels(frame->image, 8);
+                if (AutoExposureS[AE_OFF].s != ISS_ON && measureFrame(frame->image, 8))
+                    autoExpose();
+                findStars(frame->image, 8);
+                captureEvent(frame->image, 8);
+                if (luckyFrame(frame->image, 8))
+                {
+                    Streamer->newFrame(frame->image, frame->image_bytes);
+                    recordFrame(frame->image);
+                }
+            }
+            else
+            {
+                uint8_t * image = PrimaryCCD.getFrameBuffer();
+                size_t bytes = convertFrame(frame, image);
+                correctHotPixels(image, outputBPP());
+                if (AutoExposureS[AE_OFF].s != ISS_ON && measureFrame(image, outputBPP()))
+                    autoExpose();
+                findStars(image, outputBPP());
+                captureEvent(image, outputBPP());
+                if (luckyFrame(image, outputBPP()))
+                {
+                    Streamer->newFrame(image, bytes);
+                    recordFrame(image);
+                }
+            }
+        }
+        else if (InExposure)
+        {
+            grabImage(frame);
+        }
+
+        releaseFrame(frame);
+    }
+
+    // Packet size only changes with the ring down, never in the middle of an exposure
+    if (retunePending && !InExposure)
+    {
+        retunePending = false;
+        configureFormat7(captureMode, colorCoding, roiX, roiY, width, height);
+    }
+}
+
 IPState DC1394_PGREY::GuideNorth(float ms)
 {
     INDI_UNUSED(ms);
@@ -23,18 +23,39 @@
 
 #include <indiccd.h>
 #include <dc1394/dc1394.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.h"
+#include "capability_cache.h"
+#include "calibration.h"
+#include "hot_pixels.h"
+#include "star_detect.h"
+#include "event_capture.h"
+#include "frame_log.h"
+#include "ser_recorder.h"
+#include "frame_shm.h"
+#include "fits_compress.h"
 
 using namespace std;
 
 class DC1394_PGREY: public INDI::CCD
 {
 public:
-    DC1394_PGREY();
+    /* guid is the camera this device drives, 0 for the first one found.
+     * With several cameras each device is named after its GUID. */
+    DC1394_PGREY(uint64_t guid = 0, bool nameByGUID = false);
 
     bool ISNewNumber (const char *dev, const char *name, double values[], char *names[], int n);
     virtual bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n);
+    bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n);
     void ISGetProperties(const char *dev);
 
+    // One dc1394 context shared by every camera in the process
+    static dc1394_t *acquireContext();
+    static void releaseContext();
+
 protected:
     // General device functions
     bool Connect();
@@ -42,14 +63,19 @@ protected:
     const char *getDefaultName();
     bool initProperties();
     bool updateProperties();
+    bool saveConfigItems(FILE *fp);
 
     // CCD specific functions
     bool StartExposure(float duration);
     bool AbortExposure();
+    bool StartStreaming();
+    bool StopStreaming();
     void TimerHit();
     /*void addFITSKeywords(fitsfile *fptr, CCDChip *targetChip);*/
-    void addFITSKeywords(INDI::CCDChip *targetChip);
+    void addFITSKeywords(INDI::CCDChip *targetChip, std::vector<INDI::FITSRecord> &fitsKeywords);
+    bool UpdateCCDFrame(int x, int y, int w, int h);
     bool UpdateCCDBin(int binx, int biny);
+    bool ExposureComplete(INDI::CCDChip *targetChip);
 
     IPState GuideNorth(float ms);
     IPState GuideSouth(float ms);
@@ -58,28 +84,153 @@ protected:
 
 private:
     // Utility functions
+    bool  openCamera();
+    void  closeCamera();
     float CalcTimeLeft();
     void  setupParams();
-    void  grabImage();
+    void  grabImage(dc1394video_frame_t *frame);
+    void  stackFrame(dc1394video_frame_t *frame);
+    void  buildFrame(dc1394video_frame_t *frame);
+    void  publishFrameTiming();
+
+    // Calibration of finished exposures against master frames
+    void  calibrateFrame();
+    void  recordMaster();
+    void  correctHotPixels(uint8_t *image, uint8_t bpp);
+    void  learnBadPixels(const MasterKey &key, const float *data);
+    bool  measureFrame(const uint8_t *image, uint8_t bpp);
+    uint32_t saturationLevel(uint8_t bpp);
+    void  findStars(const uint8_t *image, uint8_t bpp);
+    bool  luckyFrame(const uint8_t *image, uint8_t bpp);
+    void  captureEvent(const uint8_t *image, uint8_t bpp);
+    void  recordFrame(const uint8_t *image);
+    double streamFrameTime();
+    void  publishFrameStatistics(const uint8_t *image, uint8_t bpp);
     float GetTemperature();
+    void  flushCapture();
+    size_t convertFrame(dc1394video_frame_t *frame, uint8_t *dst);
+    uint8_t outputBPP();
+    void  updateStreamFormat();
+    bool  setColorCoding(dc1394color_coding_t coding);
+    bool  setTriggerMode(int mode);
+    bool  configureFormat7(dc1394video_mode_t mode, dc1394color_coding_t coding, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+    bool  applySubframe(int x, int y, int w, int h);
+    void  negotiateBusSpeed();
+    bool  applyPacketSize();
+    void  trackBandwidth(dc1394video_frame_t *frame, bool corrupt);
+
+    // Capture thread
+    bool  startCaptureThread();
+    void  stopCaptureThread();
+    void  captureLoop();
+    void  releaseFrame(dc1394video_frame_t *frame);
+    void  processFrames();
+    static void frameCallbackHelper(int fd, void *context);
+    static void compressCallbackHelper(int fd, void *context);
 
     // Are we exposing?
     bool InExposure;
     bool capturing;
-    // Struct to keep timing
-    struct timeval ExpStart;
+    // Exposure time is up, waiting for the frame to arrive
+    bool downloading;
+    // Monotonic start of the running exposure
+    struct timespec ExpStart;
+    // Wall clock time the host started it, to compare with what the camera says
+    struct timeval ExpStartWall;
+
+    /* When and how a frame was taken. Times are UTC seconds since the epoch.
+     * With the bus cycle timer the camera's own timestamp places the exposure
+     * to well under a millisecond; without it the host arrival time is walked
+     * back over the transfer and the exposure. */
+    struct FrameTiming
+    {
+        bool valid;
+        bool embedded;          // the camera's embedded image info was read
+        bool cycleSync;         // start derived from the bus cycle timer
+        uint32_t frameCounter;
+        uint32_t shutterRaw;
+        uint32_t gainRaw;
+        double start;
+        double mid;
+        double hostOffset;      // start minus ExpStartWall
+    };
+    bool  enableEmbeddedInfo();
+    void  timeFrame(dc1394video_frame_t *frame, FrameTiming &t);
+    FrameTiming frameTiming;
+
+    /* Exposures longer than the shutter allows are taken as a stack of equal
+     * sub-exposures, summed as they arrive into the frame buffer, which holds
+     * 32-bit pixels for the purpose */
+    uint32_t stackTotal;        // sub-exposures in the running exposure, 1 when not stacking
+    uint32_t stackDone;
+    double stackStart;          // start of the first sub-exposure
+    std::vector<uint8_t> stackScratch;  // one software binned sub-exposure
+
+    /* Recording a master from several frames: the exposure is repeated
+     * buildTotal times, the frames kept at 16 bits and combined per pixel */
+    uint32_t buildTotal;        // frames in the running exposure, 1 when not building
+    uint32_t buildDone;
+    std::vector<uint16_t> buildFrames;
+    uint32_t embeddedBytes;     // leading image bytes the camera overwrites, 0 when off
+    bool cycleTimerAvailable;
 
     float ExposureRequest;
     float TemperatureRequest;
     int   timerID;
     
+    // Current Format7 region of interest
+    uint32_t roiX;
+    uint32_t roiY;
     uint32_t width;
     uint32_t height;
+
+    // Sensor size, in pixels of selected_mode
+    uint32_t maxWidth;
+    uint32_t maxHeight;
+
+    bool readFormat7Geometry(dc1394video_mode_t mode, Format7Geometry &g);
+    void findBinnedModes(const dc1394video_modes_t &modes);
+
+    /* Binning, indexed by factor. geometry[1] is selected_mode; other factors
+     * only have a geometry when the camera offers a binned Format7 mode for
+     * them, otherwise frames are binned in software. */
+    static const int MAX_BIN = 4;
+    Format7Geometry geometry[MAX_BIN + 1];
+    bool hardwareBin[MAX_BIN + 1];
+    uint32_t binning;
+    dc1394video_mode_t captureMode;
     
     float gain_min;
     float gain_max;
+    float shutter_min;
+    float shutter_max;
+
+    // Shutter register writes are skipped when the exposure time repeats
+    bool setShutter(float seconds);
+    float shutterRequest;       // last value written, negative when unknown
+    float shutterValue;         // what the camera made of it
+    bool setGain(float dB);
+
+    /* Auto exposure steers shutter (and gain) from each frame's median. Both
+     * registers are written together, only on a real change, and the frames
+     * still in flight with the old settings are not judged. */
+    void autoExpose();
+    float aeShutter;            // shutter the controller wants, 0 until it has one
+    uint32_t aeSettle;          // frames to let pass before judging again
+    ISwitch AutoExposureS[3];
+    ISwitchVectorProperty AutoExposureSP;
+    INumber AutoExposureN[3];
+    INumberVectorProperty AutoExposureNP;
+
+    // Capabilities are probed on first contact and reused from disk afterwards
+    bool probeCapabilities(CameraCapabilities &caps);
+    bool verifyCapabilities(const CameraCapabilities &caps);
+    void applyCapabilities(const CameraCapabilities &caps);
+    bool capabilitiesCached;
     
     dc1394video_mode_t selected_mode;
+    dc1394color_coding_t colorCoding;
+    uint8_t bitsPerPixel;
     
     bool temperatureCanRead;
     INumberVectorProperty SettingsNP;
@@ -88,10 +239,201 @@ private:
     // We declare the CCD temperature property
     INumber TemperatureN[1];
     INumberVectorProperty TemperatureNP;
+
+    ISwitch PixelFormatS[2];
+    ISwitchVectorProperty PixelFormatSP;
+
+    /* Free running toggles transmission for every exposure. In the triggered
+     * modes transmission stays on and the camera only sends a frame when a
+     * trigger fires, so exposures need no flush or restart. */
+    ISwitch TriggerModeS[3];
+    ISwitchVectorProperty TriggerModeSP;
+    int triggerMode;            // mode the camera registers are in
+
+    INumber BandwidthN[3];
+    INumberVectorProperty BandwidthNP;
+
+    INumber TimingN[3];
+    INumberVectorProperty TimingNP;
+
+    CalibrationLibrary calibration;
+    ISwitch CalibrationS[3];
+    ISwitchVectorProperty CalibrationSP;
+    IText CalibrationT[2];
+    ITextVectorProperty CalibrationTP;
+    INumber MasterN[2];
+    INumberVectorProperty MasterNP;
+    ISwitch MasterCombineS[2];
+    ISwitchVectorProperty MasterCombineSP;
+
+    INumber StatisticsN[9];
+    INumberVectorProperty StatisticsNP;
+    INumber HistogramN[32];
+    INumberVectorProperty HistogramNP;
+    std::vector<uint32_t> histogram;
+    uint32_t fullScale;         // saturation level of the last measured frame
+
+    ISwitch StarDetectionS[2];
+    ISwitchVectorProperty StarDetectionSP;
+    INumber StarSettingsN[2];
+    INumberVectorProperty StarSettingsNP;
+    INumber StarFieldN[4];
+    INumberVectorProperty StarFieldNP;
+    INumber GuideStarN[5];
+    INumberVectorProperty GuideStarNP;
+
+    /* Lucky imaging only lets stream frames through that are sharper than
+     * a running percentile of the last few hundred; the scores of those are
+     * kept in a ring */
+    void resetLucky();
+    std::vector<float> luckyScores;
+    std::vector<float> luckyScratch;
+    uint32_t luckyNext;
+    uint32_t luckyScored;
+    uint32_t luckyPassed;
+    struct timespec luckyPublished;
+    ISwitch LuckyS[2];
+    ISwitchVectorProperty LuckySP;
+    INumber LuckySettingsN[2];
+    INumberVectorProperty LuckySettingsNP;
+    INumber LuckyStatsN[4];
+    INumberVectorProperty LuckyStatsNP;
+
+    /* Event capture keeps the last seconds of the stream in memory and saves
+     * them, with what follows, when a frame changes suddenly or a client
+     * triggers it */
+    bool startEvents();
+    void reportEvents();
+    EventRecorder events;
+    uint32_t eventCount;
+    struct timespec eventPublished;
+    ISwitch EventS[2];
+    ISwitchVectorProperty EventSP;
+    ISwitch EventTriggerS[1];
+    ISwitchVectorProperty EventTriggerSP;
+    INumber EventSettingsN[4];
+    INumberVectorProperty EventSettingsNP;
+    IText EventDirT[1];
+    ITextVectorProperty EventDirTP;
+    INumber EventStatusN[4];
+    INumberVectorProperty EventStatusNP;
+
+    /* The timing log is for occultations: the capture thread appends every
+     * frame with its time and frame counter to a memory-mapped log and
+     * hands the buffer straight back to the DMA ring, so nothing on the
+     * event loop can hold up the camera. */
+    bool startTimingLog();
+    void stopTimingLog();
+    void publishTimingLog();
+    void logFrame(dc1394video_frame_t *frame);
+    FrameLog frameLog;
+    std::atomic<bool> logging;
+    std::atomic<bool> logFailed;
+    std::atomic<uint32_t> logDropped;
+    // Capture thread only
+    bool logFirst;
+    uint32_t logLastCounter;
+    uint64_t logLastTimestamp;
+    double logPeriod;           // microseconds between frames, for hosts without the frame counter
+    // Event loop only, for the frame rate
+    uint32_t logRateFrames;
+    struct timespec logRateStart;
+    ISwitch TimingLogS[2];
+    ISwitchVectorProperty TimingLogSP;
+    INumber TimingLogN[1];
+    INumberVectorProperty TimingLogNP;
+    IText TimingLogDirT[1];
+    ITextVectorProperty TimingLogDirTP;
+    INumber TimingLogStatusN[4];
+    INumberVectorProperty TimingLogStatusNP;
+
+    // SER recording of the frames that go out on the stream
+    bool startSer();
+    void stopSer();
+    void publishSer();
+    SerRecorder ser;
+    uint32_t serReportedBehind;
+    struct timespec serPublished;
+    ISwitch SerS[2];
+    ISwitchVectorProperty SerSP;
+    ISwitch SerDirectS[2];
+    ISwitchVectorProperty SerDirectSP;
+    INumber SerSettingsN[1];
+    INumberVectorProperty SerSettingsNP;
+    IText SerDirT[1];
+    ITextVectorProperty SerDirTP;
+    INumber SerStatusN[4];
+    INumberVectorProperty SerStatusNP;
+
+    // Exposures handed to local clients through shared memory
+    bool openShm();
+    bool publishShm();
+    FrameShm frameShm;
+    char shmDescriptor[256];
+    ISwitch ShmS[2];
+    ISwitchVectorProperty ShmSP;
+    INumber ShmSettingsN[1];
+    INumberVectorProperty ShmSettingsNP;
+    IBLOB ShmFrameB;
+    IBLOBVectorProperty ShmFrameBP;
+
+    // Tile compressed FITS for clients, compressed while the next exposure runs
+    bool completeLocally(INDI::CCDChip *targetChip);
+    bool startCompression();
+    void stopCompression();
+    bool compressFrame();
+    void sendCompressed();
+    FitsCompressor compressor;
+    int compressCallbackID;
+    ISwitch CompressionS[3];
+    ISwitchVectorProperty CompressionSP;
+    INumber CompressionSettingsN[1];
+    INumberVectorProperty CompressionSettingsNP;
+    INumber CompressionStatusN[2];
+    INumberVectorProperty CompressionStatusNP;
+
+    HotPixelMap hotPixels;
+    ISwitch HotPixelS[2];
+    ISwitchVectorProperty HotPixelSP;
+    // Masters applied to the frame being delivered, empty when none
+    std::string appliedDark;
+    std::string appliedFlat;
+
+    // Format7 packet size negotiation
+    uint32_t packetSize;
+    uint32_t packetUnit;
+    uint32_t packetMax;
+    uint32_t packetLimit;       // ceiling learned from corrupt frames, 0 when none
+    bool retunePending;
+    int corruptFrames;
+    int windowFrames;
+    uint64_t rateBytes;
+    struct timeval rateStart;
     
+    ITextVectorProperty GuidTP;
+    IText GuidT[1];
+    uint64_t cameraGUID;
+    uint64_t connectedGUID;
+
+    static dc1394_t *context;
+    static int contextUsers;
+
     dc1394_t *dc1394;
     dc1394camera_t *dcam;
 
+    /* The capture thread owns the DMA ring: it is the only one calling
+     * dc1394_capture_dequeue/enqueue. Filled frames go to the event loop
+     * through readyFrames, and come back through releasedFrames once the
+     * event loop is done with them. */
+    static const uint32_t DMA_BUFFERS = 5;
+    std::thread captureThread;
+    std::atomic<bool> captureQuit;
+    SPSCQueue<dc1394video_frame_t *, 8> readyFrames;
+    SPSCQueue<dc1394video_frame_t *, 8> releasedFrames;
+    int notifyPipe[2];      // capture thread -> event loop
+    int wakePipe[2];        // event loop -> capture thread
+    int frameCallbackID;
+
 };
 
 #endif // DC1394_PGREY_H
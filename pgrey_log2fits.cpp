@@ -0,0 +1,141 @@
+/**
+ * Converts binary frame logs of the Point Grey dc1394 driver to FITS
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "frame_log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fitsio.h>
+
+/* Usage: pgrey_log2fits log.pglog [out.fits]
+ *
+ * Writes the frames as a FITS cube, followed by a FRAMES table with the
+ * start, host timestamp, camera frame counter and dropped count of each.
+ * Logs that were never closed are read up to their last complete record. */
+
+static void writeFrame(fitsfile *fptr, const FrameLogHeader &header, const uint8_t *frame, size_t index, int *status)
+{
+    size_t npix = (size_t)header.width * header.height;
+    long naxes[3] = { (long)header.width, (long)header.height, (long)index + 1 };
+
+    // The cube grows a frame at a time so a log never has to fit in memory
+    fits_resize_img(fptr, header.bpp == 8 ? BYTE_IMG : USHORT_IMG, 3, naxes, status);
+    if (header.bpp == 8)
+    {
+        fits_write_img(fptr, TBYTE, (LONGLONG)index * npix + 1, npix, (void *)frame, status);
+    }
+    else
+    {
+        std::vector<uint16_t> samples(npix);
+        for (size_t j = 0; j < npix; j++)
+            samples[j] = header.bigEndian ? (frame[2 * j] << 8) | frame[2 * j + 1] : ((const uint16_t *)frame)[j];
+        fits_write_img(fptr, TUSHORT, (LONGLONG)index * npix + 1, npix, &samples[0], status);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FrameLogHeader header;
+    std::string out;
+    FILE *fp;
+    fitsfile *fptr = NULL;
+    int status = 0;
+
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: %s log.pglog [out.fits]\n", argv[0]);
+        return 2;
+    }
+    out = argc == 3 ? argv[2] : std::string(argv[1]) + ".fits";
+
+    fp = fopen(argv[1], "rb");
+    if (!fp)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, FRAME_LOG_MAGIC, sizeof(header.magic)) ||
+            (header.bpp != 8 && header.bpp != 16) || header.frameBytes < (size_t)header.width * header.height * (header.bpp / 8))
+    {
+        fprintf(stderr, "%s: not a frame log\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    FrameLogRecord record;
+    std::vector<uint8_t> frame(header.frameBytes);
+    std::vector<double> start, timestamp;
+    std::vector<long> counter, dropped;
+    long naxes[3] = { (long)header.width, (long)header.height, 1 };
+    double shutter = header.shutter, gain = header.gain;
+    long x = header.x, y = header.y;
+
+    fits_create_file(&fptr, ("!" + out).c_str(), &status);
+    fits_create_img(fptr, header.bpp == 8 ? BYTE_IMG : USHORT_IMG, 3, naxes, &status);
+    fits_update_key(fptr, TDOUBLE, "EXPTIME", &shutter, "Total Exposure Time (s)", &status);
+    fits_update_key(fptr, TDOUBLE, "GAIN", &gain, "Gain", &status);
+    fits_update_key(fptr, TLONG, "XORGSUBF", &x, "Subframe X position", &status);
+    fits_update_key(fptr, TLONG, "YORGSUBF", &y, "Subframe Y position", &status);
+
+    while ((!header.frames || start.size() < header.frames) && !status &&
+            fread(&record, sizeof(record), 1, fp) == 1 && fread(&frame[0], 1, frame.size(), fp) == frame.size())
+    {
+        // Space reserved past the end of a log that was not closed reads as zeros
+        if (!record.timestamp)
+            break;
+        writeFrame(fptr, header, &frame[0], start.size(), &status);
+        start.push_back(record.start);
+        timestamp.push_back(record.timestamp);
+        counter.push_back(record.frameCounter);
+        dropped.push_back(record.dropped);
+    }
+    fclose(fp);
+
+    size_t n = start.size();
+    if (!n)
+    {
+        fits_close_file(fptr, &status);
+        remove(out.c_str());
+        fprintf(stderr, "%s: no frames\n", argv[1]);
+        return 1;
+    }
+
+    char *ttype[] = { (char *)"START", (char *)"TIMESTAMP", (char *)"FRAMECNT", (char *)"DROPPED" };
+    char *tform[] = { (char *)"1D", (char *)"1D", (char *)"1K", (char *)"1J" };
+    char *tunit[] = { (char *)"s", (char *)"us", (char *)"", (char *)"" };
+    fits_create_tbl(fptr, BINARY_TBL, n, 4, ttype, tform, tunit, "FRAMES", &status);
+    fits_write_comment(fptr, "START is the UTC exposure start in seconds since 1970", &status);
+    fits_write_col(fptr, TDOUBLE, 1, 1, 1, n, &start[0], &status);
+    fits_write_col(fptr, TDOUBLE, 2, 1, 1, n, &timestamp[0], &status);
+    fits_write_col(fptr, TLONG, 3, 1, 1, n, &counter[0], &status);
+    fits_write_col(fptr, TLONG, 4, 1, 1, n, &dropped[0], &status);
+    fits_close_file(fptr, &status);
+
+    if (status)
+    {
+        char text[FLEN_STATUS];
+        fits_get_errstatus(status, text);
+        fprintf(stderr, "%s: %s\n", out.c_str(), text);
+        return 1;
+    }
+    printf("%u frames written to %s\n", (unsigned int)n, out.c_str());
+    return 0;
+}
@@ -0,0 +1,297 @@
+/**
+ * SER video recording of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "ser_recorder.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Blocks go to disk whole, so this is also the size of every write
+static const size_t BLOCK_SIZE = 4 << 20;
+// O_DIRECT wants buffers and offsets aligned to the device's blocks, a page covers any of them
+static const size_t BLOCK_ALIGN = 4096;
+// The file is preallocated this far ahead of the writer
+static const uint64_t PREALLOCATE_STEP = 512 << 20;
+
+#pragma pack(push, 1)
+struct SerHeader
+{
+    char fileId[14];
+    int32_t luId;
+    int32_t colorId;
+    int32_t littleEndian;
+    int32_t width;
+    int32_t height;
+    int32_t pixelDepth;
+    int32_t frameCount;
+    char observer[40];
+    char instrument[40];
+    char telescope[40];
+    int64_t dateTime;
+    int64_t dateTimeUTC;
+};
+#pragma pack(pop)
+
+// SER times are .NET ticks: 100 ns units since 0001-01-01
+static int64_t serTicks(double unixTime)
+{
+    return (int64_t)llround(unixTime * 1e7) + 621355968000000000LL;
+}
+
+SerRecorder::SerRecorder()
+    : directIO(false), frames(0), behind(0), failed(false), fd(-1), width(0), height(0), bpp(8), frameBytes(0), startTime(0),
+      fillBlock(-1), fillBytes(0), fillOffset(0), closing(false), bytesWritten(0)
+{
+}
+
+SerRecorder::~SerRecorder()
+{
+    stop();
+    for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+}
+
+bool SerRecorder::start(const std::string &name, uint32_t w, uint32_t h, uint32_t bits, size_t budget, bool direct)
+{
+    size_t count = std::max((size_t)2, budget / BLOCK_SIZE);
+    struct timespec now;
+
+    stop();
+
+    fd = -1;
+    if (direct)
+        fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    // Not every filesystem takes O_DIRECT, the page cache will do there
+    directIO = fd >= 0;
+    if (fd < 0)
+        fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    while (blocks.size() > count)
+    {
+        free(blocks.back());
+        blocks.pop_back();
+    }
+    while (blocks.size() < count)
+    {
+        void *block;
+        if (posix_memalign(&block, BLOCK_ALIGN, BLOCK_SIZE))
+            break;
+        // Touched now so the stream does not take the page faults
+        memset(block, 0, BLOCK_SIZE);
+        blocks.push_back((uint8_t *)block);
+    }
+    if (blocks.size() < 2)
+    {
+        ::close(fd);
+        fd = -1;
+        unlink(name.c_str());
+        return false;
+    }
+
+    path = name;
+    width = w;
+    height = h;
+    bpp = bits;
+    frameBytes = (size_t)w * h * (bits / 8);
+    frames = behind = 0;
+    failed = false;
+    bytesWritten = 0;
+    timestamps.clear();
+    timestamps.reserve(65536);
+    clock_gettime(CLOCK_REALTIME, &now);
+    startTime = now.tv_sec + now.tv_nsec / 1e9;
+
+    full.clear();
+    spare.clear();
+    for (uint32_t i = 1; i < blocks.size(); i++)
+        spare.push_back(i);
+    // The header goes in last, its place is kept at the start of the first block
+    fillBlock = 0;
+    fillOffset = 0;
+    fillBytes = sizeof(SerHeader);
+    memset(blocks[0], 0, sizeof(SerHeader));
+
+    closing = false;
+    writer = std::thread(&SerRecorder::writerLoop, this);
+    return true;
+}
+
+bool SerRecorder::push(const uint8_t *frame, double time)
+{
+    size_t room, done = 0;
+
+    if (fd < 0)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        room = spare.size() * BLOCK_SIZE + (fillBlock >= 0 ? BLOCK_SIZE - fillBytes : 0);
+    }
+    if (room < frameBytes || failed)
+    {
+        behind++;
+        return false;
+    }
+
+    while (done < frameBytes)
+    {
+        size_t n;
+
+        if (fillBlock < 0)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            fillBlock = spare.front();
+            spare.pop_front();
+            fillBytes = 0;
+        }
+
+        n = std::min(frameBytes - done, BLOCK_SIZE - fillBytes);
+        memcpy(blocks[fillBlock] + fillBytes, frame + done, n);
+        fillBytes += n;
+        done += n;
+
+        if (fillBytes == BLOCK_SIZE)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                full.push_back(std::make_pair((uint32_t)fillBlock, fillOffset));
+            }
+            wake.notify_one();
+            fillOffset += BLOCK_SIZE;
+            fillBlock = -1;
+        }
+    }
+
+    timestamps.push_back(serTicks(time));
+    frames++;
+    return true;
+}
+
+double SerRecorder::backlog()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return blocks.empty() ? 0 : full.size() / (double)blocks.size();
+}
+
+void SerRecorder::writerLoop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    uint64_t allocated = 0;
+
+    for (;;)
+    {
+        while (full.empty() && !closing)
+            wake.wait(guard);
+        if (full.empty())
+            break;
+
+        std::pair<uint32_t, uint64_t> job = full.front();
+        full.pop_front();
+        guard.unlock();
+
+        if (!failed)
+        {
+            // Preallocating keeps the file in few extents; a filesystem without fallocate just goes on without
+            if (job.second + BLOCK_SIZE > allocated)
+            {
+                if (fallocate(fd, 0, allocated, PREALLOCATE_STEP) == 0)
+                    allocated += PREALLOCATE_STEP;
+                else
+                    allocated = UINT64_MAX;
+            }
+            if (pwrite(fd, blocks[job.first], BLOCK_SIZE, job.second) == (ssize_t)BLOCK_SIZE)
+                bytesWritten += BLOCK_SIZE;
+            else
+                failed = true;
+        }
+
+        guard.lock();
+        spare.push_back(job.first);
+    }
+}
+
+bool SerRecorder::stop()
+{
+    SerHeader header;
+    struct tm tm;
+    time_t seconds;
+    uint64_t end;
+    int tail;
+    bool ok;
+
+    if (fd < 0)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+    wake.notify_one();
+    writer.join();
+    ::close(fd);
+    fd = -1;
+
+    /* The rest is not block sized, so it goes through the page cache: the
+     * partial last block, the timestamps and finally the header */
+    ok = !failed;
+    tail = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (tail < 0)
+        return false;
+    end = fillOffset;
+    if (fillBlock >= 0 && fillBytes)
+    {
+        ok = ok && pwrite(tail, blocks[fillBlock], fillBytes, fillOffset) == (ssize_t)fillBytes;
+        end += fillBytes;
+    }
+    fillBlock = -1;
+    // Frames and header only, the writer may have preallocated well past them
+    ok = ok && ftruncate(tail, end) == 0;
+    if (!timestamps.empty())
+        ok = ok && pwrite(tail, &timestamps[0], timestamps.size() * sizeof(uint64_t), end) ==
+             (ssize_t)(timestamps.size() * sizeof(uint64_t));
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.fileId, "LUCAM-RECORDER", sizeof(header.fileId));
+    header.colorId = 0;             // MONO
+    /* The flag is read the opposite way round from the specification by
+     * nearly every program that reads SER; 0 is what they take for the
+     * little-endian samples written here */
+    header.littleEndian = 0;
+    header.width = width;
+    header.height = height;
+    header.pixelDepth = bpp;
+    header.frameCount = frames;
+    strncpy(header.instrument, "Point Grey dc1394", sizeof(header.instrument));
+    seconds = (time_t)startTime;
+    localtime_r(&seconds, &tm);
+    header.dateTime = serTicks(startTime + tm.tm_gmtoff);
+    header.dateTimeUTC = serTicks(startTime);
+    ok = ok && pwrite(tail, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+
+    ok = (::close(tail) == 0) && ok;
+    bytesWritten = end + timestamps.size() * sizeof(uint64_t);
+    return ok;
+}
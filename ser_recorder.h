@@ -0,0 +1,101 @@
+/**
+ * SER video recording of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef SER_RECORDER_H
+#define SER_RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Records a stream into a SER file. Frames are copied into large aligned
+ * blocks, which a writer thread puts on disk whole, optionally bypassing
+ * the page cache with O_DIRECT. The file is preallocated ahead of the
+ * writer. The header, the last partial block and the per-frame UTC
+ * timestamps of the trailer are written when recording stops.
+ *
+ * Queuing a frame never waits. When every block is waiting for the disk,
+ * the frame is refused and counted as behind, for the driver to report. */
+class SerRecorder
+{
+public:
+    SerRecorder();
+    ~SerRecorder();
+
+    /* Create path for w x h frames of bpp (8 or 16) bits, with budget bytes
+     * of blocks between the stream and the disk. direct asks for O_DIRECT;
+     * whether it was granted is in directIO. */
+    bool start(const std::string &path, uint32_t w, uint32_t h, uint32_t bpp, size_t budget, bool direct);
+    // Write out what is queued and close the file. Waits for the writer.
+    bool stop();
+
+    // Queue a frame taken at time (UTC seconds)
+    bool push(const uint8_t *frame, double time);
+
+    bool running() const
+    {
+        return fd >= 0;
+    }
+    const std::string &name() const
+    {
+        return path;
+    }
+    // Share of the blocks waiting for the disk
+    double backlog();
+    uint64_t written() const
+    {
+        return bytesWritten;
+    }
+
+    bool directIO;
+    uint32_t frames;
+    uint32_t behind;            // frames refused because the writer was behind
+    std::atomic<bool> failed;
+
+private:
+    void writerLoop();
+
+    std::string path;
+    int fd;
+    uint32_t width, height, bpp;
+    size_t frameBytes;
+    double startTime;
+    std::vector<uint64_t> timestamps;
+
+    std::vector<uint8_t *> blocks;
+    int32_t fillBlock;          // block frames are being copied into, -1 when none
+    size_t fillBytes;
+    uint64_t fillOffset;        // file offset of the fill block
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::pair<uint32_t, uint64_t> > full;   // block and its file offset
+    std::deque<uint32_t> spare;
+    bool closing;
+    std::atomic<uint64_t> bytesWritten;
+    std::thread writer;
+};
+
+#endif // SER_RECORDER_H
@@ -0,0 +1,77 @@
+/**
+ * Lock-free single-producer/single-consumer ring used to pass frames
+ * between the capture thread and the INDI event loop.
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+/* Exactly one thread may call push() and exactly one other thread may call
+ * pop(). Size must be a power of two; one slot is kept free to tell a full
+ * ring from an empty one. */
+template <typename T, size_t Size>
+class SPSCQueue
+{
+    static_assert((Size & (Size - 1)) == 0, "SPSCQueue size must be a power of two");
+
+public:
+    SPSCQueue() : head(0), tail(0) {}
+
+    bool push(const T &item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) & (Size - 1);
+        if (next == head.load(std::memory_order_acquire))
+            return false;
+        slots[t] = item;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = slots[h];
+        head.store((h + 1) & (Size - 1), std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    T slots[Size];
+    /* Keep the indices on separate cache lines so producer and consumer don't
+     * false-share. Padded rather than alignas(64): an over-aligned member
+     * would make the owning class over-aligned, which new does not honour
+     * before C++17. */
+    char pad0[64];
+    std::atomic<size_t> head;
+    char pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char pad2[64 - sizeof(std::atomic<size_t>)];
+};
+
+#endif // SPSC_QUEUE_H
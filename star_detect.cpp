@@ -0,0 +1,340 @@
+/**
+ * Star detection of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "star_detect.h"
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <thread>
+
+// Tiles are square, a band is one row of tiles
+static const uint32_t TILE = 64;
+// Background statistics look at every SAMPLE_STEP-th pixel in both directions
+static const uint32_t SAMPLE_STEP = 4;
+// Components bigger than this fraction of the frame are nebulosity or gradients
+static const uint32_t MAX_AREA_FRACTION = 50;
+
+// A horizontal run of pixels above the threshold, with its share of the moments
+struct Run
+{
+    uint32_t y, x0, x1;
+    uint32_t parent;
+    double sum, sumX, sumY;
+    float peak;
+    bool saturated;
+};
+
+// Per band: tile backgrounds and noise, and the runs found
+struct Band
+{
+    std::vector<float> background;
+    std::vector<float> noise;
+    std::vector<Run> runs;
+};
+
+static uint32_t findRoot(std::vector<Run> &runs, uint32_t i)
+{
+    while (runs[i].parent != i)
+    {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+static void unite(std::vector<Run> &runs, uint32_t a, uint32_t b)
+{
+    a = findRoot(runs, a);
+    b = findRoot(runs, b);
+    if (a != b)
+        runs[std::max(a, b)].parent = std::min(a, b);
+}
+
+// 8-connected: touching or diagonal neighbours on adjacent rows
+static inline bool overlaps(const Run &a, const Run &b)
+{
+    return a.x0 <= b.x1 + 1 && b.x0 <= a.x1 + 1;
+}
+
+// Join runs of row range [curStart, curEnd) with those of the row above, [prevStart, prevEnd)
+static void linkRows(std::vector<Run> &runs, size_t prevStart, size_t prevEnd, size_t curStart, size_t curEnd)
+{
+    size_t p = prevStart;
+
+    for (size_t c = curStart; c < curEnd; c++)
+    {
+        // Both rows are sorted by x, skip what ends left of this run
+        while (p < prevEnd && runs[p].x1 + 1 < runs[c].x0)
+            p++;
+        for (size_t q = p; q < prevEnd && runs[q].x0 <= runs[c].x1 + 1; q++)
+            if (overlaps(runs[q], runs[c]))
+                unite(runs, q, c);
+    }
+}
+
+template <typename T>
+static void tileStatistics(const T *px, uint32_t w, uint32_t x0, uint32_t y0, uint32_t tw, uint32_t th, std::vector<float> &sample,
+                           float &background, float &noise)
+{
+    size_t mid;
+
+    sample.clear();
+    for (uint32_t y = y0; y < y0 + th; y += SAMPLE_STEP)
+        for (uint32_t x = x0; x < x0 + tw; x += SAMPLE_STEP)
+            sample.push_back(px[(size_t)y * w + x]);
+
+    mid = sample.size() / 2;
+    std::nth_element(sample.begin(), sample.begin() + mid, sample.end());
+    background = sample[mid];
+    for (size_t i = 0; i < sample.size(); i++)
+        sample[i] = fabsf(sample[i] - background);
+    std::nth_element(sample.begin(), sample.begin() + mid, sample.end());
+    // A perfectly flat tile would make every pixel above the background a detection
+    noise = std::max(1.0f, 1.4826f * sample[mid]);
+}
+
+template <typename T>
+static void processBand(const T *px, uint32_t w, uint32_t h, uint32_t y0, const StarDetectParams &params, Band &band)
+{
+    uint32_t y1 = std::min(h, y0 + TILE);
+    uint32_t tiles = (w + TILE - 1) / TILE;
+    std::vector<float> sample, threshold(tiles);
+    size_t prevStart = 0, prevEnd = 0;
+
+    band.background.resize(tiles);
+    band.noise.resize(tiles);
+    band.runs.clear();
+    for (uint32_t t = 0; t < tiles; t++)
+    {
+        uint32_t x0 = t * TILE;
+        tileStatistics(px, w, x0, y0, std::min(TILE, w - x0), y1 - y0, sample, band.background[t], band.noise[t]);
+        threshold[t] = band.background[t] + params.sigma * band.noise[t];
+    }
+
+    for (uint32_t y = y0; y < y1; y++)
+    {
+        const T *row = px + (size_t)y * w;
+        size_t rowStart = band.runs.size();
+        uint32_t x = 0;
+
+        while (x < w)
+        {
+            uint32_t t = x / TILE;
+            if (row[x] <= threshold[t])
+            {
+                x++;
+                continue;
+            }
+
+            Run r;
+            r.y = y;
+            r.x0 = x;
+            r.parent = band.runs.size();
+            r.sum = r.sumX = r.sumY = 0;
+            r.peak = 0;
+            r.saturated = false;
+            while (x < w && row[x] > threshold[x / TILE])
+            {
+                float v = row[x] - band.background[x / TILE];
+                r.sum += v;
+                r.sumX += v * x;
+                r.peak = std::max(r.peak, v);
+                r.saturated |= row[x] >= params.saturation;
+                x++;
+            }
+            r.x1 = x - 1;
+            r.sumY = r.sum * y;
+            band.runs.push_back(r);
+        }
+
+        if (y > y0)
+            linkRows(band.runs, prevStart, prevEnd, rowStart, band.runs.size());
+        prevStart = rowStart;
+        prevEnd = band.runs.size();
+    }
+}
+
+// Half flux radius over a circle around the centroid, background subtracted
+template <typename T>
+static double halfFluxRadius(const T *px, uint32_t w, uint32_t h, const Star &star, double radius, float background)
+{
+    int x0 = std::max(0, (int)floor(star.x - radius)), x1 = std::min((int)w - 1, (int)ceil(star.x + radius));
+    int y0 = std::max(0, (int)floor(star.y - radius)), y1 = std::min((int)h - 1, (int)ceil(star.y + radius));
+    double sum = 0, sumR = 0;
+
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            double dx = x - star.x, dy = y - star.y;
+            double r = sqrt(dx * dx + dy * dy);
+            double v = px[(size_t)y * w + x] - background;
+            if (r <= radius && v > 0)
+            {
+                sum += v;
+                sumR += v * r;
+            }
+        }
+    }
+    return sum > 0 ? sumR / sum : 0;
+}
+
+template <typename T>
+static void detect(const T *px, uint32_t w, uint32_t h, const StarDetectParams &params, StarField &field)
+{
+    uint32_t bands = (h + TILE - 1) / TILE;
+    uint32_t tiles = (w + TILE - 1) / TILE;
+    uint32_t maxArea = std::max<uint32_t>(params.minArea, (uint32_t)((size_t)w * h / MAX_AREA_FRACTION));
+    std::vector<Band> band(bands);
+    std::vector<Run> runs;
+    std::vector<size_t> base(bands);
+    std::vector<float> all;
+    std::atomic<uint32_t> next(0);
+    size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), bands);
+    std::vector<std::thread> threads;
+
+    field.stars.clear();
+    field.background = field.noise = 0;
+    if (w == 0 || h == 0)
+        return;
+
+    // Bands are independent until they are stitched
+    auto work = [&]()
+    {
+        uint32_t b;
+        while ((b = next++) < bands)
+            processBand(px, w, h, b * TILE, params, band[b]);
+    };
+    for (size_t i = 1; i < workers; i++)
+        threads.push_back(std::thread(work));
+    work();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    // One run list with global labels, then join the last row of each band to the first of the next
+    for (uint32_t b = 0; b < bands; b++)
+    {
+        base[b] = runs.size();
+        for (size_t i = 0; i < band[b].runs.size(); i++)
+        {
+            runs.push_back(band[b].runs[i]);
+            runs.back().parent += base[b];
+        }
+    }
+    for (uint32_t b = 1; b < bands; b++)
+    {
+        uint32_t edge = b * TILE;
+        size_t prevEnd = base[b], prevStart = prevEnd, curStart = base[b], curEnd = curStart;
+        while (prevStart > base[b - 1] && runs[prevStart - 1].y == edge - 1)
+            prevStart--;
+        while (curEnd < runs.size() && runs[curEnd].y == edge)
+            curEnd++;
+        linkRows(runs, prevStart, prevEnd, curStart, curEnd);
+    }
+
+    // Sum the moments of every component at its root
+    struct Blob
+    {
+        double sum, sumX, sumY;
+        float peak;
+        uint32_t area;
+        uint32_t x0, x1, y0, y1;
+        bool saturated;
+    };
+    std::vector<int> blobOf(runs.size(), -1);
+    std::vector<Blob> blobs;
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        uint32_t root = findRoot(runs, i);
+        const Run &r = runs[i];
+        if (blobOf[root] < 0)
+        {
+            Blob nb = { 0, 0, 0, 0, 0, r.x0, r.x1, r.y, r.y, false };
+            blobOf[root] = blobs.size();
+            blobs.push_back(nb);
+        }
+        Blob &bl = blobs[blobOf[root]];
+        bl.sum += r.sum;
+        bl.sumX += r.sumX;
+        bl.sumY += r.sumY;
+        bl.peak = std::max(bl.peak, r.peak);
+        bl.area += r.x1 - r.x0 + 1;
+        bl.x0 = std::min(bl.x0, r.x0);
+        bl.x1 = std::max(bl.x1, r.x1);
+        bl.y0 = std::min(bl.y0, r.y);
+        bl.y1 = std::max(bl.y1, r.y);
+        bl.saturated |= r.saturated;
+    }
+
+    for (uint32_t b = 0; b < bands; b++)
+        all.insert(all.end(), band[b].background.begin(), band[b].background.end());
+    std::nth_element(all.begin(), all.begin() + all.size() / 2, all.end());
+    field.background = all[all.size() / 2];
+    all.clear();
+    for (uint32_t b = 0; b < bands; b++)
+        all.insert(all.end(), band[b].noise.begin(), band[b].noise.end());
+    std::nth_element(all.begin(), all.begin() + all.size() / 2, all.end());
+    field.noise = all[all.size() / 2];
+
+    for (size_t i = 0; i < blobs.size(); i++)
+    {
+        const Blob &bl = blobs[i];
+        if (bl.area < params.minArea || bl.area > maxArea || bl.sum <= 0 || bl.x0 == 0 || bl.y0 == 0 || bl.x1 == w - 1 || bl.y1 == h - 1)
+            continue;
+
+        Star s;
+        s.x = bl.sumX / bl.sum;
+        s.y = bl.sumY / bl.sum;
+        s.flux = bl.sum;
+        s.peak = bl.peak;
+        s.area = bl.area;
+        s.saturated = bl.saturated;
+        s.hfr = 0;
+        s.snr = 0;
+        field.stars.push_back(s);
+    }
+    std::sort(field.stars.begin(), field.stars.end(), [](const Star & a, const Star & b)
+    {
+        return a.flux > b.flux;
+    });
+    if (field.stars.size() > params.maxStars)
+        field.stars.resize(params.maxStars);
+
+    for (size_t i = 0; i < field.stars.size(); i++)
+    {
+        Star &s = field.stars[i];
+        uint32_t t = std::min((uint32_t)s.y / TILE, bands - 1) * tiles + std::min((uint32_t)s.x / TILE, tiles - 1);
+        float background = band[t / tiles].background[t % tiles];
+        float noise = band[t / tiles].noise[t % tiles];
+        // Wide enough for the wings, a couple of pixels past the thresholded core
+        double radius = 2 * sqrt(s.area / M_PI) + 2;
+
+        s.hfr = halfFluxRadius(px, w, h, s, radius, background);
+        s.snr = s.flux / sqrt(s.flux + s.area * (double)noise * noise);
+    }
+}
+
+void detectStars(const uint8_t *image, uint32_t bpp, uint32_t w, uint32_t h, const StarDetectParams &params, StarField &field)
+{
+    if (bpp == 16)
+        detect((const uint16_t *)image, w, h, params, field);
+    else
+        detect(image, w, h, params, field);
+}
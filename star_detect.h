@@ -0,0 +1,64 @@
+/**
+ * Star detection of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef STAR_DETECT_H
+#define STAR_DETECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Positions are in pixels of the frame as delivered, with the centre of the
+ * first pixel at (0, 0). Flux and peak are above the local background. */
+struct Star
+{
+    double x, y;
+    double flux;
+    double peak;
+    double hfr;                 // half flux radius
+    double snr;
+    uint32_t area;              // pixels above the threshold
+    bool saturated;
+};
+
+struct StarField
+{
+    double background;          // median of the tile backgrounds
+    double noise;               // median of the tile noise estimates
+    std::vector<Star> stars;    // brightest first
+};
+
+struct StarDetectParams
+{
+    float sigma;                // detection threshold above the background, in noise sigma
+    uint32_t minArea;           // smaller blobs are noise or hot pixels
+    uint32_t saturation;        // pixel value regarded as saturated
+    uint32_t maxStars;          // how many of the brightest get an HFR
+};
+
+/* Find the stars in a w x h frame of 8 or 16-bit pixels. The frame is cut
+ * into bands of tiles handled on all cores: per-tile background and noise
+ * (median and MAD), a threshold at background + sigma * noise, and runs of
+ * bright pixels labelled into connected components (8-connected). The
+ * bands are then stitched, and each star gets an intensity weighted
+ * centroid and its half flux radius. Stars touching the frame edge are
+ * dropped. */
+void detectStars(const uint8_t *image, uint32_t bpp, uint32_t w, uint32_t h, const StarDetectParams &params, StarField &field);
+
+#endif // STAR_DETECT_H
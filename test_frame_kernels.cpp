@@ -0,0 +1,515 @@
+/**
+ * Checks of the SIMD pixel kernels of the Point Grey dc1394 driver
+ *
+ * Copyright (C) 2017 Andy Nikolenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "frame_kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/* The SIMD versions must match the scalar reference bit for bit, including
+ * the tail after the last full vector and sources that are not aligned.
+ * Lengths run past a couple of AVX2 vectors so every tail size comes up. */
+static const size_t MAX_LENGTH = 200;
+static const size_t MAX_OFFSET = 7;
+
+// Long enough for the accumulators that are emptied as they go to be emptied several times
+static const size_t LARGE_LENGTH = (1 << 20) + 13;
+
+static unsigned failures;
+
+// variant is the source offset, which masters were applied or the frame count
+static void fail(const char *kernel, size_t n, size_t variant, size_t at)
+{
+    fprintf(stderr, "%s: mismatch at %lu for n = %lu, variant %lu\n", kernel, (unsigned long)at, (unsigned long)n,
+            (unsigned long)variant);
+    failures++;
+}
+
+static void testUnpack()
+{
+    std::vector<uint8_t> src(2 * MAX_LENGTH + MAX_OFFSET);
+    std::vector<uint16_t> out(MAX_LENGTH + 1), ref(MAX_LENGTH + 1);
+    size_t n, offset, i;
+
+    for (i = 0; i < src.size(); i++)
+        src[i] = rand();
+
+    for (offset = 0; offset <= MAX_OFFSET; offset++)
+    {
+        for (n = 0; n <= MAX_LENGTH; n++)
+        {
+            // The element past the end catches a kernel writing too far
+            out.assign(out.size(), 0xbeef);
+            ref.assign(ref.size(), 0xbeef);
+            unpackBigEndian16(&out[0], &src[offset], n);
+            unpackBigEndian16Scalar(&ref[0], &src[offset], n);
+            for (i = 0; i <= n; i++)
+            {
+                if (out[i] != ref[i])
+                {
+                    fail("unpackBigEndian16", n, offset, i);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Straightforward bin x bin average over the source bytes, as the binning
+ * kernels are specified in frame_kernels.h. 8-bit bins are summed instead. */
+static uint16_t binReference(const uint8_t *src, uint32_t x, uint32_t y, uint32_t srcStride, uint32_t bin, uint32_t bytes,
+                             bool bigEndian)
+{
+    uint32_t sum = 0, area = bin * bin, r, c;
+    uint16_t v;
+
+    for (r = 0; r < bin; r++)
+    {
+        for (c = 0; c < bin; c++)
+        {
+            const uint8_t *p = src + (size_t)(y * bin + r) * srcStride + (size_t)(x * bin + c) * bytes;
+            if (bytes == 1)
+                v = p[0];
+            else if (bigEndian)
+                v = (p[0] << 8) | p[1];
+            else
+                memcpy(&v, p, 2);
+            sum += v;
+        }
+    }
+    return bytes == 1 ? sum : (sum + area / 2) / area;
+}
+
+static void checkBinning(const char *kernel, const uint8_t *src, uint32_t w, uint32_t h, uint32_t srcStride, uint32_t bin,
+                         uint32_t bytes, bool bigEndian, size_t offset)
+{
+    uint32_t ow = w / bin, oh = h / bin;
+    // The element past the end catches a kernel writing too far
+    std::vector<uint16_t> out((size_t)ow * oh + 1, 0xbeef);
+    size_t i;
+
+    if (bytes == 1)
+        binSum8(&out[0], src, w, h, srcStride, bin);
+    else
+        binAverage16(&out[0], src, w, h, srcStride, bin, bigEndian);
+
+    for (i = 0; i + 1 < out.size(); i++)
+    {
+        if (out[i] != binReference(src, i % ow, i / ow, srcStride, bin, bytes, bigEndian))
+        {
+            fail(kernel, w, offset, i);
+            return;
+        }
+    }
+    if (out[i] != 0xbeef)
+        fail(kernel, w, offset, i);
+}
+
+/* There is no scalar binning to compare with, so the kernels are checked
+ * against the reference above. Rows are padded like the Format7 strides,
+ * and a row and most widths leave pixels over that must be dropped. */
+static void testBinning()
+{
+    static const char *const kernels[] = { "binSum8", "binAverage16 big-endian", "binAverage16 host order" };
+    const uint32_t wide = 4000;
+    std::vector<uint8_t> src;
+    uint32_t format, bytes, bin, w, h, stride;
+    size_t offset, i;
+
+    for (format = 0; format < 3; format++)
+    {
+        bytes = format ? 2 : 1;
+        for (bin = 2; bin <= 4; bin++)
+        {
+            h = 2 * bin + 1;
+            for (w = 0; w <= MAX_LENGTH; w++)
+            {
+                stride = (w + 3) * bytes;
+                src.resize((size_t)h * stride + MAX_OFFSET);
+                for (i = 0; i < src.size(); i++)
+                    src[i] = rand();
+                for (offset = 0; offset <= MAX_OFFSET; offset++)
+                    checkBinning(kernels[format], &src[offset], w, h, stride, bin, bytes, format == 1, offset);
+            }
+        }
+
+        // Full scale over a sensor wide row, the accumulators must not wrap
+        src.assign((size_t)4 * wide * bytes, 0xFF);
+        checkBinning(kernels[format], &src[0], wide, 4, wide * bytes, 4, bytes, format == 1, 0);
+    }
+}
+
+// stackAdd16 shares its SIMD code with the binning and has no scalar twin
+static void stackAdd16Reference(uint32_t *acc, const uint8_t *src, size_t n, bool bigEndian)
+{
+    uint16_t v;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (bigEndian)
+            v = (src[2 * i] << 8) | src[2 * i + 1];
+        else
+            memcpy(&v, src + 2 * i, 2);
+        acc[i] += v;
+    }
+}
+
+/* The accumulators start from large values, as they are deep into a long
+ * stack, so the adds carry into the upper bytes */
+static void testStackAdd()
+{
+    static const char *const kernels[] = { "stackAdd8", "stackAdd16 big-endian", "stackAdd16 host order" };
+    std::vector<uint8_t> src(2 * MAX_LENGTH + MAX_OFFSET);
+    std::vector<uint32_t> acc(MAX_LENGTH + 1), out, ref;
+    size_t n, offset, i;
+    int format;
+
+    for (i = 0; i < src.size(); i++)
+        src[i] = rand();
+    for (i = 0; i < acc.size(); i++)
+        acc[i] = ((uint32_t)rand() << 8) ^ rand();
+
+    for (format = 0; format < 3; format++)
+    {
+        for (offset = 0; offset <= MAX_OFFSET; offset++)
+        {
+            for (n = 0; n <= MAX_LENGTH; n++)
+            {
+                // acc[n] is left alone by both, so it doubles as the canary
+                out = acc;
+                ref = acc;
+                if (format == 0)
+                {
+                    stackAdd8(&out[0], &src[offset], n);
+                    stackAdd8Scalar(&ref[0], &src[offset], n);
+                }
+                else
+                {
+                    stackAdd16(&out[0], &src[offset], n, format == 1);
+                    stackAdd16Reference(&ref[0], &src[offset], n, format == 1);
+                }
+                for (i = 0; i <= n; i++)
+                {
+                    if (out[i] != ref[i])
+                    {
+                        fail(kernels[format], n, offset, i);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Darks with half-integer values put many results exactly on a tie, which
+ * is where rounding to even and rounding up part ways. Flats around 1 and
+ * darks above the pixel value exercise both clamps. */
+template <typename T>
+static void testCalibrate(const char *kernel, void (*simd)(T *, const float *, const float *, size_t),
+                          void (*scalar)(T *, const float *, const float *, size_t), uint32_t maxValue)
+{
+    std::vector<T> px(MAX_LENGTH + 1), out(MAX_LENGTH + 1), ref(MAX_LENGTH + 1);
+    std::vector<float> dark(MAX_LENGTH), invFlat(MAX_LENGTH);
+    size_t n, i;
+    int masters;
+
+    for (i = 0; i < MAX_LENGTH; i++)
+    {
+        px[i] = rand() % (maxValue + 1);
+        dark[i] = (rand() % 64) * 0.5f;
+        invFlat[i] = i % 3 ? 0.75f + (rand() % 64) / 64.0f : 1.0f;
+    }
+    px[0] = 0;
+    px[1] = maxValue;
+
+    // Dark and flat, dark only, flat only
+    for (masters = 0; masters < 3; masters++)
+    {
+        const float *d = masters != 2 ? &dark[0] : NULL;
+        const float *f = masters != 1 ? &invFlat[0] : NULL;
+
+        for (n = 0; n <= MAX_LENGTH; n++)
+        {
+            out = px;
+            ref = px;
+            simd(&out[0], d, f, n);
+            scalar(&ref[0], d, f, n);
+            for (i = 0; i <= n; i++)
+            {
+                if (out[i] != ref[i])
+                {
+                    fail(kernel, n, masters, i);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Frames of a small spread around a level with occasional outliers, like
+ * darks with hot pixels and cosmic rays, so kappa clipping takes effect.
+ * Every fifth pixel is the same in all frames and has no spread at all.
+ * The frame count decides the sorting network and the median's form. */
+static void testCombine()
+{
+    static const uint32_t counts[] = { 1, 2, 3, 4, 5, 7, 8, 9, 16, 25 };
+    static const uint32_t MAX_FRAMES = 25;
+    std::vector<std::vector<uint16_t> > frames(MAX_FRAMES, std::vector<uint16_t>(MAX_LENGTH + 1 + MAX_OFFSET));
+    std::vector<const uint16_t *> framePtrs(MAX_FRAMES);
+    std::vector<float> out(MAX_LENGTH + 1), ref(MAX_LENGTH + 1);
+    size_t n, offset, i, c;
+    uint32_t k, count;
+    int clipped;
+
+    for (k = 0; k < MAX_FRAMES; k++)
+    {
+        for (i = 0; i < frames[k].size(); i++)
+        {
+            if (i % 5 == 0)
+                frames[k][i] = 1000 + i;
+            else
+                frames[k][i] = rand() % 8 ? 1000 + rand() % 64 : rand() % 65536;
+        }
+        framePtrs[k] = &frames[k][0];
+    }
+
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        count = counts[c];
+        // Median, then the clipped mean
+        for (clipped = 0; clipped < 2; clipped++)
+        {
+            for (n = 0; n <= MAX_LENGTH; n++)
+            {
+                // Pixel offsets into the frames, which leave the loads unaligned
+                offset = n % (MAX_OFFSET + 1);
+                out.assign(out.size(), -1.0f);
+                ref.assign(ref.size(), -1.0f);
+                combine16(&framePtrs[0], count, offset, n, clipped ? 2.5f : 0, &out[0]);
+                combine16Scalar(&framePtrs[0], count, offset, n, clipped ? 2.5f : 0, &ref[0]);
+                for (i = 0; i <= n; i++)
+                {
+                    if (out[i] != ref[i])
+                    {
+                        fail(clipped ? "combine16 clipped" : "combine16 median", n, count, i);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void runFrameStats(bool simd, const uint8_t *px, size_t n, uint32_t, uint32_t *hist, FrameStats &stats)
+{
+    if (simd)
+        frameStats8(px, n, hist, stats);
+    else
+        frameStats8Scalar(px, n, hist, stats);
+}
+
+static void runFrameStats(bool simd, const uint16_t *px, size_t n, uint32_t shift, uint32_t *hist, FrameStats &stats)
+{
+    if (simd)
+        frameStats16(px, n, shift, hist, stats);
+    else
+        frameStats16Scalar(px, n, shift, hist, stats);
+}
+
+// A mismatch in the totals is reported at the number of bins
+template <typename T>
+static void checkFrameStats(const char *kernel, const T *px, size_t n, uint32_t shift, size_t bins, size_t offset)
+{
+    // The bin past the end catches a kernel writing too far
+    std::vector<uint32_t> hist(bins + 1, 0xdeadbeef), refHist(bins + 1, 0xdeadbeef);
+    FrameStats stats, ref;
+    size_t i;
+
+    runFrameStats(true, px, n, shift, &hist[0], stats);
+    runFrameStats(false, px, n, shift, &refHist[0], ref);
+    if (stats.min != ref.min || stats.max != ref.max || stats.sum != ref.sum || stats.sumSquares != ref.sumSquares)
+    {
+        fail(kernel, n, offset, bins);
+        return;
+    }
+    for (i = 0; i <= bins; i++)
+    {
+        if (hist[i] != refHist[i])
+        {
+            fail(kernel, n, offset, i);
+            return;
+        }
+    }
+}
+
+/* The pixel after the last one is set to an extreme that would change the
+ * totals if it were read. The long full-scale frame empties the narrow SIMD
+ * accumulators several times over (every FLUSH_EVERY loop iterations). */
+template <typename T>
+static void testFrameStats(const char *kernel, uint32_t maxValue, uint32_t shift)
+{
+    std::vector<T> px(MAX_LENGTH + MAX_OFFSET + 1), large(LARGE_LENGTH + 1, maxValue);
+    size_t bins = (maxValue + 1) >> shift;
+    size_t n, offset, i;
+    T saved;
+
+    for (i = 0; i < px.size(); i++)
+        px[i] = 1 + rand() % (maxValue - 1);
+
+    for (offset = 0; offset <= MAX_OFFSET; offset++)
+    {
+        for (n = 0; n <= MAX_LENGTH; n++)
+        {
+            saved = px[offset + n];
+            px[offset + n] = n & 1 ? maxValue : 0;
+            checkFrameStats(kernel, &px[offset], n, shift, bins, offset);
+            px[offset + n] = saved;
+        }
+    }
+
+    large[LARGE_LENGTH] = 0;
+    checkFrameStats(kernel, &large[0], LARGE_LENGTH, shift, bins, 0);
+}
+
+static double runLaplacian(bool simd, const uint8_t *px, uint32_t w, uint32_t h, uint32_t)
+{
+    return simd ? laplacianVariance8(px, w, h) : laplacianVariance8Scalar(px, w, h);
+}
+
+static double runLaplacian(bool simd, const uint16_t *px, uint32_t w, uint32_t h, uint32_t shift)
+{
+    return simd ? laplacianVariance16(px, w, h, shift) : laplacianVariance16Scalar(px, w, h, shift);
+}
+
+/* Both versions sum in integers, so the variances must be equal. The pixel
+ * after the frame is an extreme that would show if it were read. The
+ * full-scale checkerboard gives the largest Laplacian on every pixel of
+ * rows as wide as a large sensor's. Mismatches are reported at the height. */
+template <typename T>
+static void testLaplacian(const char *kernel, uint32_t maxValue, uint32_t shift)
+{
+    const uint32_t MAX_HEIGHT = 5, wide = 5000;
+    std::vector<T> px(MAX_LENGTH * MAX_HEIGHT + MAX_OFFSET + 1), large((size_t)wide * 4 + 1);
+    uint32_t w, h;
+    size_t offset, i;
+    T saved;
+
+    for (i = 0; i < px.size(); i++)
+        px[i] = rand() % (maxValue + 1);
+
+    for (offset = 0; offset <= MAX_OFFSET; offset++)
+    {
+        for (h = 0; h <= MAX_HEIGHT; h++)
+        {
+            for (w = 0; w <= MAX_LENGTH; w++)
+            {
+                saved = px[offset + w * h];
+                px[offset + w * h] = w & 1 ? maxValue : 0;
+                if (runLaplacian(true, &px[offset], w, h, shift) != runLaplacian(false, &px[offset], w, h, shift))
+                    fail(kernel, w, offset, h);
+                px[offset + w * h] = saved;
+            }
+        }
+    }
+
+    for (i = 0; i < large.size(); i++)
+        large[i] = (i / wide + i % wide) & 1 ? maxValue : 0;
+    if (runLaplacian(true, &large[0], wide, 4, shift) != runLaplacian(false, &large[0], wide, 4, shift))
+        fail(kernel, wide, 0, 4);
+}
+
+static uint64_t runFrameDifference(bool simd, const uint8_t *a, const uint8_t *b, size_t n)
+{
+    return simd ? frameDifference8(a, b, n) : frameDifference8Scalar(a, b, n);
+}
+
+static uint64_t runFrameDifference(bool simd, const uint16_t *a, const uint16_t *b, size_t n)
+{
+    return simd ? frameDifference16(a, b, n) : frameDifference16Scalar(a, b, n);
+}
+
+/* The two frames are offset differently so their loads are misaligned
+ * against each other, and the pixels after them are as far apart as they
+ * can be. The long full-scale pair fills the 16-bit lanes' blocks of
+ * DIFF_BLOCK16 pixels to their largest sums. */
+template <typename T>
+static void testFrameDifference(const char *kernel, uint32_t maxValue)
+{
+    std::vector<T> a(MAX_LENGTH + MAX_OFFSET + 1), b(MAX_LENGTH + MAX_OFFSET + 1);
+    std::vector<T> largeA(LARGE_LENGTH + 1, maxValue), largeB(LARGE_LENGTH + 1, 0);
+    size_t n, offset, other, i;
+    T savedA, savedB;
+
+    for (i = 0; i < a.size(); i++)
+    {
+        a[i] = rand() % (maxValue + 1);
+        b[i] = rand() % (maxValue + 1);
+    }
+
+    for (offset = 0; offset <= MAX_OFFSET; offset++)
+    {
+        other = (offset * 3) % (MAX_OFFSET + 1);
+        for (n = 0; n <= MAX_LENGTH; n++)
+        {
+            savedA = a[offset + n];
+            savedB = b[other + n];
+            a[offset + n] = maxValue;
+            b[other + n] = 0;
+            if (runFrameDifference(true, &a[offset], &b[other], n) != runFrameDifference(false, &a[offset], &b[other], n))
+                fail(kernel, n, offset, n);
+            a[offset + n] = savedA;
+            b[other + n] = savedB;
+        }
+    }
+
+    largeA[LARGE_LENGTH] = 0;
+    largeB[LARGE_LENGTH] = maxValue;
+    if (runFrameDifference(true, &largeA[0], &largeB[0], LARGE_LENGTH) !=
+            runFrameDifference(false, &largeA[0], &largeB[0], LARGE_LENGTH))
+        fail(kernel, LARGE_LENGTH, 0, LARGE_LENGTH);
+}
+
+int main()
+{
+    srand(1);
+    testUnpack();
+    testBinning();
+    testStackAdd();
+    testCalibrate<uint8_t>("calibrate8", calibrate8, calibrate8Scalar, 255);
+    testCalibrate<uint16_t>("calibrate16", calibrate16, calibrate16Scalar, 65535);
+    testCombine();
+    testFrameStats<uint8_t>("frameStats8", 255, 0);
+    testFrameStats<uint16_t>("frameStats16", 65535, 0);
+    testFrameStats<uint16_t>("frameStats16 shifted", 65535, 4);
+    testLaplacian<uint8_t>("laplacianVariance8", 255, 0);
+    testLaplacian<uint16_t>("laplacianVariance16", 4095, 0);
+    testLaplacian<uint16_t>("laplacianVariance16 shifted", 65535, 4);
+    testFrameDifference<uint8_t>("frameDifference8", 255);
+    testFrameDifference<uint16_t>("frameDifference16", 65535);
+
+    if (failures)
+    {
+        fprintf(stderr, "%u kernel checks failed\n", failures);
+        return 1;
+    }
+    printf("All kernel checks passed\n");
+    return 0;
+}